@@ -0,0 +1,460 @@
+//----------------------------------------------------------------------------------------------------------------------
+/// Benchmark of the whole compositing pipeline. For every BMP size and layer depth it writes two BMPs with
+/// fillBmpHeaderDefaultValues() and a script that loads them, crops both, places them depth times with all blend
+/// modes, prints, saves, undoes half of the layers and saves again. The script is run by the program with --script
+/// and --stats, and one CSV line per run reports the time of every stage, the throughput in megapixels per second and
+/// the peak resident set size of the program.
+///
+/// Build: gcc -O2 -o a4-bench a4-bench.c bmp.c
+/// Usage: ./a4-bench [--binary PATH] [--sizes LIST] [--depths LIST] [--kernels LIST] [--runs N] [--threads N]
+///
+/// Author: 12326821
+//----------------------------------------------------------------------------------------------------------------------
+
+#define _DEFAULT_SOURCE
+
+#include "bmp.h"
+#include "blend.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define BYTE 4
+#define PATH_SIZE 256
+#define LIST_SIZE 16
+#define NANOSECONDS 1e9
+#define MEGAPIXEL 1e6
+#define BENCH_BMPS_COUNT 2
+#define DEFAULT_BINARY "./a4-csf"
+#define DEFAULT_SIZES "256,1024"
+#define DEFAULT_DEPTHS "8,64"
+#define DEFAULT_KERNELS "best"
+#define DEFAULT_RUNS 3
+#define KERNELS_BEST "best"
+#define TEMPORARY_TEMPLATE "/tmp/a4-bench-XXXXXX"
+
+typedef enum _Bench_Stages_
+{
+  BENCH_LOAD,
+  BENCH_CROP,
+  BENCH_PLACE,
+  BENCH_BLEND,
+  BENCH_PRINT,
+  BENCH_SAVE,
+  BENCH_STAGES_COUNT
+} BenchStages;
+
+typedef struct _Bench_Options_
+{
+  const char* binary_;
+  int sizes_[LIST_SIZE];
+  int sizes_count_;
+  int depths_[LIST_SIZE];
+  int depths_count_;
+  char* kernels_[LIST_SIZE];
+  int kernels_count_;
+  int runs_;
+  const char* threads_;
+} BenchOptions;
+
+typedef struct _Bench_Result_
+{
+  double seconds_[BENCH_STAGES_COUNT];
+  uint64_t blended_pixels_;
+  double total_seconds_;
+  long peak_rss_kb_;
+} BenchResult;
+
+static const char* stage_names[BENCH_STAGES_COUNT] = {"load", "crop", "place", "blend", "print", "save"};
+static const char blend_modes[] = {BLEND_MODE_N, BLEND_MODE_M, BLEND_MODE_S, BLEND_MODE_E,
+                                   BLEND_MODE_O, BLEND_MODE_A, BLEND_MODE_D, BLEND_MODE_L};
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Gets the current time.
+/// @return Seconds of a monotonic clock.
+static double getSeconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / NANOSECONDS;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Splits a comma separated list of positive numbers.
+/// @param text The list.
+/// @param numbers Receives the numbers.
+/// @return Count of numbers or 0 if the list is not valid.
+static int parseNumbers(char* text, int numbers[LIST_SIZE])
+{
+  int count = 0;
+  for (char* word = strtok(text, ","); word != NULL; word = strtok(NULL, ","))
+  {
+    if (count == LIST_SIZE || atoi(word) <= 0)
+    {
+      return 0;
+    }
+    numbers[count++] = atoi(word);
+  }
+  return count;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Parses the "--name value" pairs of the benchmark.
+/// @param argc Count of cmd line arguments.
+/// @param argv Holds the cmd line arguments.
+/// @param options Options to fill, defaults are used for everything not given.
+/// @return 0 if every option was valid, 1 if not.
+static int parseOptions(int argc, char* argv[], BenchOptions* options)
+{
+  static char sizes[] = DEFAULT_SIZES;
+  static char depths[] = DEFAULT_DEPTHS;
+  static char kernels[] = DEFAULT_KERNELS;
+  char* sizes_list = sizes;
+  char* depths_list = depths;
+  char* kernels_list = kernels;
+  options->binary_ = DEFAULT_BINARY;
+  options->runs_ = DEFAULT_RUNS;
+  options->threads_ = NULL;
+  for (int index = 1; index < argc; index += 2)
+  {
+    if (index + 1 >= argc)
+    {
+      return 1;
+    }
+    char* value = argv[index + 1];
+    if (strcmp(argv[index], "--binary") == 0)
+    {
+      options->binary_ = value;
+    }
+    else if (strcmp(argv[index], "--sizes") == 0)
+    {
+      sizes_list = value;
+    }
+    else if (strcmp(argv[index], "--depths") == 0)
+    {
+      depths_list = value;
+    }
+    else if (strcmp(argv[index], "--kernels") == 0)
+    {
+      kernels_list = value;
+    }
+    else if (strcmp(argv[index], "--runs") == 0 && atoi(value) > 0)
+    {
+      options->runs_ = atoi(value);
+    }
+    else if (strcmp(argv[index], "--threads") == 0 && atoi(value) > 0)
+    {
+      options->threads_ = value;
+    }
+    else
+    {
+      return 1;
+    }
+  }
+  options->sizes_count_ = parseNumbers(sizes_list, options->sizes_);
+  options->depths_count_ = parseNumbers(depths_list, options->depths_);
+  options->kernels_count_ = 0;
+  for (char* word = strtok(kernels_list, ","); word != NULL && options->kernels_count_ < LIST_SIZE;
+       word = strtok(NULL, ","))
+  {
+    options->kernels_[options->kernels_count_++] = word;
+  }
+  return options->sizes_count_ == 0 || options->depths_count_ == 0 || options->kernels_count_ == 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Writes a square 32-bit BMP with a gradient. The alpha channel has opaque, transparent and half covered
+///        stripes, so the normal mode goes through all of its paths.
+/// @param path Path of the new file.
+/// @param size Width and height.
+/// @param seed Changes the colors, so the BMPs of one size differ.
+/// @return 0 if the file was written, 1 if not.
+static int writeBmp(const char* path, int size, int seed)
+{
+  BmpHeader header;
+  fillBmpHeaderDefaultValues(&header, size, size);
+  unsigned char* pixels = malloc((size_t)size * size * BYTE);
+  FILE* file = fopen(path, "wb");
+  if (pixels == NULL || file == NULL)
+  {
+    free(pixels);
+    if (file != NULL)
+    {
+      fclose(file);
+    }
+    return 1;
+  }
+  for (int y = 0; y < size; y++)
+  {
+    for (int x = 0; x < size; x++)
+    {
+      unsigned char* pixel = pixels + ((size_t)y * size + x) * BYTE;
+      pixel[0] = (unsigned char)(x * 255 / size + seed * 64);
+      pixel[1] = (unsigned char)(y * 255 / size);
+      pixel[2] = (unsigned char)((x ^ y) + seed * 32);
+      int stripe = (x / 16 + y / 16 + seed) % 4;
+      pixel[3] = stripe == 0 ? 0 : stripe == 1 ? (unsigned char)(x + y) : 255;
+    }
+  }
+  int failed = fwrite(&header, sizeof(BmpHeader), 1, file) != 1 ||
+               fwrite(pixels, (size_t)size * size * BYTE, 1, file) != 1;
+  failed |= fclose(file) != 0;
+  free(pixels);
+  return failed;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Writes the script of one size and depth. Layer positions, BMPs and blend modes follow a fixed pattern, so
+///        every run composites the same canvas.
+/// @param path Path of the script.
+/// @param directory Directory of the BMPs and the saved canvas.
+/// @param size Size of the BMPs and the canvas.
+/// @param depth Count of layers to place.
+/// @return 0 if the script was written, 1 if not.
+static int writeScript(const char* path, const char* directory, int size, int depth)
+{
+  FILE* script = fopen(path, "w");
+  if (script == NULL)
+  {
+    return 1;
+  }
+  for (int bmp = 0; bmp < BENCH_BMPS_COUNT; bmp++)
+  {
+    fprintf(script, "load %s/bmp-%d-%d.bmp\n", directory, size, bmp);
+  }
+  // the crops are views into the loaded BMPs, one of them reaches the bottom right corner
+  int half = size / 2 > 0 ? size / 2 : 1;
+  fprintf(script, "crop 0 1 1 %d %d\n", half, half);
+  fprintf(script, "crop 1 %d %d %d %d\n", size - half + 1, size - half + 1, size, size);
+  int modes_count = sizeof(blend_modes) / sizeof(blend_modes[0]);
+  for (int layer = 0; layer < depth; layer++)
+  {
+    int bmp = layer % (2 * BENCH_BMPS_COUNT);
+    int offset = bmp < BENCH_BMPS_COUNT ? 0 : (layer * 37) % half;
+    fprintf(script, "place %d %d %d %c\n", bmp, offset + 1, (offset * 3) % half + 1, blend_modes[layer % modes_count]);
+  }
+  fprintf(script, "print\n");
+  fprintf(script, "save %s/canvas.bmp\n", directory);
+  for (int layer = 0; layer < depth / 2; layer++)
+  {
+    fprintf(script, "undo\n");
+  }
+  fprintf(script, "save %s/canvas.bmp\n", directory);
+  return fclose(script) != 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Reads the CSV the program wrote with --stats.
+/// @param path Path of the stats file.
+/// @param result Receives the seconds of every stage and the composited pixels.
+/// @return 0 if every stage was found, 1 if not.
+static int readStats(const char* path, BenchResult* result)
+{
+  FILE* file = fopen(path, "r");
+  if (file == NULL)
+  {
+    return 1;
+  }
+  char line[PATH_SIZE];
+  int found = 0;
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    char name[32];
+    int calls;
+    double seconds;
+    unsigned long long pixels;
+    if (sscanf(line, "%31[^,],%d,%lf,%llu", name, &calls, &seconds, &pixels) != 4)
+    {
+      continue;
+    }
+    for (int stage = 0; stage < BENCH_STAGES_COUNT; stage++)
+    {
+      if (strcmp(name, stage_names[stage]) == 0)
+      {
+        result->seconds_[stage] = seconds;
+        found++;
+        if (stage == BENCH_BLEND)
+        {
+          result->blended_pixels_ = pixels;
+        }
+      }
+    }
+  }
+  fclose(file);
+  return found != BENCH_STAGES_COUNT;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Runs the program with a script. Output goes to /dev/null, so printing costs the formatting but not a
+///        terminal. The peak resident set size is taken from the rusage of the finished child.
+/// @param options The benchmark options.
+/// @param directory Directory of the script and the stats file.
+/// @param size Canvas size.
+/// @param kernels Value of A4_CSF_BLEND_KERNELS or "best" to leave it unset.
+/// @param result Receives the measurements.
+/// @return 0 if the program ran every command, 1 if not.
+static int runProgram(BenchOptions* options, const char* directory, int size, const char* kernels,
+                      BenchResult* result)
+{
+  char script_path[PATH_SIZE];
+  char stats_path[PATH_SIZE];
+  char canvas_size[16];
+  snprintf(script_path, sizeof(script_path), "%s/script.txt", directory);
+  snprintf(stats_path, sizeof(stats_path), "%s/stats.csv", directory);
+  snprintf(canvas_size, sizeof(canvas_size), "%d", size);
+  char* arguments[] = {(char*)options->binary_, canvas_size, canvas_size, "--script", script_path,
+                       "--stats", stats_path, options->threads_ != NULL ? "--threads" : NULL,
+                       (char*)options->threads_, NULL};
+
+  double start = getSeconds();
+  pid_t child = fork();
+  if (child < 0)
+  {
+    return 1;
+  }
+  if (child == 0)
+  {
+    int null_output = open("/dev/null", O_WRONLY);
+    dup2(null_output, STDOUT_FILENO);
+    if (strcmp(kernels, KERNELS_BEST) == 0)
+    {
+      unsetenv(BLEND_KERNELS_ENVIRONMENT);
+    }
+    else
+    {
+      setenv(BLEND_KERNELS_ENVIRONMENT, kernels, 1);
+    }
+    execv(options->binary_, arguments);
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  if (wait4(child, &status, 0, &usage) != child)
+  {
+    return 1;
+  }
+  result->total_seconds_ = getSeconds() - start;
+  result->peak_rss_kb_ = usage.ru_maxrss;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    fprintf(stderr, "%s exited with status %d\n", options->binary_, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return 1;
+  }
+  return readStats(stats_path, result);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Computes a throughput.
+/// @param pixels Pixels processed.
+/// @param seconds Time it took.
+/// @return Megapixels per second, 0 if nothing was measured.
+static double getThroughput(double pixels, double seconds)
+{
+  return seconds > 0 ? pixels / MEGAPIXEL / seconds : 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Removes the files of the benchmark and its directory.
+/// @param directory The temporary directory.
+/// @param options The benchmark options, used for the BMP names.
+static void removeFiles(const char* directory, BenchOptions* options)
+{
+  char path[PATH_SIZE];
+  const char* names[] = {"script.txt", "stats.csv", "canvas.bmp"};
+  for (size_t name = 0; name < sizeof(names) / sizeof(names[0]); name++)
+  {
+    snprintf(path, sizeof(path), "%s/%s", directory, names[name]);
+    unlink(path);
+  }
+  for (int size = 0; size < options->sizes_count_; size++)
+  {
+    for (int bmp = 0; bmp < BENCH_BMPS_COUNT; bmp++)
+    {
+      snprintf(path, sizeof(path), "%s/bmp-%d-%d.bmp", directory, options->sizes_[size], bmp);
+      unlink(path);
+    }
+  }
+  rmdir(directory);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Main function of the benchmark.
+/// @param argc Count of cmd line arguments.
+/// @param argv Holds the cmd line arguments.
+/// @return 0 if every run passed, 1 if not.
+int main(int argc, char* argv[])
+{
+  BenchOptions options;
+  if (parseOptions(argc, argv, &options) != 0)
+  {
+    fprintf(stderr, "Usage: %s [--binary PATH] [--sizes LIST] [--depths LIST] [--kernels LIST] [--runs N] "
+                    "[--threads N]\n", argv[0]);
+    return 1;
+  }
+  char directory[] = TEMPORARY_TEMPLATE;
+  if (mkdtemp(directory) == NULL)
+  {
+    fprintf(stderr, "Cannot create a temporary directory\n");
+    return 1;
+  }
+
+  int failed = 0;
+  printf("size,depth,kernels,run,load_s,crop_s,place_s,blend_s,print_s,save_s,total_s,"
+         "load_mp_s,blend_mp_s,save_mp_s,peak_rss_kb\n");
+  for (int size_index = 0; size_index < options.sizes_count_ && !failed; size_index++)
+  {
+    int size = options.sizes_[size_index];
+    char path[PATH_SIZE];
+    for (int bmp = 0; bmp < BENCH_BMPS_COUNT && !failed; bmp++)
+    {
+      snprintf(path, sizeof(path), "%s/bmp-%d-%d.bmp", directory, size, bmp);
+      failed = writeBmp(path, size, bmp);
+    }
+    for (int depth_index = 0; depth_index < options.depths_count_ && !failed; depth_index++)
+    {
+      int depth = options.depths_[depth_index];
+      snprintf(path, sizeof(path), "%s/script.txt", directory);
+      failed = writeScript(path, directory, size, depth);
+      for (int kernels = 0; kernels < options.kernels_count_ && !failed; kernels++)
+      {
+        for (int run = 0; run < options.runs_ && !failed; run++)
+        {
+          BenchResult result;
+          memset(&result, 0, sizeof(BenchResult));
+          failed = runProgram(&options, directory, size, options.kernels_[kernels], &result);
+          if (failed)
+          {
+            break;
+          }
+          // two BMPs are loaded and two canvases are saved by every script
+          double canvas_pixels = (double)size * size;
+          printf("%d,%d,%s,%d", size, depth, options.kernels_[kernels], run + 1);
+          for (int stage = 0; stage < BENCH_STAGES_COUNT; stage++)
+          {
+            printf(",%.6f", result.seconds_[stage]);
+          }
+          printf(",%.6f,%.2f,%.2f,%.2f,%ld\n", result.total_seconds_,
+                 getThroughput(BENCH_BMPS_COUNT * canvas_pixels, result.seconds_[BENCH_LOAD]),
+                 getThroughput((double)result.blended_pixels_, result.seconds_[BENCH_BLEND]),
+                 getThroughput(2 * canvas_pixels, result.seconds_[BENCH_SAVE]), result.peak_rss_kb_);
+          fflush(stdout);
+        }
+      }
+    }
+  }
+  if (failed)
+  {
+    fprintf(stderr, "Benchmark failed\n");
+  }
+  removeFiles(directory, &options);
+  return failed;
+}
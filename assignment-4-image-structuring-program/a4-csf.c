@@ -3,35 +3,83 @@
 ///
 /// Author: 12326821
 //----------------------------------------------------------------------------------------------------------------------
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <glob.h>
+#include <time.h>
+#include <pthread.h>
 #include "bmp.h"
+#include "blend.h"
+#include "decode.h"
+#include "pool.h"
 
 #define SIZE 8
 #define BYTE 4
 #define FIRST_MAGIC_NUMBER 'B'
 #define SECOND_MAGIC_NUMBER 'M'
-
-#define BLEND_MODE_N 'n'
-#define BLEND_MODE_M 'm'
-#define BLEND_MODE_S 's'
+#define MINIMUM_FILE_SIZE 0x1A
+#define FILE_HEADER_SIZE 14
+#define INFO_HEADER_SIZE 40
 
 #define ARGS_COUNT_INDEX 2
 #define ARGS_COUNT 3
+#define OPTION_CACHE_SIZE "--cache-size"
+#define OPTION_THREADS "--threads"
+#define OPTION_SCRIPT "--script"
+#define OPTION_PRINT_MODE "--print-mode"
+#define OPTION_STATS "--stats"
+#define OPTION_PRUNE_BRANCHES "--prune-branches"
+#define OPTION_PRUNE_BUDGET "--prune-budget"
+#define PRINT_MODE_FULL "full"
+#define PRINT_MODE_HALF "half"
+#define PRINT_PIXEL_BYTES 40
+#define PRINT_LINE_BYTES 32
+#define SCRIPT_STDIN "-"
+#define SCRIPT_COMMENT '#'
+#define EXIT_COMMANDS_FAILED 4
+#define NANOSECONDS 1e9
+#define NANOSECONDS_PER_SECOND 1000000000ll
+#define COMMAND_TABLE_SIZE 32
+#define DEFAULT_CACHE_SIZE_MB 64
+#define MEGABYTE (1024 * 1024)
+#define BAND_CACHE_BYTES (256 * 1024)
+#define WRITE_BATCH_ROWS 1024
+#define TEMPORARY_SUFFIX ".tmp"
+#define GRID_MINIMUM_CELL_SIZE 64
+#define GRID_MAXIMUM_CELLS 256
+#define TILE_SIZE 128
+#define ALPHA_CHANNEL 3
+#define OPAQUE_ALPHA 255
+#define MINIMUM_SPAN_LENGTH 8
+#define INDEX_CAPACITY 64
+#define HASH_PRIME_1 0x9E3779B185EBCA87ull
+#define HASH_PRIME_2 0xC2B2AE3D27D4EB4Full
+#define HASH_PRIME_3 0x165667B19E3779F9ull
+#define HASH_LANES 4
 #define PLACE_ARGS_COUNT 5
 #define CROP_ARGS_COUNT 6
 #define ARGC_ONE 1
 #define ARGC_TWO 2
+#define ARGC_FOUR 4
 #define ARGC_FIVE 5
 #define ARGC_SIX 6
 
 #define ROOT_LAYER_ID 0
 #define LIBRARY_CAPACITY 1
-#define LAYER_TREE_CAPACITY 1
+#define LAYER_TABLE_CAPACITY 16
+#define LAYER_CHUNK_CAPACITY 64
+#define LAYER_CHUNK_MAXIMUM_CAPACITY 65536
 #define START_NUMBER_OF_CHILDREN 0
 #define START_ID 0
 
@@ -45,6 +93,20 @@
 #define COMMAND_TREE   "tree"
 #define COMMAND_BMPS   "bmps"
 #define COMMAND_SAVE   "save"
+#define COMMAND_UNLOAD "unload"
+#define COMMAND_LOADALL "loadall"
+#define COMMAND_FLATTEN "flatten"
+#define COMMAND_SAVESTATE "savestate"
+#define COMMAND_LOADSTATE "loadstate"
+#define COMMAND_EXPORT "export"
+#define COMMAND_PRUNE "prune"
+#define EXPORT_ID_MARKER "%d"
+
+#define STATE_MAGIC "A4CSFPRJ"
+#define STATE_MAGIC_SIZE 8
+#define STATE_VERSION 1
+#define STATE_ALIGNMENT 64
+#define STATE_NO_ID -1
 
 typedef enum _Error_Codes_
 {
@@ -65,7 +127,12 @@ typedef enum _Error_Codes_
   ERROR_INVALID_BLEND_MODE,
   ERROR_ALREADY_ROOT,
   ERROR_LAYER_ID_NOT_FOUND,
-  ERROR_INVALID_FILE_PATH
+  ERROR_INVALID_FILE_PATH,
+  ERROR_INVALID_OPTION,
+  ERROR_BMP_IN_USE,
+  ERROR_CANVAS_SIZE_MISMATCH,
+  ERROR_NOT_AN_ANCESTOR,
+  ERROR_FILE_CHANGED
 } ErrorCodes;
 
 typedef enum 
@@ -80,16 +147,81 @@ typedef enum
   TREE,
   BMPS,
   SAVE,
+  UNLOAD,
+  LOADALL,
+  FLATTEN,
+  SAVESTATE,
+  LOADSTATE,
+  EXPORT,
+  PRUNE,
   CMD_COUNT
 } CommandCodes;
 
+typedef enum _Stage_Codes_
+{
+  STAGE_LOAD,
+  STAGE_CROP,
+  STAGE_PLACE,
+  STAGE_BLEND,
+  STAGE_PRINT,
+  STAGE_SAVE,
+  STAGE_OTHER,
+  STAGE_COUNT
+} StageCodes;
+
+typedef struct _Stage_Stats_
+{
+  int calls_[STAGE_COUNT];
+  double seconds_[STAGE_COUNT];
+  uint64_t pixels_[STAGE_COUNT];
+} StageStats;
+
+typedef struct _Pixel_Buffer_
+{
+  int reference_count_;
+  char* data_;
+  size_t size_;
+  int is_mapped_;
+  dev_t device_;
+  ino_t inode_;
+  int64_t modified_ns_;
+  char* path_;
+} PixelBuffer;
+
+typedef enum _Opacity_Kinds_
+{
+  OPACITY_TRANSPARENT,
+  OPACITY_OPAQUE,
+  OPACITY_PARTIAL
+} OpacityKinds;
+
+typedef struct _Opacity_Span_
+{
+  int end_x_;
+  OpacityKinds kind_;
+} OpacitySpan;
+
 typedef struct _BMP_
 {
   int width_;
   int height_;
   int bmp_id_;
   char *pixels_;
+  ptrdiff_t stride_;
+  PixelBuffer* buffer_;
   char *path_;
+  int use_count_;
+  OpacitySpan* spans_;
+  int* row_spans_;
+  uint64_t content_hash_;
+  int is_hashed_;
+  unsigned path_hash_;
+  int64_t modified_ns_;
+  int64_t file_size_;
+  int is_indexed_;
+  struct _BMP_* content_next_;
+  struct _BMP_* path_next_;
+  struct _BMP_* twin_next_;
 } BMP;
 
 typedef struct _BMP_Library_
@@ -97,8 +229,24 @@ typedef struct _BMP_Library_
   int capacity_;
   BMP **bmps_;
   int next_id_;
+  int* free_ids_;
+  int free_count_;
+  BMP** content_index_;
+  BMP** path_index_;
+  int index_capacity_;
+  int indexed_count_;
 } BmpLibrary;
 
+typedef struct _Tiled_Canvas_
+{
+  int width_;
+  int height_;
+  int columns_;
+  int rows_;
+  size_t size_;
+  char** tiles_;
+} TiledCanvas;
+
 typedef struct _Layer_
 {
   int layer_id_;
@@ -108,35 +256,223 @@ typedef struct _Layer_
   int width_;
   int height_;
   char blend_mode_;
+  BlendRowFunction blend_row_;
   struct _Layer_* parent_layer_;
-  struct _Layer_** children_list_;
+  struct _Layer_* first_child_;
+  struct _Layer_* last_child_;
+  struct _Layer_* next_sibling_;
   int number_of_children_;
-  int capacity_;
+  int depth_;
+  TiledCanvas* snapshot_;
+  BMP* flattened_bmp_;
+  struct _Layer_* lru_previous_;
+  struct _Layer_* lru_next_;
 } Layer;
 
+typedef struct _Layer_Chunk_
+{
+  struct _Layer_Chunk_* next_;
+  int capacity_;
+  int used_;
+  Layer layers_[];
+} LayerChunk;
+
+typedef struct _Layer_Arena_
+{
+  LayerChunk* chunks_;
+  int next_capacity_;
+  Layer* free_layers_;
+} LayerArena;
+
 typedef struct _Tree_Node_
 {
   int next_id_;
   Layer* current_active_layer_;
+  Layer** layer_table_;
+  int table_capacity_;
+  int layers_count_;
+  LayerArena arena_;
+  size_t cache_budget_;
+  size_t cache_used_;
+  Layer* lru_head_;
+  Layer* lru_tail_;
+  ThreadPool* thread_pool_;
+  char* frame_;
+  Layer* frame_layer_;
+  char* print_buffer_;
+  size_t print_buffer_size_;
+  int half_blocks_;
+  StageStats stats_;
+  char* stats_path_;
+  int prune_branches_;
+  size_t prune_budget_;
+  int branches_since_prune_;
 } TreeNode;
 
+typedef struct _Rectangle_
+{
+  int x_;
+  int y_;
+  int end_x_;
+  int end_y_;
+} Rectangle;
+
+typedef struct _Program_Options_
+{
+  size_t cache_budget_;
+  int thread_count_;
+  char* script_path_;
+  int half_blocks_;
+  char* stats_path_;
+  int prune_branches_;
+  size_t prune_budget_;
+} ProgramOptions;
+
+typedef struct _Layer_Grid_
+{
+  int cell_size_;
+  int columns_;
+  int rows_;
+  int* cell_start_;
+  int* entries_;
+  Layer** layers_;
+  int layers_count_;
+} LayerGrid;
+
+typedef struct _Render_Job_
+{
+  Layer** layers_;
+  TiledCanvas** snapshots_;
+  int layers_count_;
+  LayerGrid* grid_;
+  int* snapshot_indices_;
+  int snapshots_count_;
+  const char* base_;
+  const TiledCanvas* base_tiles_;
+  char* canvas_;
+  int canvas_width_;
+  int first_row_;
+  int end_row_;
+  int band_height_;
+  char* blank_bands_;
+} RenderJob;
+
+typedef struct _Frame_Writer_
+{
+  pthread_t thread_;
+  int is_running_;
+  char* path_;
+  const char* pixels_;
+  int width_;
+  int height_;
+  ErrorCodes result_;
+} FrameWriter;
+
+typedef struct _Load_Job_
+{
+  char** paths_;
+  BMP** bmps_;
+  ErrorCodes* results_;
+} LoadJob;
+
+typedef struct _State_Header_
+{
+  char magic_[STATE_MAGIC_SIZE];
+  uint32_t version_;
+  int32_t canvas_width_;
+  int32_t canvas_height_;
+  int32_t blobs_count_;
+  int32_t bmps_count_;
+  int32_t free_count_;
+  int32_t layers_count_;
+  int32_t active_layer_id_;
+  uint64_t blobs_offset_;
+  uint64_t bmps_offset_;
+  uint64_t free_ids_offset_;
+  uint64_t layers_offset_;
+} StateHeader;
+
+typedef struct _State_Blob_
+{
+  uint64_t offset_;
+  uint64_t size_;
+} StateBlob;
+
+typedef struct _Buffer_Group_
+{
+  int first_index_;
+  int end_index_;
+  int lowest_bmp_id_;
+} BufferGroup;
+
+typedef struct _State_Bmp_
+{
+  int32_t blob_;
+  int32_t width_;
+  int32_t height_;
+  int32_t path_length_;
+  int64_t pixels_offset_;
+  int64_t stride_;
+  uint64_t path_offset_;
+} StateBmp;
+
+typedef struct _State_Layer_
+{
+  int32_t parent_id_;
+  int32_t bmp_id_;
+  int32_t flattened_bmp_id_;
+  int32_t coordinate_x_;
+  int32_t coordinate_y_;
+  char blend_mode_;
+  char padding_[3];
+} StateLayer;
+
 typedef struct _Command_
 {
   char* name_;
   int argc_;
+  StageCodes stage_;
+  int reads_pixels_;
 } Command;
 
+typedef struct _Command_Table_
+{
+  Command commands_[CMD_COUNT];
+  int slots_[COMMAND_TABLE_SIZE];
+} CommandTable;
+
 void printWelcomeMessage(char* argv[]);
-int handleArguments(int argc, char* argv[]);
+int handleArguments(int argc, char* argv[], ProgramOptions* options);
+ErrorCodes parseOptions(int argc, char* argv[], ProgramOptions* options);
 int printErrorMessage(ErrorCodes error_code);
-int commandLoop(BmpLibrary* library, int width, int height);
-int isValid(char* input, BmpLibrary* library, TreeNode* layers);
+ErrorCodes readBmp(char* path, BMP** bmp, int populate);
 ErrorCodes loadBmp(char* path, BmpLibrary* library);
+BMP* loadCachedBmp(char* path, BmpLibrary* library);
+void loadTask(void* context, int task_index);
+ErrorCodes loadAllCommand(char* pattern, BmpLibrary* library, ThreadPool* thread_pool);
+ErrorCodes decodeBmp(BMP* bmp, PixelBuffer* file, BmpHeader* header);
 void freeLibrary(BmpLibrary* library);
-void freeLayerTree(Layer* layer);
+void freeLayerTree(TreeNode* layers_tree);
 ErrorCodes initializeLibrary(BmpLibrary* library);
 void initializeCommands(Command commands[CMD_COUNT]);
+unsigned hashName(const char* name);
+void initializeCommandTable(CommandTable* table);
+CommandCodes findCommand(CommandTable* table, const char* name);
 ErrorCodes resizeCapacity(BmpLibrary* library);
+ErrorCodes addBmp(BmpLibrary* library, BMP* bmp);
+uint64_t hashBmpPixels(BMP* bmp);
+uint64_t getContentHash(BMP* bmp);
+unsigned hashBmpSize(BMP* bmp);
+int haveSamePixels(BMP* first, BMP* second);
+ErrorCodes resizeBmpIndex(BmpLibrary* library);
+void indexBmp(BmpLibrary* library, BMP* bmp);
+void unindexBmp(BmpLibrary* library, BMP* bmp);
+BMP* findContentTwin(BmpLibrary* library, BMP* bmp);
+BMP* findLoadedPath(BmpLibrary* library, const char* path, const struct stat* file_status);
+void shareTwinPixels(BMP* bmp, BMP* twin);
+ErrorCodes addIndexedBmp(BmpLibrary* library, BMP* bmp);
+void freeBmp(BMP* bmp);
+ErrorCodes unloadCommand(char* id_string, BmpLibrary* library);
 int isWhiteSpace(char* input_string);
 int isEmpty(char* input_string);
 void removeNewLine(char* string);
@@ -152,9 +488,21 @@ void printSwitchMessage(int layer_id);
 void printCommandList(void);
 int isQuit(char* input);
 int countArguments(char** words);
-ErrorCodes resizeLayerCapacity(TreeNode* layers);
-TreeNode* createRootLayer(int width, int height);
-ErrorCodes flipBmp(BMP* bmp);
+Layer* allocateLayer(LayerArena* arena);
+void freeLayerArena(LayerArena* arena);
+ErrorCodes resizeLayerTable(TreeNode* layers_tree);
+void shrinkLayerTable(TreeNode* layers_tree, size_t* reclaimed_bytes);
+Layer* findLayer(TreeNode* layers_tree, int layer_id);
+int traverseLayers(Layer* root, Layer** order, int* depths, int capacity);
+TreeNode* createRootLayer(int width, int height, ProgramOptions* options);
+PixelBuffer* createPixelBuffer(size_t size);
+PixelBuffer* retainPixelBuffer(PixelBuffer* buffer);
+void releasePixelBuffer(PixelBuffer* buffer);
+ErrorCodes mapFile(char* path, PixelBuffer** buffer, int populate, struct stat* file_status);
+ErrorCodes copyMappedBuffer(BmpLibrary* library, PixelBuffer* buffer, size_t readable_size);
+ErrorCodes detachMappedFile(BmpLibrary* library, const char* path);
+ErrorCodes checkMappedFiles(BmpLibrary* library);
+char* getBmpRow(BMP* bmp, int y);
 ErrorCodes loadBmp(char* path, BmpLibrary* library);
 void printBmps(BmpLibrary* library);
 ErrorCodes checkBmpId(int id, BmpLibrary* library);
@@ -163,20 +511,81 @@ ErrorCodes checkBlendMode(char mode);
 ErrorCodes placeBmp(int id, int canvas_x, int canvas_y, char blend_mode, BmpLibrary* library, TreeNode* layers_tree);
 ErrorCodes placeCommand(BmpLibrary* library, char** words, TreeNode* layers_tree);
 ErrorCodes undoCommand(TreeNode* layers_tree);
-int getLayers(TreeNode* layers_tree, Layer** layers_to_print);
+int getLayers(TreeNode* layers_tree, Layer** layers_to_print, Layer** cached_base);
+const char* getBasePixels(Layer* cached_base);
 void blendLayer(Layer* layer, char* canvas, int canvas_width);
-void printCanvas(char* canvas, int canvas_height, int canvas_width);
+void blendLayerRows(Layer* layer, char* canvas, int canvas_width, int first_row, int end_row);
+void blendLayerRectangle(Layer* layer, char* canvas, int canvas_width, Rectangle* rectangle);
+void blendBmpRow(Layer* layer, char* canvas_pixel, int y, int first_x, int pixel_count);
+void buildLayerSpans(Layer** layers, int layers_count);
+ErrorCodes appendOpacitySpan(BMP* bmp, int* spans_count, int* capacity, int row_start, int end_x, OpacityKinds kind);
+ErrorCodes buildOpacitySpans(BMP* bmp);
+void unlinkSnapshot(TreeNode* layers_tree, Layer* layer);
+void linkSnapshot(TreeNode* layers_tree, Layer* layer);
+void evictSnapshot(TreeNode* layers_tree, Layer* layer);
+TiledCanvas* createTiledCanvas(int width, int height);
+void freeTiledCanvas(TiledCanvas* canvas);
+size_t getTileSize(TiledCanvas* canvas, int tile);
+void readTiledRows(const TiledCanvas* canvas, int first_row, int end_row, int x, int end_x, char* destination);
+void writeTiledRows(TiledCanvas* canvas, int first_row, int end_row, const char* source);
+void copyBaseRows(const char* base, const TiledCanvas* base_tiles, int canvas_width, int first_row, int end_row,
+                  int x, int end_x, char* destination);
+void markLayerTiles(char* touched, int canvas_width, int canvas_height, Layer* layer);
+TiledCanvas* reserveSnapshot(TreeNode* layers_tree, int width, int height, const char* touched);
+ErrorCodes buildLayerGrid(LayerGrid* grid, Layer** layers, int layers_count, int canvas_width, int canvas_height);
+int compareLayerIndices(const void* first, const void* second);
+int queryLayerGrid(LayerGrid* grid, int x, int y, int width, int height, int* found);
+void freeLayerGrid(LayerGrid* grid);
+int getBandHeight(int canvas_width);
+void renderBand(void* context, int band);
+ErrorCodes renderCanvas(TreeNode* layers_tree, char* canvas);
+void addDirtyLayer(Rectangle* dirty, Layer* layer);
+int getDirtyRectangle(Layer* from, Layer* to, Rectangle* dirty);
+ErrorCodes renderRectangle(TreeNode* layers_tree, char* canvas, Rectangle* rectangle);
+ErrorCodes updateFrame(TreeNode* layers_tree);
+void fillSaveHeader(BmpHeader* header, int width, int height);
+ErrorCodes writeRows(int descriptor, struct iovec* rows, int rows_count);
+ErrorCodes createTemporaryFile(const char* path, char** temporary_path, int* descriptor);
+ErrorCodes commitTemporaryFile(int descriptor, char* temporary_path, const char* path, ErrorCodes result);
+char* appendNumber(char* output, unsigned value);
+char* appendText(char* output, const char* text);
+char* appendColor(char* output, const unsigned char* pixel, const unsigned char* background_pixel);
+ErrorCodes printCanvas(TreeNode* layers_tree, char* canvas, int canvas_height, int canvas_width);
 ErrorCodes printCommand(TreeNode* layers_tree);
 Layer* getRootLayer(TreeNode* layers_tree);
-void printTree(Layer* root, int depth);
+void printTreeLayer(Layer* layer, int depth);
 ErrorCodes treeCommand(TreeNode* layers_tree);
-Layer* switchLayer(Layer* layer, int new_layer_id);
 ErrorCodes switchCommand(TreeNode* layers_tree, char* new_id);
-ErrorCodes saveCommand(TreeNode* layers_tree, char* path);
-ErrorCodes executeCommand(char** words, BmpLibrary* library, TreeNode* layers_tree);
-ErrorCodes dispatchCommand(char** words, int argc, BmpLibrary* library, TreeNode* layers_tree);
-int isValid(char* input, BmpLibrary* library, TreeNode* layers_tree);
-int commandLoop(BmpLibrary* library, int width, int height);
+ErrorCodes flattenCommand(char* id_string, BmpLibrary* library, TreeNode* layers_tree);
+ErrorCodes saveCommand(BmpLibrary* library, TreeNode* layers_tree, char* path);
+ErrorCodes writeBmpFile(const char* path, const char* pixels, int width, int height);
+void* writeFrame(void* context);
+void startFrameWriter(FrameWriter* writer, char* path, const char* pixels, int width, int height);
+ErrorCodes finishFrameWriter(FrameWriter* writer);
+char* formatFramePath(const char* pattern, int layer_id);
+void blendStepBand(void* context, int band);
+ErrorCodes exportCommand(char** words, BmpLibrary* library, TreeNode* layers_tree);
+void releaseLayer(TreeNode* layers_tree, Layer* layer, size_t* reclaimed_bytes);
+ErrorCodes pruneLayers(TreeNode* layers_tree);
+size_t getLayerTreeBytes(TreeNode* layers_tree);
+ErrorCodes applyPrunePolicy(TreeNode* layers_tree);
+void getBmpByteRange(BMP* bmp, ptrdiff_t* first_byte, ptrdiff_t* end_byte);
+int compareBmpBuffers(const void* first, const void* second);
+int compareBufferGroups(const void* first, const void* second);
+ErrorCodes saveStateCommand(char* path, BmpLibrary* library, TreeNode* layers_tree);
+int isStateTableValid(PixelBuffer* file, uint64_t offset, int32_t count, size_t record_size);
+ErrorCodes checkStateHeader(PixelBuffer* file, int width, int height);
+ErrorCodes readStateBmps(PixelBuffer* file, BmpLibrary* library);
+ErrorCodes readStateLayers(PixelBuffer* file, BmpLibrary* library, TreeNode* layers_tree, int width, int height);
+ErrorCodes loadStateCommand(char* path, BmpLibrary* library, TreeNode* layers_tree);
+ErrorCodes executeCommand(char** words, CommandCodes command, BmpLibrary* library, TreeNode* layers_tree);
+ErrorCodes dispatchCommand(char** words, int argc, BmpLibrary* library, TreeNode* layers_tree, CommandTable* table);
+double getSeconds(void);
+void addStageTime(TreeNode* layers_tree, StageCodes stage, double seconds, uint64_t pixels);
+void writeStageStats(TreeNode* layers_tree);
+int isValid(char* input, BmpLibrary* library, TreeNode* layers_tree, CommandTable* table);
+int runScript(FILE* script, BmpLibrary* library, TreeNode* layers_tree, CommandTable* table);
+int commandLoop(BmpLibrary* library, int width, int height, ProgramOptions* options);
 
 //----------------------------------------------------------------------------------------------------------------------
 /// @brief Main function of the program.
@@ -185,11 +594,14 @@ int commandLoop(BmpLibrary* library, int width, int height);
 /// @return Either 0 for quit or 1 if memory allocation failed.
 int main(int argc, char* argv[])
 {
-  int result = handleArguments(argc, argv);
+  ProgramOptions options;
+  int result = handleArguments(argc, argv, &options);
   if (result != 0)
   {
     return result;
   }
+  initializeBlendKernels();
+  initializeDecoders();
   BmpLibrary *library = calloc(1, sizeof(BmpLibrary));
   if (library == NULL)
   {
@@ -199,10 +611,13 @@ int main(int argc, char* argv[])
   {
     return printErrorMessage(ERROR_MALLOC_FAILED);
   }
-  printWelcomeMessage(argv);
+  if (options.script_path_ == NULL)
+  {
+    printWelcomeMessage(argv);
+  }
   int width = atoi(argv[1]);
   int height = atoi(argv[2]);
-  result = commandLoop(library, width, height);
+  result = commandLoop(library, width, height, &options);
   freeLibrary(library);
   return result;
 }
@@ -215,7 +630,8 @@ ErrorCodes initializeLibrary(BmpLibrary* library)
 {
   library->capacity_ = LIBRARY_CAPACITY;
   library->bmps_ = calloc(library->capacity_, sizeof(BMP*));
-  if (library->bmps_ == NULL)
+  library->free_ids_ = calloc(library->capacity_, sizeof(int));
+  if (library->bmps_ == NULL || library->free_ids_ == NULL)
   {
     freeLibrary(library);
     return ERROR_MALLOC_FAILED;
@@ -231,33 +647,133 @@ void initializeCommands(Command commands[CMD_COUNT])
 {
     commands[HELP].name_ = COMMAND_HELP;
     commands[HELP].argc_ = ARGC_ONE;
+    commands[HELP].stage_ = STAGE_OTHER;
 
     commands[LOAD].name_ = COMMAND_LOAD;
     commands[LOAD].argc_ = ARGC_TWO;
+    commands[LOAD].stage_ = STAGE_LOAD;
+    commands[LOAD].reads_pixels_ = 1;
 
     commands[CROP].name_ = COMMAND_CROP;
     commands[CROP].argc_ = ARGC_SIX;
+    commands[CROP].stage_ = STAGE_CROP;
+    commands[CROP].reads_pixels_ = 1;
 
     commands[PLACE].name_ = COMMAND_PLACE;
     commands[PLACE].argc_ = ARGC_FIVE;
+    commands[PLACE].stage_ = STAGE_PLACE;
+    commands[PLACE].reads_pixels_ = 1;
 
     commands[UNDO].name_ = COMMAND_UNDO;
     commands[UNDO].argc_ = ARGC_ONE;
+    commands[UNDO].stage_ = STAGE_OTHER;
+    commands[UNDO].reads_pixels_ = 1;
 
     commands[PRINT].name_ = COMMAND_PRINT;
     commands[PRINT].argc_ = ARGC_ONE;
+    commands[PRINT].stage_ = STAGE_PRINT;
+    commands[PRINT].reads_pixels_ = 1;
 
     commands[SWITCH].name_ = COMMAND_SWITCH;
     commands[SWITCH].argc_ = ARGC_TWO;
+    commands[SWITCH].stage_ = STAGE_OTHER;
 
     commands[TREE].name_ = COMMAND_TREE;
     commands[TREE].argc_ = ARGC_ONE;
+    commands[TREE].stage_ = STAGE_OTHER;
 
     commands[BMPS].name_ = COMMAND_BMPS;
     commands[BMPS].argc_ = ARGC_ONE;
+    commands[BMPS].stage_ = STAGE_OTHER;
 
     commands[SAVE].name_ = COMMAND_SAVE;
     commands[SAVE].argc_ = ARGC_TWO;
+    commands[SAVE].stage_ = STAGE_SAVE;
+    commands[SAVE].reads_pixels_ = 1;
+
+    commands[UNLOAD].name_ = COMMAND_UNLOAD;
+    commands[UNLOAD].argc_ = ARGC_TWO;
+    commands[UNLOAD].stage_ = STAGE_OTHER;
+
+    commands[LOADALL].name_ = COMMAND_LOADALL;
+    commands[LOADALL].argc_ = ARGC_TWO;
+    commands[LOADALL].stage_ = STAGE_LOAD;
+    commands[LOADALL].reads_pixels_ = 1;
+
+    commands[FLATTEN].name_ = COMMAND_FLATTEN;
+    commands[FLATTEN].argc_ = ARGC_TWO;
+    commands[FLATTEN].stage_ = STAGE_OTHER;
+    commands[FLATTEN].reads_pixels_ = 1;
+
+    commands[SAVESTATE].name_ = COMMAND_SAVESTATE;
+    commands[SAVESTATE].argc_ = ARGC_TWO;
+    commands[SAVESTATE].stage_ = STAGE_OTHER;
+    commands[SAVESTATE].reads_pixels_ = 1;
+
+    commands[LOADSTATE].name_ = COMMAND_LOADSTATE;
+    commands[LOADSTATE].argc_ = ARGC_TWO;
+    commands[LOADSTATE].stage_ = STAGE_OTHER;
+
+    commands[EXPORT].name_ = COMMAND_EXPORT;
+    commands[EXPORT].argc_ = ARGC_FOUR;
+    commands[EXPORT].stage_ = STAGE_SAVE;
+    commands[EXPORT].reads_pixels_ = 1;
+
+    commands[PRUNE].name_ = COMMAND_PRUNE;
+    commands[PRUNE].argc_ = ARGC_ONE;
+    commands[PRUNE].stage_ = STAGE_OTHER;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Hashes a command name or a file path (FNV-1a).
+/// @param name The name.
+/// @return The hash.
+unsigned hashName(const char* name)
+{
+  unsigned hash = 2166136261u;
+  for (; *name != '\0'; name++)
+  {
+    hash = (hash ^ (unsigned char)*name) * 16777619u;
+  }
+  return hash;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Builds the command table once, the names are stored in an open addressing hash table.
+/// @param table The table to fill.
+void initializeCommandTable(CommandTable* table)
+{
+  initializeCommands(table->commands_);
+  memset(table->slots_, 0, sizeof(table->slots_));
+  for (int command = 0; command < CMD_COUNT; command++)
+  {
+    unsigned slot = hashName(table->commands_[command].name_) % COMMAND_TABLE_SIZE;
+    while (table->slots_[slot] != 0)
+    {
+      slot = (slot + 1) % COMMAND_TABLE_SIZE;
+    }
+    table->slots_[slot] = command + 1;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Looks up a command by name.
+/// @param table The command table.
+/// @param name The command name from user input.
+/// @return The command or CMD_COUNT if the name is unknown.
+CommandCodes findCommand(CommandTable* table, const char* name)
+{
+  unsigned slot = hashName(name) % COMMAND_TABLE_SIZE;
+  while (table->slots_[slot] != 0)
+  {
+    int command = table->slots_[slot] - 1;
+    if (strcmp(name, table->commands_[command].name_) == 0)
+    {
+      return command;
+    }
+    slot = (slot + 1) % COMMAND_TABLE_SIZE;
+  }
+  return CMD_COUNT;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -282,1321 +798,4378 @@ void freeLibrary(BmpLibrary* library)
   }
   for (int index = 0; index < library->next_id_; index++)
   {
-    if (library->bmps_[index] != NULL)
-    {
-      free(library->bmps_[index]->pixels_);
-      free(library->bmps_[index]->path_);
-      free(library->bmps_[index]);
-    }
+    freeBmp(library->bmps_[index]);
   }
   free(library->bmps_);
+  free(library->free_ids_);
+  free(library->content_index_);
+  free(library->path_index_);
   free(library);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Frees the layer tree;
-/// @param layer pointer to the tree.
-void freeLayerTree(Layer* layer)
+/// @brief Frees a bmp, takes it out of the ring of its twins and releases its pixel buffers.
+/// @param bmp The bmp, may be NULL.
+void freeBmp(BMP* bmp)
 {
-  if (layer == NULL)
+  if (bmp == NULL)
+  {
+    return;
+  }
+  if (bmp->twin_next_ != NULL)
+  {
+    BMP* previous = bmp->twin_next_;
+    while (previous->twin_next_ != bmp)
+    {
+      previous = previous->twin_next_;
+    }
+    previous->twin_next_ = bmp->twin_next_ != previous ? bmp->twin_next_ : NULL;
+  }
+  releasePixelBuffer(bmp->buffer_);
+  free(bmp->path_);
+  free(bmp->spans_);
+  free(bmp->row_spans_);
+  free(bmp);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Frees the layer tree. Snapshots are found through the LRU list and all layers go away with the arena.
+/// @param layers_tree pointer to the tree.
+void freeLayerTree(TreeNode* layers_tree)
+{
+  if (layers_tree == NULL)
   {
     return;
   }
-  for (int index = 0; index < layer->number_of_children_; index++)
+  while (layers_tree->lru_head_ != NULL)
   {
-    freeLayerTree(layer->children_list_[index]);
+    evictSnapshot(layers_tree, layers_tree->lru_head_);
   }
-  free(layer->children_list_);
-  free(layer);
-  return;
+  freeLayerArena(&layers_tree->arena_);
+  free(layers_tree->layer_table_);
+  freeThreadPool(layers_tree->thread_pool_);
+  free(layers_tree->frame_);
+  free(layers_tree->print_buffer_);
+  free(layers_tree);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Resizes the library capacity.
+/// @brief Doubles the library capacity when it is full, so adding n bmps costs O(n) copying in total.
 /// @param library pointer to the library
-/// @return -1 if malloc failed, 0 if OK
+/// @return ERROR_MALLOC_FAILED if realloc failed, 0 if OK
 ErrorCodes resizeCapacity(BmpLibrary* library)
 {
   if (library->next_id_ >= library->capacity_)
   {
-    int new_capacity = library->capacity_ + 1;
+    int new_capacity = library->capacity_ * 2;
     BMP** temporary = realloc(library->bmps_, new_capacity * sizeof(BMP*));
     if (temporary == NULL)
     {
-      printErrorMessage(ERROR_MALLOC_FAILED);
       return ERROR_MALLOC_FAILED;
     }
     library->bmps_ = temporary;
+    int* temporary_ids = realloc(library->free_ids_, new_capacity * sizeof(int));
+    if (temporary_ids == NULL)
+    {
+      return ERROR_MALLOC_FAILED;
+    }
+    library->free_ids_ = temporary_ids;
     library->capacity_ = new_capacity;
-    temporary = NULL;
   }
   return OK;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief This function validates the command line arguments.
-/// @param argc Count of command line arguments.
-/// @param argv Holds the command line arguments.
-/// @return 0 if everything is correct, -1 if not.
-int handleArguments(int argc, char *argv[])
+/// @brief Adds a bmp to the library and gives it an id. The id of the most recently unloaded bmp is reused first,
+///        otherwise the bmp gets the next new id.
+/// @param library pointer to the library
+/// @param bmp The new bmp.
+/// @return ERROR_MALLOC_FAILED if the library could not grow, 0 if OK
+ErrorCodes addBmp(BmpLibrary* library, BMP* bmp)
 {
-  if (argc != ARGS_COUNT)
+  if (library->free_count_ > 0)
   {
-    return printErrorMessage(ERROR_INVALID_AMOUNT);
+    bmp->bmp_id_ = library->free_ids_[--library->free_count_];
   }
-  int argument_index = 1;
-  while (argument_index <= ARGS_COUNT_INDEX)
+  else
   {
-    int arguments_length = (int)strlen(argv[argument_index]);
-    for (int index = 0; index < arguments_length; index++)
+    if (resizeCapacity(library) != OK)
     {
-      if (!isdigit(argv[argument_index][index]))
-      {
-        return printErrorMessage(ERROR_INVALID_SIZE);
-      }
+      return ERROR_MALLOC_FAILED;
     }
-    argument_index++;
-  }
-  int first_argument = atoi(argv[1]);
-  int second_argument = atoi(argv[2]);
-  if (first_argument < 1 || second_argument < 1)
-  {
-    return printErrorMessage(ERROR_INVALID_SIZE);
+    bmp->bmp_id_ = library->next_id_++;
   }
-  return 0;
+  library->bmps_[bmp->bmp_id_] = bmp;
+  return OK;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Prints the corresponding error message.
-/// @param error_code Holds the error code.
-/// @return Returns the correct return value.
-int printErrorMessage(ErrorCodes error_code)
+/// @brief Hashes the size and the pixels of a bmp. The rows are read eight bytes at a time into four independent
+///        lanes (the xxHash64 round), so the hash runs at memory speed.
+/// @param bmp The bmp.
+/// @return The hash.
+uint64_t hashBmpPixels(BMP* bmp)
 {
-  switch (error_code)
+  uint64_t lanes[HASH_LANES] = {HASH_PRIME_1, HASH_PRIME_2, HASH_PRIME_3,
+                                (uint64_t)bmp->width_ << 32 | (uint32_t)bmp->height_};
+  size_t row_size = (size_t)bmp->width_ * BYTE;
+  for (int y = 0; y < bmp->height_; y++)
   {
-    case ERROR_MALLOC_FAILED:
-      printf("[ERROR] Memory allocation failed!\n");
-      return 1;
-    case ERROR_INVALID_AMOUNT:
-      printf("[ERROR] Invalid amount of command line parameters!\n");
-      return 2;
-    case ERROR_INVALID_SIZE:
-      printf("[ERROR] Invalid canvas size specified!\n");
-      return 3;
-    case ERROR_COMMAND_UNKNOWN:
-      printf("[ERROR] Command unknown!\n");
-      return -1;
-    case ERROR_ARGUMENTS_AMOUNT:
-      printf("[ERROR] Wrong number of arguments!\n");
-      return -1;
-    case ERROR_BMP_ID_NOT_FOUND:
-      printf("[ERROR] BMP ID not found!\n");
-      return -1;
-    case ERROR_CANNOT_OPEN_FILE:
-      printf("[ERROR] Cannot open file!\n");
-      return -1;
-    case ERROR_INVALID_FILE:
-      printf("[ERROR] Invalid file!\n");
-      return -1;
-    case ERROR_OUT_OF_RANGE:
-      printf("[ERROR] Crop coordinates are outside the BMP!\n");
-      return -1;
-    case ERROR_INVALID_RECTANGLE:
-      printf("[ERROR] Crop coordinates do not form a valid rectangle!\n");
-      return -1;
-    case ERROR_INVALID_COORDINATES:
-      printf("[ERROR] Canvas coordinates are invalid!\n");
-      return -1;
-    case ERROR_BMP_DOESNT_FIT:
-      printf("[ERROR] BMP does not fit on the canvas!\n");
-      return -1;
-    case ERROR_INVALID_BLEND_MODE:
-      printf("[ERROR] Invalid blend mode!\n");
-      return -1;
-    case ERROR_ALREADY_ROOT:
-      printf("[ERROR] Already at root layer!\n");
-      return -1;
-    case ERROR_LAYER_ID_NOT_FOUND:
-      printf("[ERROR] Layer ID not found!\n");
-      return -1;
-    case ERROR_INVALID_FILE_PATH:
-      printf("[ERROR] Invalid file path!\n");
-      return -1;
-    default:
-      return 0;
+    const char* row = getBmpRow(bmp, y);
+    size_t offset = 0;
+    for (int lane = 0; offset + sizeof(uint64_t) <= row_size; offset += sizeof(uint64_t))
+    {
+      uint64_t word;
+      memcpy(&word, row + offset, sizeof(uint64_t));
+      lanes[lane] += word * HASH_PRIME_2;
+      lanes[lane] = (lanes[lane] << 31 | lanes[lane] >> 33) * HASH_PRIME_1;
+      lane = (lane + 1) % HASH_LANES;
+    }
+    if (offset < row_size)
+    {
+      uint32_t pixel;
+      memcpy(&pixel, row + offset, sizeof(uint32_t));
+      lanes[y % HASH_LANES] ^= pixel * HASH_PRIME_3;
+    }
   }
+  uint64_t hash = 0;
+  for (int lane = 0; lane < HASH_LANES; lane++)
+  {
+    hash = (hash ^ lanes[lane]) * HASH_PRIME_1;
+    hash ^= hash >> 29;
+  }
+  return hash;
 }
 
-//The following code was taken from my own Assignment 3
-//begin
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Checks if the user input was just white spaces.
-/// @param input_string Stores the user input.
-/// @return Returns 1 if it is just white spaces, 0 if it is not.
-int isWhiteSpace(char* input_string)
+/// @brief Gets the content hash of a bmp. The pixels are only hashed the first time it is needed, which is when a
+///        bmp of the same size is looked for, so loading an image that has no twin candidate does not read it.
+/// @param bmp The bmp.
+/// @return The hash.
+uint64_t getContentHash(BMP* bmp)
 {
-  int index = 0;
-  int is_space = 1;
-  while (input_string[index] != '\0')
+  if (!bmp->is_hashed_)
   {
-    if (!isspace(input_string[index]))
-    {
-      is_space = 0;
-      break;
-    }
-    index++;
+    bmp->content_hash_ = hashBmpPixels(bmp);
+    bmp->is_hashed_ = 1;
   }
-  return (is_space == 1);
+  return bmp->content_hash_;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Checks if the user input was empty. (Just newline character or null terminator)
-/// @param input_string Stores the user input.
-/// @return Returns 1 if it is \n or \0, returns 0 if it is not.
-int isEmpty(char* input_string)
+/// @brief Hashes the size of a bmp, which selects its bucket in the content index.
+/// @param bmp The bmp.
+/// @return The hash.
+unsigned hashBmpSize(BMP* bmp)
 {
-  return ((strcmp(input_string, "\n") == 0) || (input_string[0] == '\0'));
+  return (unsigned)(((uint64_t)bmp->width_ << 32 | (uint32_t)bmp->height_) * HASH_PRIME_1 >> 32);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Removes the new line character from a string.
-/// @param string String we remove the new line character from.
-void removeNewLine(char* string)
+/// @brief Compares the pixels of two bmps of the same size.
+/// @param first The first bmp.
+/// @param second The second bmp.
+/// @return 1 if every row is equal, 0 if not.
+int haveSamePixels(BMP* first, BMP* second)
 {
-  int length = strlen(string);
-  if (length > 0 && string[length - 1] == '\n')
+  if (first->width_ != second->width_ || first->height_ != second->height_)
   {
-    string[length - 1] = '\0';
+    return 0;
   }
-}
-
-//----------------------------------------------------------------------------------------------------------------------
-/// @brief This function checks if all of the input was read from the buffer.
-/// @param input_string Stores the user input.
-/// @param last_character Stores the character we want to find in the string.
-/// @return Returns NULL if last_character was not found and the iterator if it was.
-char* isInputDone(char* input_string, char last_character)
-{
-  for (char* iterator = input_string; *iterator != '\0'; iterator++)
+  for (int y = 0; y < first->height_; y++)
   {
-    if (*iterator == last_character)
+    if (memcmp(getBmpRow(first, y), getBmpRow(second, y), (size_t)first->width_ * BYTE) != 0)
     {
-      return iterator;
+      return 0;
     }
   }
-  return NULL;
+  return 1;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Sizes up (allocates more memory) for user input if needed.
-/// @param input_string Stores the user input.
-/// @param size Stores the size of the input string.
-/// @return Returns the resized input string.
-char* sizeUp(char* input_string, int* size)
+/// @brief Doubles the buckets of the content and path index once there are more indexed bmps than buckets, and
+///        sorts the bmps into the new buckets. The first call creates the index.
+/// @param library The bmp library of the program.
+/// @return OK (0) if the index is ready, ERROR_MALLOC_FAILED (1) if it could not grow.
+ErrorCodes resizeBmpIndex(BmpLibrary* library)
 {
-  while (isInputDone(input_string, '\n') == NULL)
+  if (library->content_index_ != NULL && library->indexed_count_ < library->index_capacity_)
   {
-    *size += SIZE;
-    char* temporary_string = realloc(input_string, *size * sizeof(char));
-    if (temporary_string == NULL)
+    return OK;
+  }
+  int capacity = library->content_index_ != NULL ? library->index_capacity_ * 2 : INDEX_CAPACITY;
+  BMP** content_index = calloc(capacity, sizeof(BMP*));
+  BMP** path_index = calloc(capacity, sizeof(BMP*));
+  if (content_index == NULL || path_index == NULL)
+  {
+    free(content_index);
+    free(path_index);
+    return ERROR_MALLOC_FAILED;
+  }
+  for (int id = 0; id < library->next_id_; id++)
+  {
+    BMP* bmp = library->bmps_[id];
+    if (bmp != NULL && bmp->is_indexed_)
     {
-      free(input_string);
-      input_string = NULL;
-      return NULL;
+      bmp->content_next_ = content_index[hashBmpSize(bmp) % capacity];
+      content_index[hashBmpSize(bmp) % capacity] = bmp;
+      bmp->path_next_ = NULL;
+      if (bmp->path_ != NULL)
+      {
+        bmp->path_next_ = path_index[bmp->path_hash_ % capacity];
+        path_index[bmp->path_hash_ % capacity] = bmp;
+      }
     }
-    input_string = temporary_string;
-    temporary_string = NULL;
-    int already_read = strlen(input_string);
-    int read_until = *size - already_read;
-    fgets(input_string + already_read, read_until, stdin);
   }
-  return input_string;
+  free(library->content_index_);
+  free(library->path_index_);
+  library->content_index_ = content_index;
+  library->path_index_ = path_index;
+  library->index_capacity_ = capacity;
+  return OK;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Sizes down (reallocates less memory than needed) the user input.
+/// @brief Adds a bmp of the library to the content index and, if it was read from a file, to the path index. The
+///        content index is bucketed by size, so the pixels do not have to be hashed for it. The index is an
+///        optimization, so a bmp that does not fit into it is simply not found again.
+/// @param library The bmp library of the program.
+/// @param bmp The bmp, its path hash is set already.
+void indexBmp(BmpLibrary* library, BMP* bmp)
+{
+  if (resizeBmpIndex(library) != OK)
+  {
+    return;
+  }
+  int content_slot = hashBmpSize(bmp) % library->index_capacity_;
+  bmp->content_next_ = library->content_index_[content_slot];
+  library->content_index_[content_slot] = bmp;
+  if (bmp->path_ != NULL)
+  {
+    int path_slot = bmp->path_hash_ % library->index_capacity_;
+    bmp->path_next_ = library->path_index_[path_slot];
+    library->path_index_[path_slot] = bmp;
+  }
+  bmp->is_indexed_ = 1;
+  library->indexed_count_++;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Takes a bmp out of the content and path index before it is unloaded.
+/// @param library The bmp library of the program.
+/// @param bmp The bmp.
+void unindexBmp(BmpLibrary* library, BMP* bmp)
+{
+  if (!bmp->is_indexed_)
+  {
+    return;
+  }
+  BMP** link = &library->content_index_[hashBmpSize(bmp) % library->index_capacity_];
+  while (*link != bmp)
+  {
+    link = &(*link)->content_next_;
+  }
+  *link = bmp->content_next_;
+  if (bmp->path_ != NULL)
+  {
+    link = &library->path_index_[bmp->path_hash_ % library->index_capacity_];
+    while (*link != bmp)
+    {
+      link = &(*link)->path_next_;
+    }
+    *link = bmp->path_next_;
+  }
+  bmp->is_indexed_ = 0;
+  library->indexed_count_--;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Looks for a bmp of the library with the same size and pixels. The new bmp and the candidates are only
+///        hashed once a candidate of the same size turns up, and equal hashes are confirmed by comparing the pixels,
+///        so a collision never mixes up two images.
+/// @param library The bmp library of the program.
+/// @param bmp The new bmp.
+/// @return The bmp with the same pixels or NULL if there is none.
+BMP* findContentTwin(BmpLibrary* library, BMP* bmp)
+{
+  if (library->content_index_ == NULL)
+  {
+    return NULL;
+  }
+  BMP* candidate = library->content_index_[hashBmpSize(bmp) % library->index_capacity_];
+  for (; candidate != NULL; candidate = candidate->content_next_)
+  {
+    if (candidate->width_ == bmp->width_ && candidate->height_ == bmp->height_ &&
+        getContentHash(candidate) == getContentHash(bmp) && haveSamePixels(candidate, bmp))
+    {
+      return candidate;
+    }
+  }
+  return NULL;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Looks for a bmp that was loaded from the same path while the file had the same modification time and size.
+/// @param library The bmp library of the program.
+/// @param path Path of the file.
+/// @param file_status Current status of the file.
+/// @return The loaded bmp or NULL if the file was not loaded or changed since.
+BMP* findLoadedPath(BmpLibrary* library, const char* path, const struct stat* file_status)
+{
+  if (library->path_index_ == NULL)
+  {
+    return NULL;
+  }
+  int64_t modified_ns = (int64_t)file_status->st_mtim.tv_sec * NANOSECONDS_PER_SECOND + file_status->st_mtim.tv_nsec;
+  BMP* candidate = library->path_index_[hashName(path) % library->index_capacity_];
+  for (; candidate != NULL; candidate = candidate->path_next_)
+  {
+    if (candidate->modified_ns_ == modified_ns && candidate->file_size_ == (int64_t)file_status->st_size &&
+        strcmp(candidate->path_, path) == 0)
+    {
+      return candidate;
+    }
+  }
+  return NULL;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Makes a bmp share the pixels of a twin with the same content. Its own pixel buffer is released and it joins
+///        the ring of the twin.
+/// @param bmp The bmp.
+/// @param twin A bmp with the same size and pixels.
+void shareTwinPixels(BMP* bmp, BMP* twin)
+{
+  PixelBuffer* buffer = bmp->buffer_;
+  bmp->buffer_ = retainPixelBuffer(twin->buffer_);
+  releasePixelBuffer(buffer);
+  bmp->pixels_ = twin->pixels_;
+  bmp->stride_ = twin->stride_;
+  bmp->content_hash_ = twin->content_hash_;
+  bmp->is_hashed_ = twin->is_hashed_;
+  bmp->twin_next_ = twin->twin_next_ != NULL ? twin->twin_next_ : twin;
+  twin->twin_next_ = bmp;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Adds a loaded or cropped bmp to the library. If the library already holds the same pixels, the bmp shares
+///        them instead of keeping its own copy.
+/// @param library The bmp library of the program.
+/// @param bmp The new bmp.
+/// @return ERROR_MALLOC_FAILED if the library could not grow, 0 if OK
+ErrorCodes addIndexedBmp(BmpLibrary* library, BMP* bmp)
+{
+  BMP* twin = bmp->twin_next_ == NULL ? findContentTwin(library, bmp) : NULL;
+  if (twin != NULL)
+  {
+    shareTwinPixels(bmp, twin);
+  }
+  if (addBmp(library, bmp) != OK)
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+  indexBmp(library, bmp);
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief This function validates the command line arguments.
+/// @param argc Count of command line arguments.
+/// @param argv Holds the command line arguments.
+/// @param options Receives the optional settings given after the canvas size.
+/// @return 0 if everything is correct, -1 if not.
+int handleArguments(int argc, char *argv[], ProgramOptions* options)
+{
+  if (argc < ARGS_COUNT)
+  {
+    return printErrorMessage(ERROR_INVALID_AMOUNT);
+  }
+  int argument_index = 1;
+  while (argument_index <= ARGS_COUNT_INDEX)
+  {
+    int arguments_length = (int)strlen(argv[argument_index]);
+    for (int index = 0; index < arguments_length; index++)
+    {
+      if (!isdigit(argv[argument_index][index]))
+      {
+        return printErrorMessage(ERROR_INVALID_SIZE);
+      }
+    }
+    argument_index++;
+  }
+  int first_argument = atoi(argv[1]);
+  int second_argument = atoi(argv[2]);
+  if (first_argument < 1 || second_argument < 1)
+  {
+    return printErrorMessage(ERROR_INVALID_SIZE);
+  }
+  ErrorCodes result = parseOptions(argc, argv, options);
+  if (result != OK)
+  {
+    return printErrorMessage(result);
+  }
+  return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Parses the optional "--name value" pairs that follow the canvas size.
+/// @param argc Count of command line arguments.
+/// @param argv Holds the command line arguments.
+/// @param options Options to fill, defaults are used for everything not given.
+/// @return OK (0) if every option was valid, ERROR_INVALID_OPTION otherwise.
+ErrorCodes parseOptions(int argc, char* argv[], ProgramOptions* options)
+{
+  options->cache_budget_ = (size_t)DEFAULT_CACHE_SIZE_MB * MEGABYTE;
+  options->thread_count_ = 0;
+  options->script_path_ = NULL;
+  options->half_blocks_ = 0;
+  options->stats_path_ = NULL;
+  options->prune_branches_ = 0;
+  options->prune_budget_ = 0;
+  char* threads = getenv(THREADS_ENVIRONMENT);
+  if (threads != NULL)
+  {
+    options->thread_count_ = atoi(threads);
+  }
+  for (int index = ARGS_COUNT; index < argc; index += 2)
+  {
+    if (index + 1 >= argc)
+    {
+      return ERROR_INVALID_OPTION;
+    }
+    char* value = argv[index + 1];
+    if (strcmp(argv[index], OPTION_SCRIPT) == 0 && value[0] != '\0')
+    {
+      options->script_path_ = value;
+      continue;
+    }
+    if (strcmp(argv[index], OPTION_STATS) == 0 && value[0] != '\0')
+    {
+      options->stats_path_ = value;
+      continue;
+    }
+    if (strcmp(argv[index], OPTION_PRINT_MODE) == 0 &&
+        (strcmp(value, PRINT_MODE_FULL) == 0 || strcmp(value, PRINT_MODE_HALF) == 0))
+    {
+      options->half_blocks_ = strcmp(value, PRINT_MODE_HALF) == 0;
+      continue;
+    }
+    for (int letter = 0; value[letter] != '\0'; letter++)
+    {
+      if (!isdigit((unsigned char)value[letter]))
+      {
+        return ERROR_INVALID_OPTION;
+      }
+    }
+    if (strcmp(argv[index], OPTION_CACHE_SIZE) == 0 && value[0] != '\0')
+    {
+      options->cache_budget_ = (size_t)strtoul(value, NULL, 10) * MEGABYTE;
+    }
+    else if (strcmp(argv[index], OPTION_THREADS) == 0 && value[0] != '\0')
+    {
+      options->thread_count_ = atoi(value);
+    }
+    else if (strcmp(argv[index], OPTION_PRUNE_BRANCHES) == 0 && value[0] != '\0')
+    {
+      options->prune_branches_ = atoi(value);
+    }
+    else if (strcmp(argv[index], OPTION_PRUNE_BUDGET) == 0 && value[0] != '\0')
+    {
+      options->prune_budget_ = (size_t)strtoul(value, NULL, 10) * MEGABYTE;
+    }
+    else
+    {
+      return ERROR_INVALID_OPTION;
+    }
+  }
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Prints the corresponding error message.
+/// @param error_code Holds the error code.
+/// @return Returns the correct return value.
+int printErrorMessage(ErrorCodes error_code)
+{
+  switch (error_code)
+  {
+    case ERROR_MALLOC_FAILED:
+      printf("[ERROR] Memory allocation failed!\n");
+      return 1;
+    case ERROR_INVALID_AMOUNT:
+      printf("[ERROR] Invalid amount of command line parameters!\n");
+      return 2;
+    case ERROR_INVALID_SIZE:
+      printf("[ERROR] Invalid canvas size specified!\n");
+      return 3;
+    case ERROR_COMMAND_UNKNOWN:
+      printf("[ERROR] Command unknown!\n");
+      return -1;
+    case ERROR_ARGUMENTS_AMOUNT:
+      printf("[ERROR] Wrong number of arguments!\n");
+      return -1;
+    case ERROR_BMP_ID_NOT_FOUND:
+      printf("[ERROR] BMP ID not found!\n");
+      return -1;
+    case ERROR_CANNOT_OPEN_FILE:
+      printf("[ERROR] Cannot open file!\n");
+      return -1;
+    case ERROR_INVALID_FILE:
+      printf("[ERROR] Invalid file!\n");
+      return -1;
+    case ERROR_OUT_OF_RANGE:
+      printf("[ERROR] Crop coordinates are outside the BMP!\n");
+      return -1;
+    case ERROR_INVALID_RECTANGLE:
+      printf("[ERROR] Crop coordinates do not form a valid rectangle!\n");
+      return -1;
+    case ERROR_INVALID_COORDINATES:
+      printf("[ERROR] Canvas coordinates are invalid!\n");
+      return -1;
+    case ERROR_BMP_DOESNT_FIT:
+      printf("[ERROR] BMP does not fit on the canvas!\n");
+      return -1;
+    case ERROR_INVALID_BLEND_MODE:
+      printf("[ERROR] Invalid blend mode!\n");
+      return -1;
+    case ERROR_ALREADY_ROOT:
+      printf("[ERROR] Already at root layer!\n");
+      return -1;
+    case ERROR_LAYER_ID_NOT_FOUND:
+      printf("[ERROR] Layer ID not found!\n");
+      return -1;
+    case ERROR_INVALID_FILE_PATH:
+      printf("[ERROR] Invalid file path!\n");
+      return -1;
+    case ERROR_INVALID_OPTION:
+      printf("[ERROR] Invalid command line option!\n");
+      return 2;
+    case ERROR_BMP_IN_USE:
+      printf("[ERROR] BMP is used by a layer!\n");
+      return -1;
+    case ERROR_CANVAS_SIZE_MISMATCH:
+      printf("[ERROR] Project was saved with a different canvas size!\n");
+      return -1;
+    case ERROR_NOT_AN_ANCESTOR:
+      printf("[ERROR] First layer is not an ancestor of the last layer!\n");
+      return -1;
+    case ERROR_FILE_CHANGED:
+      printf("[ERROR] A loaded file was changed by another program!\n");
+      return -1;
+    default:
+      return 0;
+  }
+}
+
+//The following code was taken from my own Assignment 3
+//begin
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Checks if the user input was just white spaces.
 /// @param input_string Stores the user input.
-/// @return Returns the resized input string.
-char* sizeDown(char* input_string)
+/// @return Returns 1 if it is just white spaces, 0 if it is not.
+int isWhiteSpace(char* input_string)
+{
+  int index = 0;
+  int is_space = 1;
+  while (input_string[index] != '\0')
+  {
+    if (!isspace(input_string[index]))
+    {
+      is_space = 0;
+      break;
+    }
+    index++;
+  }
+  return (is_space == 1);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Checks if the user input was empty. (Just newline character or null terminator)
+/// @param input_string Stores the user input.
+/// @return Returns 1 if it is \n or \0, returns 0 if it is not.
+int isEmpty(char* input_string)
+{
+  return ((strcmp(input_string, "\n") == 0) || (input_string[0] == '\0'));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Removes the new line character from a string.
+/// @param string String we remove the new line character from.
+void removeNewLine(char* string)
+{
+  int length = strlen(string);
+  if (length > 0 && string[length - 1] == '\n')
+  {
+    string[length - 1] = '\0';
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief This function checks if all of the input was read from the buffer.
+/// @param input_string Stores the user input.
+/// @param last_character Stores the character we want to find in the string.
+/// @return Returns NULL if last_character was not found and the iterator if it was.
+char* isInputDone(char* input_string, char last_character)
+{
+  for (char* iterator = input_string; *iterator != '\0'; iterator++)
+  {
+    if (*iterator == last_character)
+    {
+      return iterator;
+    }
+  }
+  return NULL;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Sizes up (allocates more memory) for user input if needed.
+/// @param input_string Stores the user input.
+/// @param size Stores the size of the input string.
+/// @return Returns the resized input string.
+char* sizeUp(char* input_string, int* size)
+{
+  while (isInputDone(input_string, '\n') == NULL)
+  {
+    *size += SIZE;
+    char* temporary_string = realloc(input_string, *size * sizeof(char));
+    if (temporary_string == NULL)
+    {
+      free(input_string);
+      input_string = NULL;
+      return NULL;
+    }
+    input_string = temporary_string;
+    temporary_string = NULL;
+    int already_read = strlen(input_string);
+    int read_until = *size - already_read;
+    fgets(input_string + already_read, read_until, stdin);
+  }
+  return input_string;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Sizes down (reallocates less memory than needed) the user input.
+/// @param input_string Stores the user input.
+/// @return Returns the resized input string.
+char* sizeDown(char* input_string)
+{
+  int new_size = strlen(input_string) + 1;
+  char* temporary_string = realloc(input_string, new_size * sizeof(char));
+  if (temporary_string == NULL)
+  {
+    return NULL;
+  }
+  return temporary_string;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Reads and validates user input.
+/// @return Returns the input string.
+char* readInput(void)
+{
+  int size = SIZE;
+  char* input_string = calloc(size, sizeof(char));
+  if (input_string == NULL)
+  {
+    return NULL;
+  }
+
+  char c;
+  while ((c = getchar()) != EOF && isspace(c) && c != '\n'){}
+  if (c != EOF)
+  {
+      ungetc(c, stdin);
+  }
+
+  fgets(input_string, size, stdin);
+
+  if (strcmp(input_string, "\n") == 0)
+  {
+    printErrorMessage(ERROR_COMMAND_UNKNOWN);
+  }
+  if (isInputDone(input_string, '\n') == NULL)
+  {
+    input_string = sizeUp(input_string, &size);
+    if (input_string == NULL)
+    {
+      return NULL;
+    }
+  }
+  if ((int)strlen(input_string) < size)
+  {
+    input_string = sizeDown(input_string);
+    if (input_string == NULL)
+    {
+      return NULL;
+    }
+  }
+  return input_string; 
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Splits string into words.
+/// @param input Input string.
+/// @return  Returns the words.
+char** splitString(char* input)
+{
+  int index = 0;
+  int input_length = strlen(input);
+  char** words = calloc(input_length + 1, sizeof(char*));
+  if (words == NULL)
+  {
+    free(input);
+    return NULL;
+  }
+  char* word = strtok(input, " ");
+  while (word != NULL)
+  {
+    words[index++] = word;
+    word = strtok(NULL, " ");
+  }
+  words[index] = NULL;
+  return words;
+}
+//end
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Prints the successful crop message.
+/// @param bmp_id Id of the bmp.
+/// @param new_bmp_id Id of the new cropped bmp.
+/// @param width Width of the new bmp.
+/// @param height Height of the new bmp.
+void printCropMessage(int bmp_id, int new_bmp_id, int width, int height)
+{
+  printf("Cropped ID %d to new ID %d with dimensions %d x %d\n",
+          bmp_id, new_bmp_id, width, height);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Prints the successful undo message.
+/// @param id Id of the layer we switched to after undo.
+void printUndoMessage(int id)
+{
+  printf("Switched to layer %d\n", id);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Prints successful place message.
+/// @param layer_id Id of the layer we switched to after placing.
+void printPlaceMessage(int layer_id)
+{
+  printf("Switched to layer %d\n", layer_id);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Prints successful switch message.
+/// @param layer_id Id of the layer we switched to.
+void printSwitchMessage(int layer_id)
+{
+  printf("Switched to layer %d\n", layer_id);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Prints list of commands.
+void printCommandList(void)
+{
+  printf("\n"
+         "Available commands:\n"
+         " help\n"
+         " load <PATH>\n"
+         " crop <BMP_ID> <TOP_X> <TOP_Y> <BOTTOM_X> <BOTTOM_Y>\n"
+         " place <BMP_ID> <CANVAS_X> <CANVAS_Y> <BLEND_MODE>\n"
+         " undo\n"
+         " print\n"
+         " switch <LAYER_ID>\n"
+         " tree\n"
+         " bmps\n"
+         " save <FILE_PATH>\n"
+         " unload <BMP_ID>\n"
+         " loadall <PATTERN>\n"
+         " flatten <LAYER_ID>\n"
+         " savestate <FILE_PATH>\n"
+         " loadstate <FILE_PATH>\n"
+         " export <FROM_LAYER_ID> <TO_LAYER_ID> <PATTERN>\n"
+         " prune\n"
+         " quit\n"
+         "\n");
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Checks if input was the quit command and trims trailing spaces.
+/// @param input User input.
+/// @return Returns true if it was, false if not.
+int isQuit(char* input)
+{
+  removeNewLine(input);
+  int len = strlen(input);
+  while (len > 0 && isspace((unsigned char)input[len - 1]))
+  {
+    input[len - 1] = '\0';
+    len--;
+  }
+  return strcmp("quit", input) == 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Counts the number of arguments, including the command itself.
+/// @param words User input split into words.
+/// @return Returns number of arguments.
+int countArguments(char** words)
+{
+  int number_of_arguments = 0;
+  while (words[number_of_arguments] != NULL)
+  {
+    number_of_arguments++;
+  }
+  return number_of_arguments;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Takes a zeroed layer from the arena. Layers freed by prune are reused first, the others are handed out
+///        from chunks that double in size up to a limit, so placing many layers costs few allocations and layers
+///        never move in memory.
+/// @param arena The layer arena.
+/// @return The layer or NULL if memory allocation failed.
+Layer* allocateLayer(LayerArena* arena)
+{
+  if (arena->free_layers_ != NULL)
+  {
+    Layer* layer = arena->free_layers_;
+    arena->free_layers_ = layer->next_sibling_;
+    memset(layer, 0, sizeof(Layer));
+    return layer;
+  }
+  if (arena->chunks_ == NULL || arena->chunks_->used_ == arena->chunks_->capacity_)
+  {
+    int capacity = arena->next_capacity_ > 0 ? arena->next_capacity_ : LAYER_CHUNK_CAPACITY;
+    LayerChunk* chunk = calloc(1, sizeof(LayerChunk) + capacity * sizeof(Layer));
+    if (chunk == NULL)
+    {
+      return NULL;
+    }
+    chunk->capacity_ = capacity;
+    chunk->next_ = arena->chunks_;
+    arena->chunks_ = chunk;
+    arena->next_capacity_ = capacity < LAYER_CHUNK_MAXIMUM_CAPACITY ? capacity * 2 : capacity;
+  }
+  return &arena->chunks_->layers_[arena->chunks_->used_++];
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Releases every layer of the arena at once.
+/// @param arena The layer arena.
+void freeLayerArena(LayerArena* arena)
+{
+  while (arena->chunks_ != NULL)
+  {
+    LayerChunk* next = arena->chunks_->next_;
+    free(arena->chunks_);
+    arena->chunks_ = next;
+  }
+  arena->next_capacity_ = 0;
+  arena->free_layers_ = NULL;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Makes sure the id table has room for the next layer id, doubling its size when it is full.
+/// @param layers_tree The layer tree of the program.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed.
+ErrorCodes resizeLayerTable(TreeNode* layers_tree)
+{
+  if (layers_tree->next_id_ < layers_tree->table_capacity_)
+  {
+    return OK;
+  }
+  int new_capacity = layers_tree->table_capacity_ > 0 ? layers_tree->table_capacity_ * 2 : LAYER_TABLE_CAPACITY;
+  Layer** temporary = realloc(layers_tree->layer_table_, new_capacity * sizeof(Layer*));
+  if (temporary == NULL)
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+  memset(temporary + layers_tree->table_capacity_, 0, (new_capacity - layers_tree->table_capacity_) * sizeof(Layer*));
+  layers_tree->layer_table_ = temporary;
+  layers_tree->table_capacity_ = new_capacity;
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Drops the free ids at the end of the id table, so the next layer gets the id after the last layer left, and
+///        halves the table while it is at most a quarter full.
+/// @param layers_tree The layer tree of the program.
+/// @param reclaimed_bytes Receives the bytes the table gave back in addition.
+void shrinkLayerTable(TreeNode* layers_tree, size_t* reclaimed_bytes)
+{
+  while (layers_tree->layer_table_[layers_tree->next_id_ - 1] == NULL)
+  {
+    layers_tree->next_id_--;
+  }
+  int new_capacity = layers_tree->table_capacity_;
+  while (new_capacity / 2 >= LAYER_TABLE_CAPACITY && layers_tree->next_id_ <= new_capacity / 4)
+  {
+    new_capacity /= 2;
+  }
+  if (new_capacity == layers_tree->table_capacity_)
+  {
+    return;
+  }
+  // a table that cannot shrink in place keeps its size
+  Layer** temporary = realloc(layers_tree->layer_table_, new_capacity * sizeof(Layer*));
+  if (temporary != NULL)
+  {
+    *reclaimed_bytes += (size_t)(layers_tree->table_capacity_ - new_capacity) * sizeof(Layer*);
+    layers_tree->layer_table_ = temporary;
+    layers_tree->table_capacity_ = new_capacity;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Looks up a layer by its id in constant time.
+/// @param layers_tree The layer tree of the program.
+/// @param layer_id Id of the layer.
+/// @return The layer or NULL if there is no layer with that id.
+Layer* findLayer(TreeNode* layers_tree, int layer_id)
+{
+  if (layer_id < 0 || layer_id >= layers_tree->next_id_)
+  {
+    return NULL;
+  }
+  return layers_tree->layer_table_[layer_id];
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Lists a subtree in pre-order (parents before children, children in the order they were placed). The walk
+///        follows the child, sibling and parent links, so it needs neither recursion nor a stack.
+/// @param root First layer of the subtree.
+/// @param order Receives the layers.
+/// @param depths Receives the depth of every layer relative to root, may be NULL.
+/// @param capacity Size of order and depths, at least the number of layers in the subtree.
+/// @return Number of layers listed.
+int traverseLayers(Layer* root, Layer** order, int* depths, int capacity)
+{
+  int count = 0;
+  int depth = 0;
+  Layer* layer = root;
+  while (layer != NULL && count < capacity)
+  {
+    order[count] = layer;
+    if (depths != NULL)
+    {
+      depths[count] = depth;
+    }
+    count++;
+    if (layer->first_child_ != NULL)
+    {
+      layer = layer->first_child_;
+      depth++;
+      continue;
+    }
+    while (layer != root && layer->next_sibling_ == NULL)
+    {
+      layer = layer->parent_layer_;
+      depth--;
+    }
+    layer = layer != root ? layer->next_sibling_ : NULL;
+  }
+  return count;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Creates the root layer and sets it as canvas.
+/// @param width Width of the canvas.
+/// @param height Height of the canvas.
+/// @param options Settings for the snapshot cache and the render threads.
+/// @return  layers tree if everything passed, NULL for memory allocation fail.
+TreeNode* createRootLayer(int width, int height, ProgramOptions* options)
+{
+  TreeNode* layers = calloc(1, sizeof(TreeNode));
+  if (layers == NULL)
+  {
+    printErrorMessage(ERROR_MALLOC_FAILED);
+    return NULL;
+  }
+  Layer* root = allocateLayer(&layers->arena_);
+  if (root == NULL)
+  {
+    free(layers);
+    printErrorMessage(ERROR_MALLOC_FAILED);
+    return NULL;
+  }
+
+  root->layer_id_ = ROOT_LAYER_ID;
+  root->width_ = width;
+  root->height_ = height;
+  root->parent_layer_ = NULL;
+
+  layers->next_id_ = root->layer_id_ + 1;
+  layers->cache_budget_ = options->cache_budget_;
+  layers->half_blocks_ = options->half_blocks_;
+  layers->stats_path_ = options->stats_path_;
+  layers->prune_branches_ = options->prune_branches_;
+  layers->prune_budget_ = options->prune_budget_;
+  layers->layers_count_ = 1;
+  layers->current_active_layer_ = root;
+  layers->current_active_layer_->number_of_children_ = START_NUMBER_OF_CHILDREN;
+
+  layers->thread_pool_ = createThreadPool(options->thread_count_);
+  if (layers->thread_pool_ == NULL || resizeLayerTable(layers) != OK)
+  {
+    freeThreadPool(layers->thread_pool_);
+    freeLayerArena(&layers->arena_);
+    free(layers);
+    printErrorMessage(ERROR_MALLOC_FAILED);
+    return NULL;
+  }
+  layers->layer_table_[root->layer_id_] = root;
+  return layers;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Allocates a pixel buffer on the heap with one reference.
+/// @param size Size of the buffer in bytes.
+/// @return The buffer or NULL if memory allocation failed.
+PixelBuffer* createPixelBuffer(size_t size)
+{
+  PixelBuffer* buffer = calloc(1, sizeof(PixelBuffer));
+  if (buffer == NULL)
+  {
+    return NULL;
+  }
+  buffer->data_ = malloc(size);
+  if (buffer->data_ == NULL)
+  {
+    free(buffer);
+    return NULL;
+  }
+  buffer->size_ = size;
+  buffer->reference_count_ = 1;
+  return buffer;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Adds a reference to a pixel buffer that is shared by another BMP.
+/// @param buffer The buffer.
+/// @return The same buffer.
+PixelBuffer* retainPixelBuffer(PixelBuffer* buffer)
+{
+  buffer->reference_count_++;
+  return buffer;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Drops one reference of a pixel buffer and frees or unmaps it when the last one is gone.
+/// @param buffer The buffer, may be NULL.
+void releasePixelBuffer(PixelBuffer* buffer)
+{
+  if (buffer == NULL || --buffer->reference_count_ > 0)
+  {
+    return;
+  }
+  if (buffer->is_mapped_)
+  {
+    munmap(buffer->data_, buffer->size_);
+  }
+  else
+  {
+    free(buffer->data_);
+  }
+  free(buffer->path_);
+  free(buffer);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Maps a whole file into memory read only. Pages are only read from disk when they are touched, and they are
+///        shared with the page cache. Files that cannot be mapped are read into a heap buffer instead.
+/// @param path Path to the file.
+/// @param buffer Receives the buffer holding the file.
+/// @param populate 1 to read the whole file right away instead of on first touch.
+/// @param status Receives the status of the mapped file, may be NULL.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed, -1 for other errors
+ErrorCodes mapFile(char* path, PixelBuffer** buffer, int populate, struct stat* status)
+{
+  int descriptor = open(path, O_RDONLY);
+  if (descriptor < 0)
+  {
+    return ERROR_CANNOT_OPEN_FILE;
+  }
+  struct stat file_status;
+  if (fstat(descriptor, &file_status) != 0 || !S_ISREG(file_status.st_mode) ||
+      file_status.st_size < MINIMUM_FILE_SIZE)
+  {
+    close(descriptor);
+    return ERROR_INVALID_FILE;
+  }
+  size_t size = (size_t)file_status.st_size;
+  PixelBuffer* new_buffer = calloc(1, sizeof(PixelBuffer));
+  if (new_buffer == NULL)
+  {
+    close(descriptor);
+    return ERROR_MALLOC_FAILED;
+  }
+  new_buffer->size_ = size;
+  new_buffer->reference_count_ = 1;
+
+  void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), descriptor, 0);
+  if (mapping != MAP_FAILED)
+  {
+    new_buffer->data_ = mapping;
+    new_buffer->is_mapped_ = 1;
+    new_buffer->device_ = file_status.st_dev;
+    new_buffer->inode_ = file_status.st_ino;
+    new_buffer->modified_ns_ =
+      (int64_t)file_status.st_mtim.tv_sec * NANOSECONDS_PER_SECOND + file_status.st_mtim.tv_nsec;
+    new_buffer->path_ = malloc(strlen(path) + 1);
+    if (new_buffer->path_ == NULL)
+    {
+      munmap(mapping, size);
+      free(new_buffer);
+      close(descriptor);
+      return ERROR_MALLOC_FAILED;
+    }
+    strcpy(new_buffer->path_, path);
+  }
+  else
+  {
+    new_buffer->data_ = malloc(size);
+    size_t already_read = 0;
+    while (new_buffer->data_ != NULL && already_read < size)
+    {
+      ssize_t read_now = pread(descriptor, new_buffer->data_ + already_read, size - already_read, already_read);
+      if (read_now <= 0)
+      {
+        break;
+      }
+      already_read += read_now;
+    }
+    if (new_buffer->data_ == NULL || already_read < size)
+    {
+      ErrorCodes result = new_buffer->data_ == NULL ? ERROR_MALLOC_FAILED : ERROR_INVALID_FILE;
+      free(new_buffer->data_);
+      free(new_buffer);
+      close(descriptor);
+      return result;
+    }
+  }
+  close(descriptor);
+  if (status != NULL)
+  {
+    *status = file_status;
+  }
+  *buffer = new_buffer;
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Copies a pixel buffer that is mapped from a file into the heap and moves every bmp that uses it to the copy.
+/// @param library The bmp library of the program.
+/// @param buffer The mapped buffer.
+/// @param readable_size Bytes that can still be read from the mapping, the rest of the copy is zeroed. Pages past the
+///        end of a file that was truncated cannot be touched.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed.
+ErrorCodes copyMappedBuffer(BmpLibrary* library, PixelBuffer* buffer, size_t readable_size)
+{
+  char* data = calloc(buffer->size_, sizeof(char));
+  if (data == NULL)
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+  memcpy(data, buffer->data_, readable_size < buffer->size_ ? readable_size : buffer->size_);
+  for (int id = 0; id < library->next_id_; id++)
+  {
+    BMP* bmp = library->bmps_[id];
+    if (bmp != NULL && bmp->buffer_ == buffer)
+    {
+      bmp->pixels_ = data + (bmp->pixels_ - buffer->data_);
+    }
+  }
+  munmap(buffer->data_, buffer->size_);
+  buffer->data_ = data;
+  buffer->is_mapped_ = 0;
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Has to be called before a file is written. Bmps point into the mapping of the file they were loaded from,
+///        so writing that file would change their pixels, and truncating it would make them unreadable. Buffers that
+///        are mapped from the same file (same device and inode) are copied into the heap first.
+/// @param library The bmp library of the program.
+/// @param path Path of the file that is about to be written.
+/// @return OK (0) if no bmp uses the file any more, ERROR_MALLOC_FAILED (1) if memory allocation failed.
+ErrorCodes detachMappedFile(BmpLibrary* library, const char* path)
+{
+  struct stat file_status;
+  if (stat(path, &file_status) != 0)
+  {
+    return OK;
+  }
+  for (int id = 0; id < library->next_id_; id++)
+  {
+    BMP* bmp = library->bmps_[id];
+    if (bmp != NULL && bmp->buffer_->is_mapped_ && bmp->buffer_->device_ == file_status.st_dev &&
+        bmp->buffer_->inode_ == file_status.st_ino &&
+        copyMappedBuffer(library, bmp->buffer_, bmp->buffer_->size_) != OK)
+    {
+      return ERROR_MALLOC_FAILED;
+    }
+  }
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Has to be called before a command reads pixels. A mapping shows what another program writes into the
+///        file, and touching pages past the end of a truncated file kills the program with SIGBUS. Files that still
+///        have the size and modification time they were mapped with are fine, so are files that were replaced or
+///        deleted because the mapping keeps the old inode. A file that was changed in place is copied into the heap as
+///        far as it can still be read, so later commands cannot crash, and the command is rejected.
+/// @param library The bmp library of the program.
+/// @return OK (0) if no mapped file changed, ERROR_MALLOC_FAILED (1) if memory allocation failed,
+///         ERROR_FILE_CHANGED if a file was changed by another program.
+ErrorCodes checkMappedFiles(BmpLibrary* library)
+{
+  ErrorCodes result = OK;
+  for (int id = 0; id < library->next_id_; id++)
+  {
+    BMP* bmp = library->bmps_[id];
+    if (bmp == NULL || !bmp->buffer_->is_mapped_)
+    {
+      continue;
+    }
+    PixelBuffer* buffer = bmp->buffer_;
+    struct stat file_status;
+    if (stat(buffer->path_, &file_status) != 0 || file_status.st_dev != buffer->device_ ||
+        file_status.st_ino != buffer->inode_)
+    {
+      continue;
+    }
+    int64_t modified_ns = (int64_t)file_status.st_mtim.tv_sec * NANOSECONDS_PER_SECOND + file_status.st_mtim.tv_nsec;
+    if ((size_t)file_status.st_size == buffer->size_ && modified_ns == buffer->modified_ns_)
+    {
+      continue;
+    }
+    if (copyMappedBuffer(library, buffer, (size_t)file_status.st_size) != OK)
+    {
+      return ERROR_MALLOC_FAILED;
+    }
+    result = ERROR_FILE_CHANGED;
+  }
+  return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Gets a row of the bmp, counted from the top. Rows are reached through the stride, so bottom-up files do not
+///        have to be flipped and crops do not have to be copied.
+/// @param bmp The bmp.
+/// @param y Row index from the top.
+/// @return Pointer to the first pixel of the row.
+char* getBmpRow(BMP* bmp, int y)
+{
+  return bmp->pixels_ + (ptrdiff_t)y * bmp->stride_;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Reads a bmp without adding it to the library, so several files can be read at once. The file is memory
+///        mapped and the BMP references the pixel rows in place. 24-bit, 8-bit and RLE8 files are expanded into a BGRA
+///        buffer instead, every other bit depth is read as 32-bit BGRA like before. The pixels are not hashed here,
+///        getContentHash() does that once a bmp of the same size is looked up for sharing.
+/// @param path Path to the bmp.
+/// @param bmp Receives the new bmp.
+/// @param populate 1 to read the whole file right away instead of on first use.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed, -1 for other errors
+ErrorCodes readBmp(char* path, BMP** bmp, int populate)
+{
+  PixelBuffer* buffer = NULL;
+  struct stat file_status;
+  ErrorCodes result = mapFile(path, &buffer, populate, &file_status);
+  if (result != OK)
+  {
+    return result;
+  }
+  BmpHeader header;
+  memset(&header, 0, sizeof(BmpHeader));
+  memcpy(&header, buffer->data_, buffer->size_ < sizeof(BmpHeader) ? buffer->size_ : sizeof(BmpHeader));
+  if (header.b_ != FIRST_MAGIC_NUMBER || header.m_ != SECOND_MAGIC_NUMBER)
+  {
+    releasePixelBuffer(buffer);
+    return ERROR_INVALID_FILE;
+  }
+
+  uint32_t pixel_offset = header.offset_pixel_array_;
+  int32_t width = header.width_;
+  int32_t height = header.height_;
+  int bits_per_pixel = header.number_of_bits_per_pixel_;
+  int is_encoded = header.compression_ == BMP_COMPRESSION_RLE8 && bits_per_pixel == 8;
+  int is_decoded = is_encoded || (header.compression_ == BMP_COMPRESSION_RGB && (bits_per_pixel == 24 ||
+                                                                                 bits_per_pixel == 8));
+
+  int64_t rows = height < 0 ? -(int64_t)height : height;
+  size_t row_size = is_decoded ? getStoredRowSize(width, bits_per_pixel) : (size_t)width * BYTE;
+  if (width <= 0 || rows == 0 || rows > INT32_MAX || pixel_offset > buffer->size_ ||
+      (!is_encoded && (buffer->size_ - pixel_offset) / row_size < (size_t)rows) ||
+      (is_decoded && (header.number_of_bytes_in_header_ < INFO_HEADER_SIZE ||
+                      (size_t)width * rows > SIZE_MAX / BYTE)) ||
+      (is_encoded && (height < 0 || (size_t)width * rows > getRle8PixelLimit(buffer->size_ - pixel_offset, width))))
+  {
+    releasePixelBuffer(buffer);
+    return ERROR_INVALID_FILE;
+  }
+
+  BMP* new_bmp = calloc(1, sizeof(BMP));
+  if (new_bmp == NULL)
+  {
+    releasePixelBuffer(buffer);
+    return ERROR_MALLOC_FAILED;
+  }
+  new_bmp->width_ = width;
+  new_bmp->height_ = (int)rows;
+  new_bmp->buffer_ = buffer;
+  char* data = buffer->data_;
+  if (height > 0 && !is_encoded)
+  {
+    new_bmp->pixels_ = data + pixel_offset + (rows - 1) * row_size;
+    new_bmp->stride_ = -(ptrdiff_t)row_size;
+  }
+  else
+  {
+    new_bmp->pixels_ = data + pixel_offset;
+    new_bmp->stride_ = (ptrdiff_t)row_size;
+  }
+  if (is_decoded)
+  {
+    result = decodeBmp(new_bmp, buffer, &header);
+    if (result != OK)
+    {
+      freeBmp(new_bmp);
+      return result;
+    }
+  }
+
+  new_bmp->path_ = calloc((strlen(path) + 1), sizeof(char));
+  if (new_bmp->path_ == NULL)
+  {
+    freeBmp(new_bmp);
+    return ERROR_MALLOC_FAILED;
+  }
+  strcpy(new_bmp->path_, path);
+  new_bmp->path_hash_ = hashName(path);
+  new_bmp->modified_ns_ = (int64_t)file_status.st_mtim.tv_sec * NANOSECONDS_PER_SECOND + file_status.st_mtim.tv_nsec;
+  new_bmp->file_size_ = (int64_t)file_status.st_size;
+  *bmp = new_bmp;
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Loads the bmp and stores it in the library. A file that is loaded already and did not change is not read
+///        again, and pixels the library already holds are shared.
+/// @param path Path to the bmp.
+/// @param library The bmp library of the program.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed, -1 for other errors
+ErrorCodes loadBmp(char* path, BmpLibrary* library)
+{
+  BMP* new_bmp = loadCachedBmp(path, library);
+  if (new_bmp == NULL)
+  {
+    ErrorCodes result = readBmp(path, &new_bmp, 0);
+    if (result != OK)
+    {
+      return result;
+    }
+  }
+  if (addIndexedBmp(library, new_bmp) != OK)
+  {
+    freeBmp(new_bmp);
+    return ERROR_MALLOC_FAILED;
+  }
+
+  printf("Loaded %s with ID %d and dimensions %d %d\n",
+  path, new_bmp->bmp_id_, new_bmp->width_, new_bmp->height_);
+
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Creates a bmp for a file that the library loaded already, if the file has the same modification time and
+///        size as back then. The new bmp shares the pixels of the loaded one, so the file is not read at all.
+/// @param path Path to the bmp.
+/// @param library The bmp library of the program.
+/// @return The new bmp, or NULL if the file has to be read (also when memory allocation failed).
+BMP* loadCachedBmp(char* path, BmpLibrary* library)
+{
+  struct stat file_status;
+  if (stat(path, &file_status) != 0 || !S_ISREG(file_status.st_mode))
+  {
+    return NULL;
+  }
+  BMP* loaded_bmp = findLoadedPath(library, path, &file_status);
+  BMP* new_bmp = loaded_bmp != NULL ? calloc(1, sizeof(BMP)) : NULL;
+  char* new_path = new_bmp != NULL ? malloc(strlen(path) + 1) : NULL;
+  if (new_path == NULL)
+  {
+    free(new_bmp);
+    return NULL;
+  }
+  strcpy(new_path, path);
+  new_bmp->width_ = loaded_bmp->width_;
+  new_bmp->height_ = loaded_bmp->height_;
+  new_bmp->path_ = new_path;
+  new_bmp->path_hash_ = loaded_bmp->path_hash_;
+  new_bmp->modified_ns_ = loaded_bmp->modified_ns_;
+  new_bmp->file_size_ = loaded_bmp->file_size_;
+  shareTwinPixels(new_bmp, loaded_bmp);
+  return new_bmp;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Reads one file of a loadall command on a worker thread.
+/// @param context The LoadJob.
+/// @param task_index Index of the file.
+void loadTask(void* context, int task_index)
+{
+  LoadJob* job = context;
+  if (job->bmps_[task_index] == NULL)
+  {
+    job->results_[task_index] = readBmp(job->paths_[task_index], &job->bmps_[task_index], 1);
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Loads every bmp matching a glob pattern. The files are read and decoded in parallel on the thread pool,
+///        then added to the library in sorted path order, so the ids do not depend on which file was read first.
+///        Files that fail to load get their error printed and are skipped.
+/// @param pattern The glob pattern.
+/// @param library The bmp library of the program.
+/// @param thread_pool The thread pool.
+/// @return OK (0) if the pattern matched, ERROR_MALLOC_FAILED (1) if memory allocation failed,
+///         ERROR_CANNOT_OPEN_FILE (-1) if no file matched.
+ErrorCodes loadAllCommand(char* pattern, BmpLibrary* library, ThreadPool* thread_pool)
+{
+  glob_t matches;
+  int glob_result = glob(pattern, 0, NULL, &matches);
+  if (glob_result == GLOB_NOSPACE)
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+  if (glob_result != 0)
+  {
+    globfree(&matches);
+    return ERROR_CANNOT_OPEN_FILE;
+  }
+  int files_count = (int)matches.gl_pathc;
+  LoadJob job = {matches.gl_pathv, calloc(files_count, sizeof(BMP*)), calloc(files_count, sizeof(ErrorCodes))};
+  if (job.bmps_ == NULL || job.results_ == NULL)
+  {
+    free(job.bmps_);
+    free(job.results_);
+    globfree(&matches);
+    return ERROR_MALLOC_FAILED;
+  }
+  for (int index = 0; index < files_count; index++)
+  {
+    job.bmps_[index] = loadCachedBmp(job.paths_[index], library);
+  }
+  runThreadPool(thread_pool, loadTask, &job, files_count);
+
+  ErrorCodes result = OK;
+  for (int index = 0; index < files_count; index++)
+  {
+    BMP* new_bmp = job.bmps_[index];
+    if (job.results_[index] == OK && result == OK && addIndexedBmp(library, new_bmp) != OK)
+    {
+      result = ERROR_MALLOC_FAILED;
+    }
+    if (result != OK)
+    {
+      freeBmp(new_bmp);
+    }
+    else if (job.results_[index] == OK)
+    {
+      printf("Loaded %s with ID %d and dimensions %d %d\n",
+      job.paths_[index], new_bmp->bmp_id_, new_bmp->width_, new_bmp->height_);
+    }
+    else
+    {
+      printErrorMessage(job.results_[index]);
+    }
+  }
+  free(job.bmps_);
+  free(job.results_);
+  globfree(&matches);
+  return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Expands the pixels of a 24-bit, 8-bit or RLE8 bmp into a new BGRA buffer in one pass. On success the bmp
+///        refers to the new buffer and the file is released.
+/// @param bmp The bmp, its rows still point into the file.
+/// @param file Buffer holding the file.
+/// @param header Header of the file.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed, ERROR_INVALID_FILE (-1)
+///         if the compressed data is broken.
+ErrorCodes decodeBmp(BMP* bmp, PixelBuffer* file, BmpHeader* header)
+{
+  PixelBuffer* pixels = createPixelBuffer((size_t)bmp->width_ * bmp->height_ * BYTE);
+  if (pixels == NULL)
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+  uint32_t palette[PALETTE_SIZE];
+  int is_paletted = header->number_of_bits_per_pixel_ == 8;
+  if (is_paletted)
+  {
+    size_t palette_offset = FILE_HEADER_SIZE + (size_t)header->number_of_bytes_in_header_;
+    size_t colors_count = header->colors_in_palette_ != 0 ? header->colors_in_palette_ : PALETTE_SIZE;
+    colors_count = colors_count < PALETTE_SIZE ? colors_count : PALETTE_SIZE;
+    if (palette_offset > file->size_)
+    {
+      colors_count = 0;
+    }
+    else if ((file->size_ - palette_offset) / BYTE < colors_count)
+    {
+      colors_count = (file->size_ - palette_offset) / BYTE;
+    }
+    buildPalette(palette, (unsigned char*)file->data_ + palette_offset, (int)colors_count);
+  }
+
+  if (header->compression_ == BMP_COMPRESSION_RLE8)
+  {
+    size_t pixel_offset = header->offset_pixel_array_;
+    if (decodeRle8((unsigned char*)pixels->data_, bmp->width_, bmp->height_,
+                   (unsigned char*)file->data_ + pixel_offset, file->size_ - pixel_offset, palette) != 0)
+    {
+      releasePixelBuffer(pixels);
+      return ERROR_INVALID_FILE;
+    }
+  }
+  else
+  {
+    decodeRows((unsigned char*)pixels->data_, (unsigned char*)bmp->pixels_, bmp->stride_, bmp->width_, bmp->height_,
+               is_paletted ? palette : NULL);
+  }
+  releasePixelBuffer(file);
+  bmp->buffer_ = pixels;
+  bmp->pixels_ = pixels->data_;
+  bmp->stride_ = (ptrdiff_t)bmp->width_ * BYTE;
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Prints the bmps.
+/// @param library The bmp library of the program.
+void printBmps(BmpLibrary* library)
+{
+  if (library == NULL)
+  {
+    return;
+  }
+
+  for (int index = 0; index < library->next_id_; index++)
+  {
+    if (library->bmps_[index] != NULL)
+    {
+      printf("BMP %d has dimensions %d x %d\n", 
+      library->bmps_[index]->bmp_id_, library->bmps_[index]->width_, library->bmps_[index]->height_);
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Validates the bmp ID. Ids are indexes into the library, unloaded ids leave an empty slot.
+/// @param id Id we are looking for.
+/// @param library The bmp library of the program.
+/// @return OK (0) if it was found, ERROR_BMP_ID_NOT_FOUND (-1) if it was not.
+ErrorCodes checkBmpId(int id, BmpLibrary* library)
+{
+  if (id < 0 || id >= library->next_id_ || library->bmps_[id] == NULL)
+  {
+    return ERROR_BMP_ID_NOT_FOUND;
+  }
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Removes a bmp from the library, its id is handed out again by the next load or crop. Bmps that are placed
+///        on a layer stay loaded because the layer tree refers to them.
+/// @param id_string Id of the bmp from user input.
+/// @param library The bmp library of the program.
+/// @return OK (0) if everything passed, ERROR_BMP_ID_NOT_FOUND or ERROR_BMP_IN_USE (-1) otherwise.
+ErrorCodes unloadCommand(char* id_string, BmpLibrary* library)
+{
+  for (int index = 0; id_string[index] != '\0'; index++)
+  {
+    if (!isdigit((unsigned char)id_string[index]))
+    {
+      return ERROR_BMP_ID_NOT_FOUND;
+    }
+  }
+  int id = atoi(id_string);
+  if (checkBmpId(id, library) != OK)
+  {
+    return ERROR_BMP_ID_NOT_FOUND;
+  }
+  if (library->bmps_[id]->use_count_ > 0)
+  {
+    return ERROR_BMP_IN_USE;
+  }
+  unindexBmp(library, library->bmps_[id]);
+  freeBmp(library->bmps_[id]);
+  library->bmps_[id] = NULL;
+  library->free_ids_[library->free_count_++] = id;
+  printf("Unloaded BMP %d\n", id);
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Validates the arguments and crops the bmp. The cropped bmp is a view that shares the pixel buffer of the
+///        original one, only its first row pointer and size differ. If the library already holds the same pixels,
+///        the crop shares those instead.
+/// @param words User input split into words.
+/// @param library The bmp library of the program.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if malloc failed, -1 for everything else.
+ErrorCodes cropCommand(char** words, BmpLibrary* library)
+{
+  int id = atoi(words[1]);
+  int top_x = atoi(words[2]);
+  int top_y = atoi(words[3]);
+  int bottom_x = atoi(words[4]);
+  int bottom_y = atoi(words[5]);
+
+  if (checkBmpId(id, library) != OK)
+  {
+    return ERROR_BMP_ID_NOT_FOUND;
+  }
+  for (int index_words = 1; index_words < CROP_ARGS_COUNT; index_words++)
+  {
+    for (int index_letters = 0; words[index_words][index_letters] != 0; index_letters++)
+    {
+      if (!isdigit(words[index_words][index_letters]))
+      {
+        return ERROR_OUT_OF_RANGE;
+      }
+    }
+  }
+  BMP *old_bmp = library->bmps_[id];
+  if (top_x <= 0 || top_y <= 0 ||
+      bottom_x > old_bmp->width_ ||
+      bottom_y > old_bmp->height_)
+  {
+    return ERROR_OUT_OF_RANGE;
+  }
+  if (bottom_x < top_x || bottom_y < top_y )
+  {
+    return ERROR_INVALID_RECTANGLE;
+  }
+  int crop_width  = bottom_x - top_x + 1;
+  int crop_height = bottom_y - top_y + 1;
+  BMP *new_bmp = calloc(1, sizeof(BMP));
+  if (new_bmp == NULL)
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+  new_bmp->buffer_ = retainPixelBuffer(old_bmp->buffer_);
+  new_bmp->pixels_ = getBmpRow(old_bmp, top_y - 1) + (size_t)(top_x - 1) * BYTE;
+  new_bmp->stride_ = old_bmp->stride_;
+  new_bmp->width_ = crop_width;
+  new_bmp->height_ = crop_height;
+  new_bmp->path_ = NULL;
+
+  if (addIndexedBmp(library, new_bmp) != OK)
+  {
+    freeBmp(new_bmp);
+    return ERROR_MALLOC_FAILED;
+  }
+  printCropMessage(id, new_bmp->bmp_id_, crop_width, crop_height);
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Validates the blend mode.
+/// @param mode Blend mode from user input.
+/// @return OK (0) if everything passed, ERROR_INVALID_BLEND_MODE (-1) if blend mode was incorrect.
+ErrorCodes checkBlendMode(char mode)
+{
+  if (getBlendRowFunction(mode) == NULL)
+  {
+    return ERROR_INVALID_BLEND_MODE;
+  }
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Places bmp on the canvas by storing bmps in different layers on the layer tree.
+/// @param id Id of the bmp.
+/// @param canvas_x X coordinate where bmp is placed on the canvas.
+/// @param canvas_y Y coordinate where bmp is placed on the canvas.
+/// @param blend_mode Blend mode with which bmp should be placed.
+/// @param library The bmp library of the program.
+/// @param layers_tree The layer tree of the program.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if malloc failed, (-1,2,3) for every other error.
+ErrorCodes placeBmp(int id, int canvas_x, int canvas_y, char blend_mode, BmpLibrary* library, TreeNode* layers_tree)
+{
+  if (resizeLayerTable(layers_tree) != OK)
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+  Layer* new_layer = allocateLayer(&layers_tree->arena_);
+  if (new_layer == NULL)
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+  Layer* parent = layers_tree->current_active_layer_;
+  new_layer->width_ = parent->width_;
+  new_layer->height_ = parent->height_;
+
+  new_layer->bmp_ = library->bmps_[id];
+  new_layer->bmp_->use_count_++;
+  new_layer->coordinate_x_ = canvas_x - 1;
+  new_layer->coordinate_y_ = canvas_y - 1;
+  new_layer->blend_mode_ = blend_mode;
+  new_layer->blend_row_ = getBlendRowFunction(blend_mode);
+  new_layer->parent_layer_ = parent;
+  new_layer->depth_ = parent->depth_ + 1;
+  new_layer->number_of_children_ = START_NUMBER_OF_CHILDREN;
+
+  if (parent->last_child_ != NULL)
+  {
+    parent->last_child_->next_sibling_ = new_layer;
+    layers_tree->branches_since_prune_++;
+  }
+  else
+  {
+    parent->first_child_ = new_layer;
+  }
+  parent->last_child_ = new_layer;
+  parent->number_of_children_++;
+  layers_tree->layers_count_++;
+  new_layer->layer_id_ = layers_tree->next_id_++;
+  layers_tree->layer_table_[new_layer->layer_id_] = new_layer;
+  layers_tree->current_active_layer_ = new_layer;
+
+  printPlaceMessage(new_layer->layer_id_);
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Validates the place command and calls placeBmp() to actually place the bmp. A new branch may make the
+///        automatic prune policy free the abandoned ones.
+/// @param library The bmp library of the program.
+/// @param words User input split into words.
+/// @param layers_tree The layer tree of the program.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if malloc failed, (-1,2,3) for every other error.
+ErrorCodes placeCommand(BmpLibrary* library, char** words, TreeNode* layers_tree)
+{
+  int id = atoi(words[1]);
+  int canvas_x = atoi(words[2]);
+  int canvas_y = atoi(words[3]);
+  char blend_mode = words[4][0];
+  ErrorCodes result = checkBmpId(id, library);
+  if (result != OK)
+  {
+    return result;
+  }
+  for (int index_words = 1; index_words < PLACE_ARGS_COUNT - 1; index_words++)
+  {
+    for (int index_letters = 0; words[index_words][index_letters] != 0; index_letters++)
+    {
+      if (!isdigit((unsigned char)words[index_words][index_letters]))
+      {
+        return ERROR_INVALID_COORDINATES;
+      }
+    }
+  }
+  Layer* layer = layers_tree->current_active_layer_;
+  BMP* bmp = library->bmps_[id];
+  
+  if (canvas_x <= 0 || canvas_y <= 0)
+  {
+    return ERROR_INVALID_COORDINATES;
+  }
+
+  if ((canvas_x - 1 + bmp->width_) > layer->width_ ||
+    (canvas_y - 1 + bmp->height_) > layer->height_)
+  {
+    return ERROR_BMP_DOESNT_FIT;
+  }
+
+  if (words[4][1] != '\0') 
+  {
+      return ERROR_INVALID_BLEND_MODE;
+  }
+  result = checkBlendMode(blend_mode);
+  if (result != OK) 
+  {
+      return result;
+  }
+  result = placeBmp(id, canvas_x, canvas_y, blend_mode, library, layers_tree);
+  if (result != 0)
+  {
+    return result;
+  }
+  return applyPrunePolicy(layers_tree);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Switches user to the previous layer.
+/// @param layers_tree The layer tree of the program.
+/// @return OK (0) if everything passed, ERROR_ALREADY_ROOT (-1) if already at root layer.
+ErrorCodes undoCommand(TreeNode* layers_tree)
+{
+  if (layers_tree->current_active_layer_->layer_id_ == ROOT_LAYER_ID)
+  {
+    return ERROR_ALREADY_ROOT;
+  }
+  layers_tree->current_active_layer_ = layers_tree->current_active_layer_->parent_layer_;
+  printUndoMessage(layers_tree->current_active_layer_->layer_id_);
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Starts at leaf, goes up to root by parent layer to get the array of layers to print. Stops early at the
+///        first layer that has a cached snapshot or was flattened, since everything below it is already composited
+///        there.
+/// @param layers_tree The layer tree of the program.
+/// @param layers_to_print Array of the layers we want to print, needs room for depth_ of the active layer.
+/// @param cached_base Receives the layer whose pixels the blending starts from, NULL to start from white.
+/// @return last_index which is actually the count of all layers we want to print excluding the root layer.
+int getLayers(TreeNode* layers_tree, Layer** layers_to_print, Layer** cached_base)
+{
+  Layer* current_layer = layers_tree->current_active_layer_;
+  int last_index = 0;
+  *cached_base = NULL;
+  while (current_layer->layer_id_ != 0)
+  {
+    if (current_layer->snapshot_ != NULL || current_layer->flattened_bmp_ != NULL)
+    {
+      *cached_base = current_layer;
+      break;
+    }
+    layers_to_print[last_index++] = current_layer;
+    current_layer = current_layer->parent_layer_;
+  }
+
+  for (int index = 0; index < last_index / 2; index++)
+  {
+    Layer* temporary = layers_to_print[index];
+    layers_to_print[index] = layers_to_print[last_index - 1 - index];
+    layers_to_print[last_index - 1 - index] = temporary;
+  }
+
+  return last_index;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Gets the composited canvas a render starts from when it is stored as one block of pixels. A snapshot is
+///        preferred and is read tile by tile instead.
+/// @param cached_base Layer returned by getLayers().
+/// @return The flattened bmp of the layer, NULL to start from white or from the snapshot.
+const char* getBasePixels(Layer* cached_base)
+{
+  if (cached_base == NULL || cached_base->snapshot_ != NULL)
+  {
+    return NULL;
+  }
+  return cached_base->flattened_bmp_->pixels_;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Blends the layer pixels together. The kernel of the blend mode is looked up from blend.c when the layer is
+///        placed, and every row is handed to it.
+/// @param layer Current layer.
+/// @param canvas The root layer.
+/// @param canvas_width Width of the canvas.
+void blendLayer(Layer* layer, char* canvas, int canvas_width)
+{
+  blendLayerRows(layer, canvas, canvas_width, 0, layer->coordinate_y_ + layer->bmp_->height_);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Blends only the part of the layer that lies within the given canvas rows.
+/// @param layer Current layer.
+/// @param canvas Memory of the canvas rows from first_row to end_row.
+/// @param canvas_width Width of the canvas.
+/// @param first_row First canvas row to blend.
+/// @param end_row Canvas row after the last one to blend.
+void blendLayerRows(Layer* layer, char* canvas, int canvas_width, int first_row, int end_row)
+{
+  BMP* bmp = layer->bmp_;
+  if (layer->blend_row_ == NULL)
+  {
+    return;
+  }
+  int first_y = first_row > layer->coordinate_y_ ? first_row - layer->coordinate_y_ : 0;
+  int end_y = end_row - layer->coordinate_y_ < bmp->height_ ? end_row - layer->coordinate_y_ : bmp->height_;
+  for (int y = first_y; y < end_y; y++)
+  {
+    size_t canvas_index =
+      ((size_t)(layer->coordinate_y_ + y - first_row) * canvas_width + layer->coordinate_x_) * BYTE;
+    blendBmpRow(layer, canvas + canvas_index, y, 0, bmp->width_);
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Blends a span of one bmp row onto the canvas. Normal mode follows the opacity spans of the row when the bmp
+///        has them: transparent runs leave the canvas as it is, opaque runs are copied and only partial runs are
+///        blended.
+/// @param layer Current layer.
+/// @param canvas_pixel First canvas pixel of the span.
+/// @param y Row of the bmp.
+/// @param first_x First column of the bmp.
+/// @param pixel_count Number of pixels to blend.
+void blendBmpRow(Layer* layer, char* canvas_pixel, int y, int first_x, int pixel_count)
+{
+  BMP* bmp = layer->bmp_;
+  if (layer->blend_mode_ == BLEND_MODE_N && bmp->spans_ != NULL)
+  {
+    const char* bmp_row = getBmpRow(bmp, y);
+    const OpacitySpan* span = bmp->spans_ + bmp->row_spans_[y];
+    while (span->end_x_ <= first_x)
+    {
+      span++;
+    }
+    int end_x = first_x + pixel_count;
+    for (int x = first_x; x < end_x; span++)
+    {
+      int span_end = span->end_x_ < end_x ? span->end_x_ : end_x;
+      char* canvas_span = canvas_pixel + (size_t)(x - first_x) * BYTE;
+      if (span->kind_ == OPACITY_OPAQUE)
+      {
+        memcpy(canvas_span, bmp_row + (size_t)x * BYTE, (size_t)(span_end - x) * BYTE);
+      }
+      else if (span->kind_ == OPACITY_PARTIAL)
+      {
+        layer->blend_row_((unsigned char*)canvas_span, (const unsigned char*)bmp_row + (size_t)x * BYTE,
+                          span_end - x);
+      }
+      x = span_end;
+    }
+    return;
+  }
+  layer->blend_row_((unsigned char*)canvas_pixel, (unsigned char*)getBmpRow(bmp, y) + (size_t)first_x * BYTE,
+                    pixel_count);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Finds the opacity spans of the bmps of normal mode layers the first time they are blended. This runs
+///        before the bands are handed to the threads. The spans are an optimization, so a bmp that cannot get the
+///        memory is simply blended pixel by pixel.
+/// @param layers Layers that are about to be blended.
+/// @param layers_count Number of layers.
+void buildLayerSpans(Layer** layers, int layers_count)
+{
+  for (int index = 0; index < layers_count; index++)
+  {
+    BMP* bmp = layers[index]->bmp_;
+    if (layers[index]->blend_mode_ == BLEND_MODE_N && bmp->spans_ == NULL)
+    {
+      buildOpacitySpans(bmp);
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Adds a run of pixels to the opacity spans of the current row. Transparent and opaque runs shorter than
+///        MINIMUM_SPAN_LENGTH count as partial, so noisy alpha does not end up with one span per pixel, and a run is
+///        merged into the previous span of the row when both have the same kind.
+/// @param bmp The bmp whose spans are built.
+/// @param spans_count Count of spans so far.
+/// @param capacity Capacity of bmp->spans_.
+/// @param row_start Index of the first span of the current row.
+/// @param end_x Column after the run, the run starts where the previous span of the row ends.
+/// @param kind Kind of the run.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if the spans could not grow.
+ErrorCodes appendOpacitySpan(BMP* bmp, int* spans_count, int* capacity, int row_start, int end_x, OpacityKinds kind)
+{
+  int start_x = *spans_count > row_start ? bmp->spans_[*spans_count - 1].end_x_ : 0;
+  if (kind != OPACITY_PARTIAL && end_x - start_x < MINIMUM_SPAN_LENGTH)
+  {
+    kind = OPACITY_PARTIAL;
+  }
+  if (*spans_count > row_start && bmp->spans_[*spans_count - 1].kind_ == kind)
+  {
+    bmp->spans_[*spans_count - 1].end_x_ = end_x;
+    return OK;
+  }
+  if (*spans_count == *capacity)
+  {
+    OpacitySpan* temporary = realloc(bmp->spans_, (size_t)*capacity * 2 * sizeof(OpacitySpan));
+    if (temporary == NULL)
+    {
+      return ERROR_MALLOC_FAILED;
+    }
+    bmp->spans_ = temporary;
+    *capacity *= 2;
+  }
+  bmp->spans_[*spans_count].end_x_ = end_x;
+  bmp->spans_[*spans_count].kind_ = kind;
+  (*spans_count)++;
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Splits every row of a bmp into runs of fully transparent, fully opaque and partially covered pixels. The
+///        spans of row y are bmp->spans_[bmp->row_spans_[y]] up to the first span of the next row, every span ends
+///        where the next one starts and the last one of a row ends at the width.
+/// @param bmp The bmp.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed.
+ErrorCodes buildOpacitySpans(BMP* bmp)
+{
+  int capacity = bmp->height_ + 1;
+  int spans_count = 0;
+  bmp->spans_ = malloc(capacity * sizeof(OpacitySpan));
+  bmp->row_spans_ = malloc(((size_t)bmp->height_ + 1) * sizeof(int));
+  ErrorCodes result = bmp->spans_ == NULL || bmp->row_spans_ == NULL ? ERROR_MALLOC_FAILED : OK;
+  for (int y = 0; y < bmp->height_ && result == OK; y++)
+  {
+    const unsigned char* row = (const unsigned char*)getBmpRow(bmp, y);
+    bmp->row_spans_[y] = spans_count;
+    int run_start = 0;
+    for (int x = 1; x <= bmp->width_ && result == OK; x++)
+    {
+      unsigned alpha = row[(size_t)run_start * BYTE + ALPHA_CHANNEL];
+      if (x < bmp->width_ && row[(size_t)x * BYTE + ALPHA_CHANNEL] == alpha)
+      {
+        continue;
+      }
+      // partial alphas that differ still form one run
+      OpacityKinds kind = alpha == 0 ? OPACITY_TRANSPARENT : alpha == OPAQUE_ALPHA ? OPACITY_OPAQUE : OPACITY_PARTIAL;
+      if (kind == OPACITY_PARTIAL)
+      {
+        while (x < bmp->width_ && row[(size_t)x * BYTE + ALPHA_CHANNEL] != 0 &&
+               row[(size_t)x * BYTE + ALPHA_CHANNEL] != OPAQUE_ALPHA)
+        {
+          x++;
+        }
+      }
+      result = appendOpacitySpan(bmp, &spans_count, &capacity, bmp->row_spans_[y], x, kind);
+      run_start = x;
+    }
+  }
+  if (result != OK)
+  {
+    free(bmp->spans_);
+    free(bmp->row_spans_);
+    bmp->spans_ = NULL;
+    bmp->row_spans_ = NULL;
+    return result;
+  }
+  bmp->row_spans_[bmp->height_] = spans_count;
+  return OK;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Blends only the part of the layer that lies within a rectangle of the canvas.
+/// @param layer Current layer.
+/// @param canvas Memory of the whole canvas.
+/// @param canvas_width Width of the canvas.
+/// @param rectangle The part of the canvas to blend.
+void blendLayerRectangle(Layer* layer, char* canvas, int canvas_width, Rectangle* rectangle)
+{
+  BMP* bmp = layer->bmp_;
+  if (layer->blend_row_ == NULL)
+  {
+    return;
+  }
+  int first_x = rectangle->x_ > layer->coordinate_x_ ? rectangle->x_ - layer->coordinate_x_ : 0;
+  int end_x = rectangle->end_x_ - layer->coordinate_x_ < bmp->width_ ? rectangle->end_x_ - layer->coordinate_x_
+                                                                       : bmp->width_;
+  int first_y = rectangle->y_ > layer->coordinate_y_ ? rectangle->y_ - layer->coordinate_y_ : 0;
+  int end_y = rectangle->end_y_ - layer->coordinate_y_ < bmp->height_ ? rectangle->end_y_ - layer->coordinate_y_
+                                                                        : bmp->height_;
+  for (int y = first_y; y < end_y && first_x < end_x; y++)
+  {
+    size_t canvas_index =
+      ((size_t)(layer->coordinate_y_ + y) * canvas_width + layer->coordinate_x_ + first_x) * BYTE;
+    blendBmpRow(layer, canvas + canvas_index, y, first_x, end_x - first_x);
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Removes a layer from the snapshot LRU list without freeing its snapshot.
+/// @param layers_tree The layer tree of the program.
+/// @param layer Layer to unlink.
+void unlinkSnapshot(TreeNode* layers_tree, Layer* layer)
+{
+  if (layer->lru_previous_ != NULL)
+  {
+    layer->lru_previous_->lru_next_ = layer->lru_next_;
+  }
+  else
+  {
+    layers_tree->lru_head_ = layer->lru_next_;
+  }
+  if (layer->lru_next_ != NULL)
+  {
+    layer->lru_next_->lru_previous_ = layer->lru_previous_;
+  }
+  else
+  {
+    layers_tree->lru_tail_ = layer->lru_previous_;
+  }
+  layer->lru_previous_ = NULL;
+  layer->lru_next_ = NULL;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Adds a layer to the front of the snapshot LRU list, marking its snapshot as most recently used.
+/// @param layers_tree The layer tree of the program.
+/// @param layer Layer whose snapshot was used, must not be in the list.
+void linkSnapshot(TreeNode* layers_tree, Layer* layer)
+{
+  layer->lru_previous_ = NULL;
+  layer->lru_next_ = layers_tree->lru_head_;
+  if (layers_tree->lru_head_ != NULL)
+  {
+    layers_tree->lru_head_->lru_previous_ = layer;
+  }
+  layers_tree->lru_head_ = layer;
+  if (layers_tree->lru_tail_ == NULL)
+  {
+    layers_tree->lru_tail_ = layer;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Frees the snapshot of a layer and gives its bytes back to the cache budget.
+/// @param layers_tree The layer tree of the program.
+/// @param layer Layer whose snapshot gets evicted.
+void evictSnapshot(TreeNode* layers_tree, Layer* layer)
+{
+  unlinkSnapshot(layers_tree, layer);
+  layers_tree->cache_used_ -= layer->snapshot_->size_;
+  freeTiledCanvas(layer->snapshot_);
+  layer->snapshot_ = NULL;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Creates a tiled canvas without tiles. The canvas is split into squares of TILE_SIZE pixels (smaller at the
+///        right and bottom edge), every tile stores its rows back to back and a missing tile is white.
+/// @param width Width of the canvas.
+/// @param height Height of the canvas.
+/// @return The canvas or NULL if memory allocation failed.
+TiledCanvas* createTiledCanvas(int width, int height)
+{
+  TiledCanvas* canvas = calloc(1, sizeof(TiledCanvas));
+  if (canvas == NULL)
+  {
+    return NULL;
+  }
+  canvas->width_ = width;
+  canvas->height_ = height;
+  canvas->columns_ = (width + TILE_SIZE - 1) / TILE_SIZE;
+  canvas->rows_ = (height + TILE_SIZE - 1) / TILE_SIZE;
+  canvas->tiles_ = calloc((size_t)canvas->columns_ * canvas->rows_, sizeof(char*));
+  if (canvas->tiles_ == NULL)
+  {
+    free(canvas);
+    return NULL;
+  }
+  canvas->size_ = sizeof(TiledCanvas) + (size_t)canvas->columns_ * canvas->rows_ * sizeof(char*);
+  return canvas;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Frees a tiled canvas and its tiles.
+/// @param canvas The canvas.
+void freeTiledCanvas(TiledCanvas* canvas)
+{
+  if (canvas == NULL)
+  {
+    return;
+  }
+  for (size_t tile = 0; tile < (size_t)canvas->columns_ * canvas->rows_; tile++)
+  {
+    free(canvas->tiles_[tile]);
+  }
+  free(canvas->tiles_);
+  free(canvas);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Gets the size of one tile.
+/// @param canvas The canvas.
+/// @param tile Index of the tile, row by row.
+/// @return Size of the tile in bytes.
+size_t getTileSize(TiledCanvas* canvas, int tile)
+{
+  int64_t x = (int64_t)(tile % canvas->columns_) * TILE_SIZE;
+  int64_t y = (int64_t)(tile / canvas->columns_) * TILE_SIZE;
+  int64_t width = canvas->width_ - x < TILE_SIZE ? canvas->width_ - x : TILE_SIZE;
+  int64_t height = canvas->height_ - y < TILE_SIZE ? canvas->height_ - y : TILE_SIZE;
+  return (size_t)(width * height * BYTE);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Copies a part of some rows out of a tiled canvas, missing tiles give white pixels.
+/// @param canvas The canvas.
+/// @param first_row First row to copy.
+/// @param end_row Row after the last one.
+/// @param x First column to copy.
+/// @param end_x Column after the last one.
+/// @param destination Receives pixel x of the first row, the rows are width_ pixels apart.
+void readTiledRows(const TiledCanvas* canvas, int first_row, int end_row, int x, int end_x, char* destination)
+{
+  size_t row_size = (size_t)canvas->width_ * BYTE;
+  for (int y = first_row; y < end_row; y++)
+  {
+    char* output = destination + (size_t)(y - first_row) * row_size;
+    char** tile_row = canvas->tiles_ + (size_t)(y / TILE_SIZE) * canvas->columns_;
+    for (int64_t column_x = x; column_x < end_x;)
+    {
+      int64_t tile_x = column_x - column_x % TILE_SIZE;
+      int64_t tile_end = tile_x + TILE_SIZE < end_x ? tile_x + TILE_SIZE : end_x;
+      size_t bytes = (size_t)(tile_end - column_x) * BYTE;
+      const char* tile = tile_row[column_x / TILE_SIZE];
+      if (tile == NULL)
+      {
+        memset(output, 255, bytes);
+      }
+      else
+      {
+        int64_t tile_width = canvas->width_ - tile_x < TILE_SIZE ? canvas->width_ - tile_x : TILE_SIZE;
+        memcpy(output, tile + ((y % TILE_SIZE) * tile_width + column_x - tile_x) * BYTE, bytes);
+      }
+      output += bytes;
+      column_x = tile_end;
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Copies whole rows into the tiles a tiled canvas has, the parts that fall on missing tiles are skipped. Rows
+///        are only written by one thread, so bands can be stored in parallel.
+/// @param canvas The canvas.
+/// @param first_row First row to store.
+/// @param end_row Row after the last one.
+/// @param source The first row, the rows are width_ pixels apart.
+void writeTiledRows(TiledCanvas* canvas, int first_row, int end_row, const char* source)
+{
+  size_t row_size = (size_t)canvas->width_ * BYTE;
+  for (int y = first_row; y < end_row; y++)
+  {
+    const char* input = source + (size_t)(y - first_row) * row_size;
+    char** tile_row = canvas->tiles_ + (size_t)(y / TILE_SIZE) * canvas->columns_;
+    for (int column = 0; column < canvas->columns_; column++)
+    {
+      int64_t tile_x = (int64_t)column * TILE_SIZE;
+      int64_t tile_width = canvas->width_ - tile_x < TILE_SIZE ? canvas->width_ - tile_x : TILE_SIZE;
+      if (tile_row[column] != NULL)
+      {
+        memcpy(tile_row[column] + (y % TILE_SIZE) * tile_width * BYTE, input + tile_x * BYTE, tile_width * BYTE);
+      }
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Copies a part of the canvas a render starts from.
+/// @param base Flattened pixels to start from, see getBasePixels().
+/// @param base_tiles Snapshot to start from.
+/// @param canvas_width Width of the canvas.
+/// @param first_row First row to copy.
+/// @param end_row Row after the last one.
+/// @param x First column to copy.
+/// @param end_x Column after the last one.
+/// @param destination Receives pixel x of the first row, the rows are canvas_width pixels apart.
+void copyBaseRows(const char* base, const TiledCanvas* base_tiles, int canvas_width, int first_row, int end_row,
+                  int x, int end_x, char* destination)
 {
-  int new_size = strlen(input_string) + 1;
-  char* temporary_string = realloc(input_string, new_size * sizeof(char));
-  if (temporary_string == NULL)
+  if (base_tiles != NULL)
   {
-    return NULL;
+    readTiledRows(base_tiles, first_row, end_row, x, end_x, destination);
+    return;
+  }
+  size_t row_size = (size_t)canvas_width * BYTE;
+  size_t width_size = (size_t)(end_x - x) * BYTE;
+  for (int y = first_row; y < end_row; y++)
+  {
+    char* output = destination + (size_t)(y - first_row) * row_size;
+    if (base != NULL)
+    {
+      memcpy(output, base + (size_t)y * row_size + (size_t)x * BYTE, width_size);
+    }
+    else
+    {
+      memset(output, 255, width_size);
+    }
   }
-  return temporary_string;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Reads and validates user input.
-/// @return Returns the input string.
-char* readInput(void)
+/// @brief Marks the tiles a layer covers.
+/// @param touched One flag per tile of the canvas.
+/// @param canvas_width Width of the canvas.
+/// @param canvas_height Height of the canvas.
+/// @param layer The layer.
+void markLayerTiles(char* touched, int canvas_width, int canvas_height, Layer* layer)
 {
-  int size = SIZE;
-  char* input_string = calloc(size, sizeof(char));
-  if (input_string == NULL)
+  int columns = (canvas_width + TILE_SIZE - 1) / TILE_SIZE;
+  int64_t end_x = (int64_t)layer->coordinate_x_ + layer->bmp_->width_;
+  int64_t end_y = (int64_t)layer->coordinate_y_ + layer->bmp_->height_;
+  end_x = end_x < canvas_width ? end_x : canvas_width;
+  end_y = end_y < canvas_height ? end_y : canvas_height;
+  for (int64_t row = layer->coordinate_y_ / TILE_SIZE; row * TILE_SIZE < end_y; row++)
+  {
+    for (int64_t column = layer->coordinate_x_ / TILE_SIZE; column * TILE_SIZE < end_x; column++)
+    {
+      touched[row * columns + column] = 1;
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Allocates a snapshot within the cache budget, evicting the least recently used snapshots if needed. Only
+///        the tiles a layer up to the snapshot touched (or the render started from) get memory, the rest of the
+///        snapshot is white, so a large canvas with little on it costs little. The snapshot is counted as used but
+///        not linked into the LRU list, so it cannot be evicted while the render that fills it is running. Caching is
+///        best effort, so failing to allocate is not an error.
+/// @param layers_tree The layer tree of the program.
+/// @param width Width of the canvas.
+/// @param height Height of the canvas.
+/// @param touched One flag per tile, the tiles that need memory.
+/// @return The snapshot or NULL if it does not fit.
+TiledCanvas* reserveSnapshot(TreeNode* layers_tree, int width, int height, const char* touched)
+{
+  TiledCanvas* snapshot = createTiledCanvas(width, height);
+  if (snapshot == NULL)
+  {
+    return NULL;
+  }
+  int tiles_count = snapshot->columns_ * snapshot->rows_;
+  size_t snapshot_size = snapshot->size_;
+  for (int tile = 0; tile < tiles_count; tile++)
+  {
+    snapshot_size += touched[tile] ? getTileSize(snapshot, tile) : 0;
+  }
+  if (snapshot_size > layers_tree->cache_budget_)
+  {
+    freeTiledCanvas(snapshot);
+    return NULL;
+  }
+  while (layers_tree->cache_used_ + snapshot_size > layers_tree->cache_budget_ && layers_tree->lru_tail_ != NULL)
+  {
+    evictSnapshot(layers_tree, layers_tree->lru_tail_);
+  }
+  if (layers_tree->cache_used_ + snapshot_size > layers_tree->cache_budget_)
   {
+    freeTiledCanvas(snapshot);
     return NULL;
   }
+  for (int tile = 0; tile < tiles_count; tile++)
+  {
+    if (touched[tile] && (snapshot->tiles_[tile] = malloc(getTileSize(snapshot, tile))) == NULL)
+    {
+      freeTiledCanvas(snapshot);
+      return NULL;
+    }
+  }
+  snapshot->size_ = snapshot_size;
+  layers_tree->cache_used_ += snapshot_size;
+  return snapshot;
+}
 
-  char c;
-  while ((c = getchar()) != EOF && isspace(c) && c != '\n'){}
-  if (c != EOF)
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Builds a uniform grid over the canvas that lists, for every cell, the indices of the layers overlapping it.
+///        The lists are stored back to back (one start offset per cell) and are sorted because layers are inserted
+///        in blending order.
+/// @param grid The grid to build.
+/// @param layers Layers in blending order.
+/// @param layers_count Number of layers.
+/// @param canvas_width Width of the canvas.
+/// @param canvas_height Height of the canvas.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed
+ErrorCodes buildLayerGrid(LayerGrid* grid, Layer** layers, int layers_count, int canvas_width, int canvas_height)
+{
+  int larger_side = canvas_width > canvas_height ? canvas_width : canvas_height;
+  grid->cell_size_ = (larger_side + GRID_MAXIMUM_CELLS - 1) / GRID_MAXIMUM_CELLS;
+  if (grid->cell_size_ < GRID_MINIMUM_CELL_SIZE)
   {
-      ungetc(c, stdin);
+    grid->cell_size_ = GRID_MINIMUM_CELL_SIZE;
+  }
+  grid->columns_ = (canvas_width + grid->cell_size_ - 1) / grid->cell_size_;
+  grid->rows_ = (canvas_height + grid->cell_size_ - 1) / grid->cell_size_;
+  grid->layers_ = layers;
+  grid->layers_count_ = layers_count;
+  int cells_count = grid->columns_ * grid->rows_;
+  grid->cell_start_ = calloc(cells_count + 1, sizeof(int));
+  if (grid->cell_start_ == NULL)
+  {
+    return ERROR_MALLOC_FAILED;
   }
 
-  fgets(input_string, size, stdin);
+  for (int pass = 0; pass < 2; pass++)
+  {
+    for (int index = 0; index < layers_count; index++)
+    {
+      Layer* layer = layers[index];
+      int first_column = layer->coordinate_x_ / grid->cell_size_;
+      int last_column = (layer->coordinate_x_ + layer->bmp_->width_ - 1) / grid->cell_size_;
+      int first_row = layer->coordinate_y_ / grid->cell_size_;
+      int last_row = (layer->coordinate_y_ + layer->bmp_->height_ - 1) / grid->cell_size_;
+      for (int row = first_row; row <= last_row; row++)
+      {
+        for (int column = first_column; column <= last_column; column++)
+        {
+          int cell = row * grid->columns_ + column;
+          if (pass == 0)
+          {
+            grid->cell_start_[cell + 1]++;
+          }
+          else
+          {
+            grid->entries_[grid->cell_start_[cell]++] = index;
+          }
+        }
+      }
+    }
+    if (pass == 0)
+    {
+      for (int cell = 0; cell < cells_count; cell++)
+      {
+        grid->cell_start_[cell + 1] += grid->cell_start_[cell];
+      }
+      grid->entries_ = malloc((grid->cell_start_[cells_count] + 1) * sizeof(int));
+      if (grid->entries_ == NULL)
+      {
+        free(grid->cell_start_);
+        return ERROR_MALLOC_FAILED;
+      }
+    }
+  }
+  // the second pass moved every start offset to the end of its cell, which is the start of the next one
+  for (int cell = cells_count; cell > 0; cell--)
+  {
+    grid->cell_start_[cell] = grid->cell_start_[cell - 1];
+  }
+  grid->cell_start_[0] = 0;
+  return OK;
+}
 
-  if (strcmp(input_string, "\n") == 0)
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Compares two layer indices for qsort.
+/// @param first First index.
+/// @param second Second index.
+/// @return Negative, zero or positive like strcmp.
+int compareLayerIndices(const void* first, const void* second)
+{
+  return *(const int*)first - *(const int*)second;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Finds the layers that overlap a rectangle of the canvas. A layer covering several cells is only taken from
+///        the first of its cells inside the rectangle, so no layer is reported twice.
+/// @param grid The grid.
+/// @param x Left edge of the rectangle.
+/// @param y Top edge of the rectangle.
+/// @param width Width of the rectangle.
+/// @param height Height of the rectangle.
+/// @param found Receives the layer indices in blending order, must have room for every layer.
+/// @return Number of layers found.
+int queryLayerGrid(LayerGrid* grid, int x, int y, int width, int height, int* found)
+{
+  int found_count = 0;
+  int first_column = x / grid->cell_size_;
+  int last_column = (x + width - 1) / grid->cell_size_;
+  int first_row = y / grid->cell_size_;
+  int last_row = (y + height - 1) / grid->cell_size_;
+  last_column = last_column < grid->columns_ ? last_column : grid->columns_ - 1;
+  last_row = last_row < grid->rows_ ? last_row : grid->rows_ - 1;
+  for (int row = first_row; row <= last_row; row++)
   {
-    printErrorMessage(ERROR_COMMAND_UNKNOWN);
+    for (int column = first_column; column <= last_column; column++)
+    {
+      int cell = row * grid->columns_ + column;
+      for (int entry = grid->cell_start_[cell]; entry < grid->cell_start_[cell + 1]; entry++)
+      {
+        Layer* layer = grid->layers_[grid->entries_[entry]];
+        int layer_column = layer->coordinate_x_ / grid->cell_size_;
+        int layer_row = layer->coordinate_y_ / grid->cell_size_;
+        if ((layer_column > first_column ? layer_column : first_column) != column ||
+            (layer_row > first_row ? layer_row : first_row) != row)
+        {
+          continue;
+        }
+        if (layer->coordinate_x_ < x + width && layer->coordinate_x_ + layer->bmp_->width_ > x &&
+            layer->coordinate_y_ < y + height && layer->coordinate_y_ + layer->bmp_->height_ > y)
+        {
+          found[found_count++] = grid->entries_[entry];
+        }
+      }
+    }
   }
-  if (isInputDone(input_string, '\n') == NULL)
+  qsort(found, found_count, sizeof(int), compareLayerIndices);
+  return found_count;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Frees the memory of a layer grid.
+/// @param grid The grid.
+void freeLayerGrid(LayerGrid* grid)
+{
+  free(grid->cell_start_);
+  free(grid->entries_);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Gets the number of rows per band so that one band stays in the cache while all layers are blended into it.
+/// @param canvas_width Width of the canvas.
+/// @return Rows per band, at least 1.
+int getBandHeight(int canvas_width)
+{
+  size_t row_size = (size_t)canvas_width * BYTE;
+  return row_size < BAND_CACHE_BYTES ? (int)(BAND_CACHE_BYTES / row_size) : 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Composites every layer of a render job into one band of canvas rows, small enough to stay in the cache.
+///        Only the layers the grid reports for the band are blended. Snapshots are still copied in layer order, so
+///        they hold the band as it looks after their layer even if that layer does not touch the band.
+/// @param context The RenderJob.
+/// @param band Index of the band, counted from the first row of the job.
+void renderBand(void* context, int band)
+{
+  RenderJob* job = context;
+  int first_row = job->first_row_ + band * job->band_height_;
+  int end_row = first_row + job->band_height_ < job->end_row_ ? first_row + job->band_height_ : job->end_row_;
+  size_t row_size = (size_t)job->canvas_width_ * BYTE;
+  char* band_canvas = job->canvas_ + (size_t)(first_row - job->first_row_) * row_size;
+
+  int* found = job->grid_ != NULL ? malloc((job->layers_count_ + 1) * sizeof(int)) : NULL;
+  int found_count = job->layers_count_;
+  if (found != NULL)
   {
-    input_string = sizeUp(input_string, &size);
-    if (input_string == NULL)
+    found_count = queryLayerGrid(job->grid_, 0, first_row, job->canvas_width_, end_row - first_row, found);
+  }
+  // a band of the white canvas that no layer touches is left to the caller, it does not need to be filled
+  if (job->blank_bands_ != NULL && job->base_ == NULL && job->base_tiles_ == NULL && found != NULL &&
+      found_count == 0)
+  {
+    job->blank_bands_[band] = 1;
+    free(found);
+    return;
+  }
+  copyBaseRows(job->base_, job->base_tiles_, job->canvas_width_, first_row, end_row, 0, job->canvas_width_,
+               band_canvas);
+  int snapshot = 0;
+  for (int found_index = 0; found_index < found_count; found_index++)
+  {
+    int index = found != NULL ? found[found_index] : found_index;
+    for (; snapshot < job->snapshots_count_ && job->snapshot_indices_[snapshot] < index; snapshot++)
     {
-      return NULL;
+      writeTiledRows(job->snapshots_[job->snapshot_indices_[snapshot]], first_row, end_row, band_canvas);
     }
+    blendLayerRows(job->layers_[index], band_canvas, job->canvas_width_, first_row, end_row);
   }
-  if ((int)strlen(input_string) < size)
+  for (; snapshot < job->snapshots_count_; snapshot++)
   {
-    input_string = sizeDown(input_string);
-    if (input_string == NULL)
+    writeTiledRows(job->snapshots_[job->snapshot_indices_[snapshot]], first_row, end_row, band_canvas);
+  }
+  free(found);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Composites the active layer into the canvas. Starts from the nearest cached ancestor (or white) and
+///        snapshots the active layer as well as branch points on the way so switching between branches stays cheap.
+///        A snapshot only keeps the tiles that the layers up to it (or the cached ancestor) touched. The canvas is
+///        split into bands of rows that are composited in parallel on the thread pool.
+/// @param layers_tree The layer tree of the program.
+/// @param canvas Canvas of width * height pixels that receives the result.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed
+ErrorCodes renderCanvas(TreeNode* layers_tree, char* canvas)
+{
+  Layer* active_layer = layers_tree->current_active_layer_;
+  int canvas_width = active_layer->width_;
+  int canvas_height = active_layer->height_;
+  size_t tiles_count =
+    (size_t)((canvas_width + TILE_SIZE - 1) / TILE_SIZE) * ((canvas_height + TILE_SIZE - 1) / TILE_SIZE);
+
+  Layer** layers_to_print = calloc(active_layer->depth_ + 1, sizeof(Layer*));
+  TiledCanvas** snapshots = calloc(active_layer->depth_ + 1, sizeof(TiledCanvas*));
+  char* touched = calloc(tiles_count, sizeof(char));
+  if (layers_to_print == NULL || snapshots == NULL || touched == NULL)
+  {
+    free(touched);
+    free(layers_to_print);
+    free(snapshots);
+    return ERROR_MALLOC_FAILED;
+  }
+  double start = getSeconds();
+  Layer* cached_base = NULL;
+  int layers_count = getLayers(layers_tree, layers_to_print, &cached_base);
+  buildLayerSpans(layers_to_print, layers_count);
+  Layer* cached_snapshot = cached_base != NULL && cached_base->snapshot_ != NULL ? cached_base : NULL;
+  if (cached_snapshot != NULL)
+  {
+    unlinkSnapshot(layers_tree, cached_snapshot);
+  }
+  int* snapshot_indices = malloc((layers_count + 1) * sizeof(int));
+  if (snapshot_indices == NULL)
+  {
+    if (cached_snapshot != NULL)
     {
-      return NULL;
+      linkSnapshot(layers_tree, cached_snapshot);
+    }
+    free(touched);
+    free(layers_to_print);
+    free(snapshots);
+    return ERROR_MALLOC_FAILED;
+  }
+  for (size_t tile = 0; cached_base != NULL && tile < tiles_count; tile++)
+  {
+    touched[tile] = cached_snapshot == NULL || cached_snapshot->snapshot_->tiles_[tile] != NULL;
+  }
+  int snapshots_count = 0;
+  for (int index = 0; index < layers_count; index++)
+  {
+    Layer* layer = layers_to_print[index];
+    markLayerTiles(touched, canvas_width, canvas_height, layer);
+    if (layer == active_layer || layer->number_of_children_ > 1)
+    {
+      snapshots[index] = reserveSnapshot(layers_tree, canvas_width, canvas_height, touched);
+      if (snapshots[index] != NULL)
+      {
+        snapshot_indices[snapshots_count++] = index;
+      }
     }
   }
-  return input_string; 
+  free(touched);
+
+  LayerGrid grid;
+  int has_grid = buildLayerGrid(&grid, layers_to_print, layers_count, canvas_width, canvas_height) == OK;
+  RenderJob job = {layers_to_print, snapshots, layers_count, has_grid ? &grid : NULL, snapshot_indices,
+                   snapshots_count, NULL, NULL, canvas, canvas_width, 0, canvas_height, 1, NULL};
+  job.base_ = getBasePixels(cached_base);
+  job.base_tiles_ = cached_snapshot != NULL ? cached_snapshot->snapshot_ : NULL;
+  job.band_height_ = getBandHeight(canvas_width);
+  int band_count = (canvas_height + job.band_height_ - 1) / job.band_height_;
+  runThreadPool(layers_tree->thread_pool_, renderBand, &job, band_count);
+  addStageTime(layers_tree, STAGE_BLEND, getSeconds() - start, (uint64_t)canvas_width * canvas_height);
+  if (has_grid)
+  {
+    freeLayerGrid(&grid);
+  }
+  free(snapshot_indices);
+
+  if (cached_snapshot != NULL)
+  {
+    linkSnapshot(layers_tree, cached_snapshot);
+  }
+  for (int index = 0; index < layers_count; index++)
+  {
+    if (snapshots[index] != NULL)
+    {
+      layers_to_print[index]->snapshot_ = snapshots[index];
+      linkSnapshot(layers_tree, layers_to_print[index]);
+    }
+  }
+  free(snapshots);
+  free(layers_to_print);
+  return OK;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Splits string into words.
-/// @param input Input string.
-/// @return  Returns the words.
-char** splitString(char* input)
+/// @brief Grows the dirty rectangle so that it covers a layer.
+/// @param dirty The dirty rectangle, empty if end_x_ is not larger than x_.
+/// @param layer The layer.
+void addDirtyLayer(Rectangle* dirty, Layer* layer)
 {
-  int index = 0;
-  int input_length = strlen(input);
-  char** words = calloc(input_length + 1, sizeof(char*));
-  if (words == NULL)
+  int end_x = layer->coordinate_x_ + layer->bmp_->width_;
+  int end_y = layer->coordinate_y_ + layer->bmp_->height_;
+  if (dirty->end_x_ <= dirty->x_)
   {
-    free(input);
-    return NULL;
+    dirty->x_ = layer->coordinate_x_;
+    dirty->y_ = layer->coordinate_y_;
+    dirty->end_x_ = end_x;
+    dirty->end_y_ = end_y;
+    return;
   }
-  char* word = strtok(input, " ");
-  while (word != NULL)
+  dirty->x_ = layer->coordinate_x_ < dirty->x_ ? layer->coordinate_x_ : dirty->x_;
+  dirty->y_ = layer->coordinate_y_ < dirty->y_ ? layer->coordinate_y_ : dirty->y_;
+  dirty->end_x_ = end_x > dirty->end_x_ ? end_x : dirty->end_x_;
+  dirty->end_y_ = end_y > dirty->end_y_ ? end_y : dirty->end_y_;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Finds the part of the canvas that differs between two layers of the tree. Only the layers between each of
+///        them and their common ancestor can change pixels, so the result is the bounding box of those layers.
+/// @param from Layer the current frame shows.
+/// @param to Layer that should be shown.
+/// @param dirty Receives the bounding box, empty if nothing changed.
+/// @return Number of layers that differ.
+int getDirtyRectangle(Layer* from, Layer* to, Rectangle* dirty)
+{
+  int changed_count = 0;
+  dirty->x_ = dirty->y_ = dirty->end_x_ = dirty->end_y_ = 0;
+  while (from != to)
   {
-    words[index++] = word;
-    word = strtok(NULL, " ");
+    if (from->depth_ >= to->depth_)
+    {
+      addDirtyLayer(dirty, from);
+      from = from->parent_layer_;
+    }
+    else
+    {
+      addDirtyLayer(dirty, to);
+      to = to->parent_layer_;
+    }
+    changed_count++;
   }
-  words[index] = NULL;
-  return words;
+  return changed_count;
 }
-//end
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Prints the successful crop message.
-/// @param bmp_id Id of the bmp.
-/// @param new_bmp_id Id of the new cropped bmp.
-/// @param width Width of the new bmp.
-/// @param height Height of the new bmp.
-void printCropMessage(int bmp_id, int new_bmp_id, int width, int height)
+/// @brief Composites only a rectangle of the active layer into the canvas, the rest of the canvas is left untouched.
+///        Starts from the nearest cached ancestor (or white) like renderCanvas(), but does not create snapshots.
+/// @param layers_tree The layer tree of the program.
+/// @param canvas Canvas of width * height pixels.
+/// @param rectangle Part of the canvas to composite.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed
+ErrorCodes renderRectangle(TreeNode* layers_tree, char* canvas, Rectangle* rectangle)
 {
-  printf("Cropped ID %d to new ID %d with dimensions %d x %d\n",
-          bmp_id, new_bmp_id, width, height);
+  int canvas_width = layers_tree->current_active_layer_->width_;
+  Layer** layers_to_print = calloc(layers_tree->current_active_layer_->depth_ + 1, sizeof(Layer*));
+  if (layers_to_print == NULL)
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+  double start = getSeconds();
+  Layer* cached_base = NULL;
+  int layers_count = getLayers(layers_tree, layers_to_print, &cached_base);
+  buildLayerSpans(layers_to_print, layers_count);
+  size_t offset = ((size_t)rectangle->y_ * canvas_width + rectangle->x_) * BYTE;
+  copyBaseRows(getBasePixels(cached_base), cached_base != NULL ? cached_base->snapshot_ : NULL, canvas_width,
+               rectangle->y_, rectangle->end_y_, rectangle->x_, rectangle->end_x_, canvas + offset);
+  for (int index = 0; index < layers_count; index++)
+  {
+    Layer* layer = layers_to_print[index];
+    if (layer->coordinate_x_ < rectangle->end_x_ && layer->coordinate_x_ + layer->bmp_->width_ > rectangle->x_ &&
+        layer->coordinate_y_ < rectangle->end_y_ && layer->coordinate_y_ + layer->bmp_->height_ > rectangle->y_)
+    {
+      blendLayerRectangle(layer, canvas, canvas_width, rectangle);
+    }
+  }
+  addStageTime(layers_tree, STAGE_BLEND, getSeconds() - start,
+               (uint64_t)(rectangle->end_x_ - rectangle->x_) * (rectangle->end_y_ - rectangle->y_));
+  if (cached_base != NULL && cached_base->snapshot_ != NULL)
+  {
+    unlinkSnapshot(layers_tree, cached_base);
+    linkSnapshot(layers_tree, cached_base);
+  }
+  free(layers_to_print);
+  return OK;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Prints the successful undo message.
-/// @param id Id of the layer we switched to after undo.
-void printUndoMessage(int id)
+/// @brief Brings the retained frame up to date with the active layer. The frame remembers which layer it shows, so
+///        after place, undo or switch only the rectangle covered by the layers that changed is composited again.
+///        The whole frame is composited on first use and when the dirty part is larger than half of the canvas.
+/// @param layers_tree The layer tree of the program.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed
+ErrorCodes updateFrame(TreeNode* layers_tree)
+{
+  Layer* active_layer = layers_tree->current_active_layer_;
+  size_t canvas_area = (size_t)active_layer->width_ * active_layer->height_;
+  ErrorCodes result = OK;
+  if (layers_tree->frame_ == NULL)
+  {
+    layers_tree->frame_ = malloc(canvas_area * BYTE);
+    if (layers_tree->frame_ == NULL)
+    {
+      return ERROR_MALLOC_FAILED;
+    }
+    result = renderCanvas(layers_tree, layers_tree->frame_);
+  }
+  else if (layers_tree->frame_layer_ != active_layer)
+  {
+    Rectangle dirty;
+    getDirtyRectangle(layers_tree->frame_layer_, active_layer, &dirty);
+    size_t dirty_area = (size_t)(dirty.end_x_ - dirty.x_) * (dirty.end_y_ - dirty.y_);
+    if (dirty.end_x_ <= dirty.x_)
+    {
+      result = OK;
+    }
+    else if (dirty_area * 2 > canvas_area)
+    {
+      result = renderCanvas(layers_tree, layers_tree->frame_);
+    }
+    else
+    {
+      result = renderRectangle(layers_tree, layers_tree->frame_, &dirty);
+    }
+  }
+  // a failed render leaves the frame in an unknown state, so it is composited again next time
+  layers_tree->frame_layer_ = result == OK ? active_layer : NULL;
+  if (result != OK)
+  {
+    free(layers_tree->frame_);
+    layers_tree->frame_ = NULL;
+  }
+  return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Writes a number in decimal.
+/// @param output Where the digits go.
+/// @param value The number.
+/// @return Position after the last digit.
+char* appendNumber(char* output, unsigned value)
+{
+  char digits[10];
+  int count = 0;
+  do
+  {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  while (count > 0)
+  {
+    *output++ = digits[--count];
+  }
+  return output;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Copies a string without its null terminator.
+/// @param output Where the text goes.
+/// @param text The text.
+/// @return Position after the text.
+char* appendText(char* output, const char* text)
+{
+  while (*text != '\0')
+  {
+    *output++ = *text++;
+  }
+  return output;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Writes the escape sequence that sets the foreground color, and optionally the background color, to the
+///        color of a BGRA pixel.
+/// @param output Where the escape sequence goes.
+/// @param pixel Pixel for the foreground.
+/// @param background_pixel Pixel for the background or NULL to keep it.
+/// @return Position after the escape sequence.
+char* appendColor(char* output, const unsigned char* pixel, const unsigned char* background_pixel)
 {
-  printf("Switched to layer %d\n", id);
+  output = appendText(output, "\033[38;2;");
+  output = appendNumber(output, pixel[2]);
+  *output++ = ';';
+  output = appendNumber(output, pixel[1]);
+  *output++ = ';';
+  output = appendNumber(output, pixel[0]);
+  if (background_pixel != NULL)
+  {
+    output = appendText(output, ";48;2;");
+    output = appendNumber(output, background_pixel[2]);
+    *output++ = ';';
+    output = appendNumber(output, background_pixel[1]);
+    *output++ = ';';
+    output = appendNumber(output, background_pixel[0]);
+  }
+  *output++ = 'm';
+  return output;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Prints successful place message.
-/// @param layer_id Id of the layer we switched to after placing.
-void printPlaceMessage(int layer_id)
+/// @brief Prints the canvas. The whole frame is formatted into one buffer that is kept for the next print and written
+///        with a single call. A color escape is only written when the color changes within a row. In half block mode
+///        every line shows two pixel rows, the upper one as foreground and the lower one as background of '▀'.
+/// @param layers_tree The layer tree of the program, holds the output buffer and the print mode.
+/// @param canvas The root layer.
+/// @param canvas_height Height of the canvas.
+/// @param canvas_width Width of the canvas.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed
+ErrorCodes printCanvas(TreeNode* layers_tree, char* canvas, int canvas_height, int canvas_width)
 {
-  printf("Switched to layer %d\n", layer_id);
+  size_t buffer_size = ((size_t)canvas_height + 2) * ((size_t)canvas_width * PRINT_PIXEL_BYTES + PRINT_LINE_BYTES);
+  if (layers_tree->print_buffer_size_ < buffer_size)
+  {
+    char* temporary = realloc(layers_tree->print_buffer_, buffer_size);
+    if (temporary == NULL)
+    {
+      return ERROR_MALLOC_FAILED;
+    }
+    layers_tree->print_buffer_ = temporary;
+    layers_tree->print_buffer_size_ = buffer_size;
+  }
+  int half_blocks = layers_tree->half_blocks_;
+  int row_step = half_blocks ? 2 : 1;
+  const char* block = half_blocks ? "▀" : "███";
+  size_t row_size = (size_t)canvas_width * BYTE;
+  char* output = layers_tree->print_buffer_;
+
+  if (!half_blocks)
+  {
+    output = appendText(output, "   ");
+    for (int column_indices = 1; column_indices <= canvas_width; column_indices++)
+    {
+      output = appendText(output, column_indices < 10 ? " 0" : " ");
+      output = appendNumber(output, column_indices);
+    }
+    *output++ = '\n';
+  }
+
+  for (int y = 0; y < canvas_height; y += row_step)
+  {
+    int row_indices = y + 1;
+    if (row_indices < 10)
+    {
+      *output++ = '0';
+    }
+    output = appendNumber(output, row_indices);
+    *output++ = '|';
+
+    const unsigned char* row = (unsigned char*)canvas + y * row_size;
+    const unsigned char* lower_row = half_blocks && y + 1 < canvas_height ? row + row_size : NULL;
+    for (int x = 0; x < canvas_width; x++)
+    {
+      const unsigned char* pixel = row + (size_t)x * BYTE;
+      const unsigned char* lower_pixel = lower_row != NULL ? lower_row + (size_t)x * BYTE : NULL;
+      if (x == 0 || memcmp(pixel, pixel - BYTE, 3) != 0 ||
+          (lower_pixel != NULL && memcmp(lower_pixel, lower_pixel - BYTE, 3) != 0))
+      {
+        output = appendColor(output, pixel, lower_pixel);
+      }
+      output = appendText(output, block);
+    }
+    output = appendText(output, "\033[0m|\n");
+  }
+
+  output = appendText(output, "  ");
+  int border_width = half_blocks ? canvas_width + 2 : canvas_width * 3 + 2;
+  memset(output, '-', border_width);
+  output += border_width;
+  *output++ = '\n';
+
+  fflush(stdout);
+  struct iovec frame = {layers_tree->print_buffer_, output - layers_tree->print_buffer_};
+  writeRows(STDOUT_FILENO, &frame, 1);
+  return OK;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Prints successful switch message.
-/// @param layer_id Id of the layer we switched to.
-void printSwitchMessage(int layer_id)
+/// @brief Brings the retained frame up to date and prints it.
+/// @param layers_tree The layer tree of the program.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed
+ErrorCodes printCommand(TreeNode* layers_tree)
 {
-  printf("Switched to layer %d\n", layer_id);
+  Layer* layer = layers_tree->current_active_layer_;
+  if (updateFrame(layers_tree) != OK)
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+  return printCanvas(layers_tree, layers_tree->frame_, layer->height_, layer->width_);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Prints list of commands.
-void printCommandList(void)
+/// @brief Gets the pointer to the root layer of the tree.
+/// @param layers_tree The layer tree of the program.
+/// @return The root of the tree.
+Layer* getRootLayer(TreeNode* layers_tree)
 {
-  printf("\n"
-         "Available commands:\n"
-         " help\n"
-         " load <PATH>\n"
-         " crop <BMP_ID> <TOP_X> <TOP_Y> <BOTTOM_X> <BOTTOM_Y>\n"
-         " place <BMP_ID> <CANVAS_X> <CANVAS_Y> <BLEND_MODE>\n"
-         " undo\n"
-         " print\n"
-         " switch <LAYER_ID>\n"
-         " tree\n"
-         " bmps\n"
-         " save <FILE_PATH>\n"
-         " quit\n"
-         "\n");
+  return layers_tree->layer_table_[ROOT_LAYER_ID];
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Checks if input was the quit command and trims trailing spaces.
-/// @param input User input.
-/// @return Returns true if it was, false if not.
-int isQuit(char* input)
+/// @brief Prints one layer of the layer tree.
+/// @param layer The layer.
+/// @param depth Depth of the layer in the tree.
+void printTreeLayer(Layer* layer, int depth)
 {
-  removeNewLine(input);
-  int len = strlen(input);
-  while (len > 0 && isspace((unsigned char)input[len - 1]))
+  for (int space_count = 0; space_count < depth; space_count++)
   {
-    input[len - 1] = '\0';
-    len--;
+    printf("   ");
   }
-  return strcmp("quit", input) == 0;
+  printf("Layer %d renders BMP %d at %d %d\n",
+          layer->layer_id_, layer->bmp_->bmp_id_, layer->coordinate_x_ + 1, layer->coordinate_y_ + 1);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Counts the number of arguments, including the command itself.
-/// @param words User input split into words.
-/// @return Returns number of arguments.
-int countArguments(char** words)
+/// @brief Gets the root of the tree and prints it.
+/// @param layers_tree The layer tree of the program.
+/// @return OK (0) if everything passes, ERROR_MALLOC_FAILED (1) if memory allocation failed.
+ErrorCodes treeCommand(TreeNode* layers_tree)
 {
-  int number_of_arguments = 0;
-  while (words[number_of_arguments] != NULL)
+  Layer* root = getRootLayer(layers_tree);
+  Layer** order = malloc(layers_tree->next_id_ * sizeof(Layer*));
+  int* depths = malloc(layers_tree->next_id_ * sizeof(int));
+  int count = order != NULL && depths != NULL ? traverseLayers(root, order, depths, layers_tree->next_id_) : -1;
+  if (count < 0)
   {
-    number_of_arguments++;
+    free(order);
+    free(depths);
+    return ERROR_MALLOC_FAILED;
   }
-  return number_of_arguments;
+  printf("Layer %d\n", root->layer_id_);
+  for (int index = 1; index < count; index++)
+  {
+    printTreeLayer(order[index], depths[index]);
+  }
+  free(order);
+  free(depths);
+  return OK;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Resizes the capacity of the layer tree.
-/// @param layers Layer tree.
-/// @return Returns O if everything is OK, -1 if memory allocation failed.
-ErrorCodes resizeLayerCapacity(TreeNode* layers)
+/// @brief Validates the switch command and executes it. The layer is looked up in the id table.
+/// @param layers_tree The tree of the program.
+/// @param new_id Id of the layer we want to switch to.
+/// @return OK (0) if everything passes, ERROR_INVALID_COORDINATES (-1) if coordinates are invalid.
+ErrorCodes switchCommand(TreeNode* layers_tree, char* new_id)
 {
-  if (layers->current_active_layer_->number_of_children_ >= layers->current_active_layer_->capacity_)
+  for (int index_letters = 0; new_id[index_letters] != 0; index_letters++)
   {
-    layers->current_active_layer_->capacity_ += 1;
-    Layer** temporary = realloc(
-    layers->current_active_layer_->children_list_, 
-    layers->current_active_layer_->capacity_ * sizeof(Layer*));
-
-    if (temporary == NULL)
+    if (!isdigit(new_id[index_letters]))
     {
-      printErrorMessage(ERROR_MALLOC_FAILED);
-      return ERROR_MALLOC_FAILED;
+      return ERROR_INVALID_COORDINATES;
     }
-    layers->current_active_layer_->children_list_ = temporary;
-    temporary = NULL;
   }
+  
+  long new_layer_id = strtol(new_id, NULL, 10);
+  Layer* switched_layer = new_layer_id < layers_tree->next_id_ ? findLayer(layers_tree, (int)new_layer_id) : NULL;
+  if (switched_layer == NULL)
+  {
+    return ERROR_LAYER_ID_NOT_FOUND;
+  }
+  layers_tree->current_active_layer_ = switched_layer;
+  printSwitchMessage(switched_layer->layer_id_);
   return OK;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Creates the root layer and sets it as canvas.
-/// @param width Width of the canvas.
-/// @param height Height of the canvas.
-/// @return  layers tree if everything passed, NULL for memory allocation fail.
-TreeNode* createRootLayer(int width, int height)
+/// @brief Bakes the composite of a layer into a new bmp of the library. Renders of the layer and of every layer above
+///        it start from that bmp instead of walking down to the root, so their cost no longer grows with the history
+///        below. The tree itself is not changed, so undo, switch and tree work as before. Flattening a layer twice
+///        gives the bmp of the first time.
+/// @param id_string Id of the layer from user input.
+/// @param library The bmp library of the program.
+/// @param layers_tree The layer tree of the program.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if malloc failed, -1 for everything else.
+ErrorCodes flattenCommand(char* id_string, BmpLibrary* library, TreeNode* layers_tree)
 {
-  TreeNode* layers = calloc(1, sizeof(TreeNode));
-  if (layers == NULL)
+  for (int index = 0; id_string[index] != '\0'; index++)
   {
-    printErrorMessage(ERROR_MALLOC_FAILED);
-    return NULL;
+    if (!isdigit((unsigned char)id_string[index]))
+    {
+      return ERROR_LAYER_ID_NOT_FOUND;
+    }
   }
-  Layer* root = calloc(1, sizeof(Layer));
-  if (root == NULL)
+  long layer_id = strtol(id_string, NULL, 10);
+  Layer* layer = layer_id < layers_tree->next_id_ ? findLayer(layers_tree, (int)layer_id) : NULL;
+  if (layer == NULL)
   {
-    free(layers);
-    printErrorMessage(ERROR_MALLOC_FAILED);
-    return NULL;
+    return ERROR_LAYER_ID_NOT_FOUND;
   }
+  if (layer->layer_id_ == ROOT_LAYER_ID)
+  {
+    return ERROR_ALREADY_ROOT;
+  }
+  if (layer->flattened_bmp_ == NULL)
+  {
+    size_t canvas_size = (size_t)layer->width_ * layer->height_ * BYTE;
+    BMP* bmp = calloc(1, sizeof(BMP));
+    PixelBuffer* buffer = bmp != NULL ? createPixelBuffer(canvas_size) : NULL;
+    if (buffer == NULL)
+    {
+      free(bmp);
+      return ERROR_MALLOC_FAILED;
+    }
+    bmp->buffer_ = buffer;
+    bmp->pixels_ = buffer->data_;
+    bmp->stride_ = (ptrdiff_t)layer->width_ * BYTE;
+    bmp->width_ = layer->width_;
+    bmp->height_ = layer->height_;
 
-  root->layer_id_ = ROOT_LAYER_ID;
-  root->width_ = width;
-  root->height_ = height;
-  root->parent_layer_ = NULL;
+    ErrorCodes result = OK;
+    if (layer->snapshot_ != NULL)
+    {
+      readTiledRows(layer->snapshot_, 0, layer->height_, 0, layer->width_, bmp->pixels_);
+    }
+    else
+    {
+      Layer* active_layer = layers_tree->current_active_layer_;
+      layers_tree->current_active_layer_ = layer;
+      result = renderCanvas(layers_tree, bmp->pixels_);
+      layers_tree->current_active_layer_ = active_layer;
+    }
+    if (result == OK && addBmp(library, bmp) != OK)
+    {
+      result = ERROR_MALLOC_FAILED;
+    }
+    if (result != OK)
+    {
+      freeBmp(bmp);
+      return result;
+    }
+    // the bmp holds the same pixels, the snapshot would only take cache budget from other layers
+    if (layer->snapshot_ != NULL)
+    {
+      evictSnapshot(layers_tree, layer);
+    }
+    bmp->use_count_++;
+    layer->flattened_bmp_ = bmp;
+  }
+  printf("Flattened layer %d into BMP %d\n", layer->layer_id_, layer->flattened_bmp_->bmp_id_);
+  return OK;
+}
 
-  layers->next_id_ = root->layer_id_ + 1;
-  layers->current_active_layer_ = root;
-  layers->current_active_layer_->capacity_ = LAYER_TREE_CAPACITY;
-  layers->current_active_layer_->children_list_ = calloc(layers->current_active_layer_->capacity_, sizeof(Layer*));
-  if (layers->current_active_layer_->children_list_ == NULL)
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Fills the header of a 32-bit BMP that save or export writes. The file size field only has 32 bits, so for
+///        images of 4 GiB or more it is clamped to UINT32_MAX (readers take the size from the dimensions, like
+///        readBmp does). fillBmpHeaderDefaultValues() computes the size in int, so it only fills the other fields.
+/// @param header The header to fill.
+/// @param width Width of the image.
+/// @param height Height of the image.
+void fillSaveHeader(BmpHeader* header, int width, int height)
+{
+  fillBmpHeaderDefaultValues(header, 0, 0);
+  uint64_t total_size = sizeof(BmpHeader) + (uint64_t)width * height * BYTE;
+  header->total_size = total_size > UINT32_MAX ? UINT32_MAX : (uint32_t)total_size;
+  header->width_ = width;
+  header->height_ = height;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Writes rows to a file with as few writev calls as possible.
+/// @param descriptor The file.
+/// @param rows The rows in the order they are written, gets modified on partial writes.
+/// @param rows_count Number of rows.
+/// @return OK (0) if everything was written, ERROR_INVALID_FILE_PATH (-1) if writing failed.
+ErrorCodes writeRows(int descriptor, struct iovec* rows, int rows_count)
+{
+  while (rows_count > 0)
   {
-    free(root);
-    free(layers);
-    printErrorMessage(ERROR_MALLOC_FAILED);
-    return NULL;
+    int batch = rows_count < WRITE_BATCH_ROWS ? rows_count : WRITE_BATCH_ROWS;
+    ssize_t written = writev(descriptor, rows, batch);
+    if (written < 0)
+    {
+      return ERROR_INVALID_FILE_PATH;
+    }
+    while (rows_count > 0 && (size_t)written >= rows->iov_len)
+    {
+      written -= rows->iov_len;
+      rows++;
+      rows_count--;
+    }
+    if (rows_count > 0)
+    {
+      rows->iov_base = (char*)rows->iov_base + written;
+      rows->iov_len -= written;
+    }
   }
-  layers->current_active_layer_->number_of_children_ = START_NUMBER_OF_CHILDREN;
-
-  return layers;
+  return OK;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Flips the bmp upside down so it can be read from top left.
-/// @param bmp BMP that we flip.
-/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed.
-ErrorCodes flipBmp(BMP* bmp)
+/// @brief Creates the file that an output is written to before commitTemporaryFile() renames it over the target, so
+///        the target is either replaced completely or not at all. The file lies next to the target and is always a
+///        new one (a file left over by an earlier run is removed first), so nothing that is mapped gets written.
+/// @param path Path of the target.
+/// @param temporary_path Receives the path of the new file, it is freed by commitTemporaryFile().
+/// @param descriptor Receives the new file.
+/// @return OK (0) if the file was created, ERROR_MALLOC_FAILED (1) if malloc failed, ERROR_INVALID_FILE_PATH (-1) if
+///         the file could not be created.
+ErrorCodes createTemporaryFile(const char* path, char** temporary_path, int* descriptor)
 {
-  int bytes_in_row = bmp->width_ * BYTE;
-  int total_rows = bmp->height_;
-  char* flipped = calloc(bytes_in_row * total_rows, sizeof(char));
-  if (flipped == NULL)
+  *temporary_path = malloc(strlen(path) + sizeof(TEMPORARY_SUFFIX));
+  if (*temporary_path == NULL)
   {
     return ERROR_MALLOC_FAILED;
   }
-  for (int row = 0; row < total_rows; row++)
+  strcpy(*temporary_path, path);
+  strcat(*temporary_path, TEMPORARY_SUFFIX);
+  unlink(*temporary_path);
+  *descriptor = open(*temporary_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (*descriptor < 0)
   {
-    int source_row = total_rows - 1 - row;
-    for (int column = 0; column < bytes_in_row; column++)
-    {
-      flipped[row * bytes_in_row + column] = bmp->pixels_[source_row * bytes_in_row + column];
-    }
+    free(*temporary_path);
+    *temporary_path = NULL;
+    return ERROR_INVALID_FILE_PATH;
   }
-
-  free(bmp->pixels_);
-  bmp->pixels_ = flipped;
   return OK;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Loads the and stores it in the library.
-/// @param path Path to the bmp.
-/// @param library The bmp library of the program.
-/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed, -1 for other errors
-ErrorCodes loadBmp(char* path, BmpLibrary* library)
+/// @brief Closes a file from createTemporaryFile() and renames it over the target if it was written completely,
+///        otherwise it is removed and the target stays as it was.
+/// @param descriptor The file.
+/// @param temporary_path Path of the file, gets freed.
+/// @param path Path of the target.
+/// @param result Result of writing the file.
+/// @return OK (0) if the target was replaced, the result or ERROR_INVALID_FILE_PATH (-1) if not.
+ErrorCodes commitTemporaryFile(int descriptor, char* temporary_path, const char* path, ErrorCodes result)
 {
-  FILE* file = fopen(path, "rb");
-  if (file == NULL)
+  if (close(descriptor) != 0 || (result == OK && rename(temporary_path, path) != 0))
   {
-    return ERROR_CANNOT_OPEN_FILE;
+    result = result == OK ? ERROR_INVALID_FILE_PATH : result;
   }
-  char magic_number[2] = {0};
-  fread(magic_number, sizeof(char), 2, file);
-  if (magic_number[0] != FIRST_MAGIC_NUMBER || magic_number[1] != SECOND_MAGIC_NUMBER)
+  if (result != OK)
   {
-    fclose(file);
-    return ERROR_INVALID_FILE;
+    unlink(temporary_path);
   }
-  
-  BMP* new_bmp = calloc(1, sizeof(BMP));
-  if (new_bmp == NULL)
+  free(temporary_path);
+  return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Validates the save command and executes it. The image is streamed: chunks of rows are composited from the
+///        bottom of the canvas upwards, in the order the BMP stores them, and written right away. Only one chunk of
+///        one band per thread is in memory at a time. Bands of the white canvas that no layer touches are written from
+///        a single white row. If print already keeps a frame, that frame is brought up to date and written instead.
+///        The image goes to a new file that replaces the target once it is complete.
+/// @param library The bmp library of the program.
+/// @param layers_tree The layer tree of the program.
+/// @param path Path we want to save the bmp to.
+/// @return OK (0) if everything passes, ERROR_MALLOC_FAILED (1) if malloc fails, (-1, 2, 3) for other types of errors.
+ErrorCodes saveCommand(BmpLibrary* library, TreeNode* layers_tree, char* path)
+{
+  if (detachMappedFile(library, path) != OK)
   {
-    fclose(file);
     return ERROR_MALLOC_FAILED;
   }
+  int canvas_width = layers_tree->current_active_layer_->width_;
+  int canvas_height = layers_tree->current_active_layer_->height_;
+  size_t row_size = (size_t)canvas_width * BYTE;
+  int band_height = getBandHeight(canvas_width);
+  int chunk_rows = band_height * getThreadPoolSize(layers_tree->thread_pool_);
+  chunk_rows = chunk_rows < canvas_height ? chunk_rows : canvas_height;
 
-  uint32_t pixel_offset;
-  fseek(file, 0x0A, SEEK_SET);
-  fread(&pixel_offset, sizeof(uint32_t), 1, file);
-
-  int32_t  width;
-  fseek(file, 0x12, SEEK_SET);
-  fread(&width, sizeof(int32_t), 1, file);
-
-  int32_t  height;
-  fseek(file, 0x16, SEEK_SET);
-  fread(&height, sizeof(int32_t), 1, file);
+  Layer** layers_to_print = calloc(layers_tree->current_active_layer_->depth_ + 1, sizeof(Layer*));
+  char* chunk = malloc(chunk_rows * row_size);
+  int chunk_bands = (chunk_rows + band_height - 1) / band_height;
+  char* blank_bands = malloc(chunk_bands);
+  char* white_row = malloc(row_size);
+  struct iovec* rows = malloc(chunk_rows * sizeof(struct iovec));
+  BmpHeader* header = calloc(1, sizeof(BmpHeader));
+  if (layers_to_print == NULL || chunk == NULL || blank_bands == NULL || white_row == NULL || rows == NULL ||
+      header == NULL)
+  {
+    free(header);
+    free(white_row);
+    free(blank_bands);
+    free(rows);
+    free(chunk);
+    free(layers_to_print);
+    return ERROR_MALLOC_FAILED;
+  }
+  int use_frame = layers_tree->frame_ != NULL && updateFrame(layers_tree) == OK;
+  double start = getSeconds();
+  Layer* cached_base = NULL;
+  int layers_count = use_frame ? 0 : getLayers(layers_tree, layers_to_print, &cached_base);
+  buildLayerSpans(layers_to_print, layers_count);
+  LayerGrid grid;
+  int has_grid = !use_frame &&
+                 buildLayerGrid(&grid, layers_to_print, layers_count, canvas_width, canvas_height) == OK;
+  RenderJob job = {layers_to_print, NULL, layers_count, has_grid ? &grid : NULL, NULL, 0,
+                   NULL, NULL, chunk, canvas_width, 0, 0, band_height, blank_bands};
+  job.base_ = getBasePixels(cached_base);
+  job.base_tiles_ = cached_base != NULL ? cached_base->snapshot_ : NULL;
+  memset(white_row, 255, row_size);
+  double blend_seconds = getSeconds() - start;
 
-  new_bmp->width_ = width;
-  new_bmp->height_ = height;
+  char* temporary_path = NULL;
+  int descriptor = -1;
+  ErrorCodes result = createTemporaryFile(path, &temporary_path, &descriptor);
+  if (result == OK)
+  {
+    fillSaveHeader(header, canvas_width, canvas_height);
+    result = write(descriptor, header, sizeof(BmpHeader)) == sizeof(BmpHeader) ? OK : ERROR_INVALID_FILE_PATH;
+    for (int end_row = canvas_height; end_row > 0 && result == OK; end_row -= chunk_rows)
+    {
+      job.first_row_ = end_row > chunk_rows ? end_row - chunk_rows : 0;
+      job.end_row_ = end_row;
+      char* source = use_frame ? layers_tree->frame_ + job.first_row_ * row_size : chunk;
+      if (!use_frame)
+      {
+        int band_count = (job.end_row_ - job.first_row_ + band_height - 1) / band_height;
+        memset(blank_bands, 0, band_count);
+        start = getSeconds();
+        runThreadPool(layers_tree->thread_pool_, renderBand, &job, band_count);
+        blend_seconds += getSeconds() - start;
+      }
 
-  int number_of_pixels = width * height * BYTE;
-  new_bmp->width_ = width;
-  new_bmp->height_ = height;
-  new_bmp->bmp_id_ = library->next_id_;
-  
-  new_bmp->pixels_ = calloc(number_of_pixels, sizeof(char));
-  if (new_bmp->pixels_ == NULL)
+      int rows_count = 0;
+      for (int row = end_row - 1; row >= job.first_row_; row--)
+      {
+        int blank = !use_frame && blank_bands[(row - job.first_row_) / band_height];
+        rows[rows_count].iov_base = blank ? white_row : source + (row - job.first_row_) * row_size;
+        rows[rows_count].iov_len = row_size;
+        rows_count++;
+      }
+      result = writeRows(descriptor, rows, rows_count);
+    }
+    result = commitTemporaryFile(descriptor, temporary_path, path, result);
+  }
+  if (!use_frame)
   {
-    free(new_bmp);
-    fclose(file);
-    return ERROR_MALLOC_FAILED;
+    addStageTime(layers_tree, STAGE_BLEND, blend_seconds, (uint64_t)canvas_width * canvas_height);
   }
 
-  fseek(file, pixel_offset, SEEK_SET);  
-  fread(new_bmp->pixels_, sizeof(char), number_of_pixels, file);
-  
-  ErrorCodes result = flipBmp(new_bmp);
-  if (result != OK)
+  if (has_grid)
   {
-    return result;
+    freeLayerGrid(&grid);
+  }
+  free(header);
+  free(rows);
+  free(white_row);
+  free(blank_bands);
+  free(chunk);
+  free(layers_to_print);
+  if (result == OK)
+  {
+    printf("Successfully saved image to %s\n", path);
   }
+  return result;
+}
 
-  new_bmp->path_ = calloc((strlen(path) + 1), sizeof(char));
-  if (new_bmp->path_ == NULL)
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Writes a whole canvas to a BMP file. The rows are handed to writev bottom up, in the order the BMP stores
+///        them, so no second copy of the canvas is needed. Like save, it writes a new file and renames it over the
+///        target.
+/// @param path Path of the file.
+/// @param pixels The canvas.
+/// @param width Width of the canvas.
+/// @param height Height of the canvas.
+/// @return OK (0) if everything was written, ERROR_MALLOC_FAILED (1) if malloc failed, ERROR_INVALID_FILE_PATH (-1)
+///         if the file could not be written.
+ErrorCodes writeBmpFile(const char* path, const char* pixels, int width, int height)
+{
+  size_t row_size = (size_t)width * BYTE;
+  BmpHeader* header = calloc(1, sizeof(BmpHeader));
+  struct iovec* rows = malloc(WRITE_BATCH_ROWS * sizeof(struct iovec));
+  if (header == NULL || rows == NULL)
   {
-    free(new_bmp->pixels_);
-    free(new_bmp);
-    fclose(file);
+    free(rows);
+    free(header);
     return ERROR_MALLOC_FAILED;
   }
-  strcpy(new_bmp->path_, path);
-  fclose(file);
-
-  if (library->next_id_ >= library->capacity_)
+  char* temporary_path = NULL;
+  int descriptor = -1;
+  ErrorCodes result = createTemporaryFile(path, &temporary_path, &descriptor);
+  if (result == OK)
   {
-    library->capacity_ *= 2;
-    BMP **temporary = realloc(library->bmps_, library->capacity_ * sizeof(BMP*));
-    if (temporary == NULL)
+    fillSaveHeader(header, width, height);
+    result = write(descriptor, header, sizeof(BmpHeader)) == sizeof(BmpHeader) ? OK : ERROR_INVALID_FILE_PATH;
+    for (int end_row = height; end_row > 0 && result == OK; end_row -= WRITE_BATCH_ROWS)
     {
-      free(new_bmp->pixels_);
-      free(new_bmp->path_);
-      free(new_bmp);
-      return ERROR_MALLOC_FAILED;
+      int rows_count = 0;
+      for (int row = end_row - 1; row >= 0 && rows_count < WRITE_BATCH_ROWS; row--)
+      {
+        rows[rows_count].iov_base = (char*)pixels + row * row_size;
+        rows[rows_count].iov_len = row_size;
+        rows_count++;
+      }
+      result = writeRows(descriptor, rows, rows_count);
     }
-    library->bmps_ = temporary;
+    result = commitTemporaryFile(descriptor, temporary_path, path, result);
   }
-  library->bmps_[library->next_id_] = new_bmp;
-  library->next_id_++;
-
-  printf("Loaded %s with ID %d and dimensions %d %d\n",
-  path, new_bmp->bmp_id_, new_bmp->width_, new_bmp->height_);
+  free(rows);
+  free(header);
+  return result;
+}
 
-  return OK;
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Thread function of the frame writer.
+/// @param context The frame writer.
+/// @return Always NULL, the result is stored in the writer.
+void* writeFrame(void* context)
+{
+  FrameWriter* writer = context;
+  writer->result_ = writeBmpFile(writer->path_, writer->pixels_, writer->width_, writer->height_);
+  return NULL;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Prints the bmps.
-/// @param library The bmp library of the program.
-void printBmps(BmpLibrary* library)
+/// @brief Starts writing a frame on a background thread. If no thread can be started, the frame is written right
+///        away instead.
+/// @param writer The frame writer, must not be running.
+/// @param path Path of the file, the writer takes ownership.
+/// @param pixels The frame, must stay unchanged until finishFrameWriter() returns.
+/// @param width Width of the frame.
+/// @param height Height of the frame.
+void startFrameWriter(FrameWriter* writer, char* path, const char* pixels, int width, int height)
 {
-  if (library == NULL)
+  writer->path_ = path;
+  writer->pixels_ = pixels;
+  writer->width_ = width;
+  writer->height_ = height;
+  writer->is_running_ = pthread_create(&writer->thread_, NULL, writeFrame, writer) == 0;
+  if (!writer->is_running_)
   {
-    return;
+    writeFrame(writer);
   }
+}
 
-  for (int index = 0; index < library->next_id_; index++)
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Waits until the frame that is being written is done.
+/// @param writer The frame writer.
+/// @return Result of writing the frame, OK if there was none.
+ErrorCodes finishFrameWriter(FrameWriter* writer)
+{
+  if (writer->is_running_)
   {
-    if (library->bmps_[index] != NULL)
-    {
-      printf("BMP %d has dimensions %d x %d\n", 
-      library->bmps_[index]->bmp_id_, library->bmps_[index]->width_, library->bmps_[index]->height_);
-    }
+    pthread_join(writer->thread_, NULL);
+    writer->is_running_ = 0;
   }
+  free(writer->path_);
+  writer->path_ = NULL;
+  ErrorCodes result = writer->result_;
+  writer->result_ = OK;
+  return result;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Validates the bmp ID.
-/// @param id Id we are looking for.
-/// @param library The bmp library of the program.
-/// @return OK (0) if it was found, ERROR_BMP_ID_NOT_FOUND (-1) if it was not.
-ErrorCodes checkBmpId(int id, BmpLibrary* library)
+/// @brief Builds the file name of a frame by replacing the first %d of the pattern with the layer id. The pattern is
+///        not used as a format string, so other % signs are kept as they are.
+/// @param pattern The pattern from user input.
+/// @param layer_id Id of the layer of the frame.
+/// @return The file name or NULL if malloc failed.
+char* formatFramePath(const char* pattern, int layer_id)
 {
-  for (int index = 0; index < library->next_id_; index++)
+  const char* marker = strstr(pattern, EXPORT_ID_MARKER);
+  int prefix_length = (int)(marker - pattern);
+  const char* suffix = marker + strlen(EXPORT_ID_MARKER);
+  size_t size = snprintf(NULL, 0, "%.*s%d%s", prefix_length, pattern, layer_id, suffix) + 1;
+  char* path = malloc(size);
+  if (path != NULL)
   {
-    if (id == library->bmps_[index]->bmp_id_)
-    {
-      return OK;
-    }
+    snprintf(path, size, "%.*s%d%s", prefix_length, pattern, layer_id, suffix);
   }
-  return ERROR_BMP_ID_NOT_FOUND;
+  return path;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Blends the single layer of the job onto one band of a canvas that already holds the layers below it.
+/// @param context The render job, its canvas holds every canvas row.
+/// @param band Index of the band.
+void blendStepBand(void* context, int band)
+{
+  RenderJob* job = context;
+  int first_row = job->first_row_ + band * job->band_height_;
+  int end_row = first_row + job->band_height_ < job->end_row_ ? first_row + job->band_height_ : job->end_row_;
+  size_t row_size = (size_t)job->canvas_width_ * BYTE;
+  blendLayerRows(job->layers_[0], job->canvas_ + first_row * row_size, job->canvas_width_, first_row, end_row);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Validates the arguments and crops the bmp.
+/// @brief Validates the export command and executes it. Writes one BMP per layer on the path from the first to the
+///        last layer, the file names are the pattern with %d replaced by the layer id. Only the first frame is
+///        composited from scratch, every further frame blends its own layer onto the frame before. Two canvases take
+///        turns: while one is written on a background thread, the layers since its last frame are blended onto the
+///        other one. So every layer is blended twice instead of copying the whole canvas for every frame.
 /// @param words User input split into words.
 /// @param library The bmp library of the program.
-/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if malloc failed, -1 for everything else.
-ErrorCodes cropCommand(char** words, BmpLibrary* library)
+/// @param layers_tree The layer tree of the program.
+/// @return OK (0) if everything passes, ERROR_MALLOC_FAILED (1) if malloc fails, (-1) for other types of errors.
+ErrorCodes exportCommand(char** words, BmpLibrary* library, TreeNode* layers_tree)
 {
-  int id = atoi(words[1]);
-  int top_x = atoi(words[2]);
-  int top_y = atoi(words[3]);
-  int bottom_x = atoi(words[4]);
-  int bottom_y = atoi(words[5]);
-
-  if (checkBmpId(id, library) != OK)
-  {
-    return ERROR_BMP_ID_NOT_FOUND;
-  }
-  for (int index_words = 1; index_words < CROP_ARGS_COUNT; index_words++)
+  Layer* ends[2] = {NULL, NULL};
+  for (int end = 0; end < 2; end++)
   {
-    for (int index_letters = 0; words[index_words][index_letters] != 0; index_letters++)
+    char* id_string = words[end + 1];
+    for (int index = 0; id_string[index] != '\0'; index++)
     {
-      if (!isdigit(words[index_words][index_letters]))
+      if (!isdigit((unsigned char)id_string[index]))
       {
-        return ERROR_OUT_OF_RANGE;
+        return ERROR_LAYER_ID_NOT_FOUND;
       }
     }
+    long layer_id = strtol(id_string, NULL, 10);
+    ends[end] = layer_id < layers_tree->next_id_ ? findLayer(layers_tree, (int)layer_id) : NULL;
+    if (ends[end] == NULL)
+    {
+      return ERROR_LAYER_ID_NOT_FOUND;
+    }
   }
-  BMP *old_bmp = library->bmps_[id];
-  if (top_x <= 0 || top_y <= 0 ||
-      bottom_x > old_bmp->width_ ||
-      bottom_y > old_bmp->height_)
+  if (strstr(words[3], EXPORT_ID_MARKER) == NULL)
   {
-    return ERROR_OUT_OF_RANGE;
+    return ERROR_INVALID_FILE_PATH;
   }
-  if (bottom_x < top_x || bottom_y < top_y )
+  int frames_count = ends[1]->depth_ - ends[0]->depth_ + 1;
+  if (frames_count <= 0)
   {
-    return ERROR_INVALID_RECTANGLE;
+    return ERROR_NOT_AN_ANCESTOR;
   }
-  int crop_width  = bottom_x - top_x + 1;
-  int crop_height = bottom_y - top_y + 1;
-  BMP *new_bmp = calloc(1, sizeof(BMP));
-  if (new_bmp == NULL)
+  Layer** path = malloc(frames_count * sizeof(Layer*));
+  if (path == NULL)
   {
     return ERROR_MALLOC_FAILED;
   }
-  int new_size = crop_width * crop_height * BYTE;
-  new_bmp->pixels_ = calloc(new_size, sizeof(char));
-  if (new_bmp->pixels_ == NULL)
+  Layer* layer = ends[1];
+  for (int frame = frames_count - 1; frame > 0; frame--)
   {
-    free(new_bmp);
+    path[frame] = layer;
+    layer = layer->parent_layer_;
+  }
+  path[0] = layer;
+  if (layer != ends[0])
+  {
+    free(path);
+    return ERROR_NOT_AN_ANCESTOR;
+  }
+
+  int canvas_width = layer->width_;
+  int canvas_height = layer->height_;
+  size_t canvas_size = (size_t)canvas_width * canvas_height * BYTE;
+  char* canvases[2] = {malloc(canvas_size), malloc(canvas_size)};
+  if (canvases[0] == NULL || canvases[1] == NULL)
+  {
+    free(canvases[1]);
+    free(canvases[0]);
+    free(path);
     return ERROR_MALLOC_FAILED;
   }
-  new_bmp->width_ = crop_width;
-  new_bmp->height_ = crop_height;
-  new_bmp->bmp_id_ = library->next_id_;
-  new_bmp->path_ = NULL;
+  Layer* active_layer = layers_tree->current_active_layer_;
+  layers_tree->current_active_layer_ = path[0];
+  ErrorCodes result = renderCanvas(layers_tree, canvases[0]);
+  layers_tree->current_active_layer_ = active_layer;
+  if (result == OK)
+  {
+    memcpy(canvases[1], canvases[0], canvas_size);
+  }
 
-  for (int y_coordinate = 0;  y_coordinate < crop_height;  y_coordinate++)
+  // frame that each canvas holds
+  int canvas_frames[2] = {0, 0};
+  FrameWriter writer = {0};
+  RenderJob job = {NULL, NULL, 1, NULL, NULL, 0, NULL, NULL, NULL, canvas_width, 0, 0,
+                   getBandHeight(canvas_width), NULL};
+  for (int frame = 0; frame < frames_count && result == OK; frame++)
   {
-    for (int x_coordinate = 0; x_coordinate < crop_width; x_coordinate++)
+    int turn = frame % 2;
+    job.canvas_ = canvases[turn];
+    double start = getSeconds();
+    uint64_t blended_pixels = 0;
+    for (int step = canvas_frames[turn] + 1; step <= frame; step++)
+    {
+      BMP* bmp = path[step]->bmp_;
+      buildLayerSpans(&path[step], 1);
+      job.layers_ = &path[step];
+      job.first_row_ = path[step]->coordinate_y_;
+      job.end_row_ = path[step]->coordinate_y_ + bmp->height_;
+      runThreadPool(layers_tree->thread_pool_, blendStepBand, &job,
+                    (bmp->height_ + job.band_height_ - 1) / job.band_height_);
+      blended_pixels += (uint64_t)bmp->width_ * bmp->height_;
+    }
+    canvas_frames[turn] = frame;
+    if (frame > 0)
     {
-      int old_x = top_x - 1 + x_coordinate;
-      int old_y = top_y - 1 + y_coordinate;
-      int old_index = (old_y * old_bmp->width_ + old_x) * BYTE;
-      int new_index = (y_coordinate * crop_width + x_coordinate) * BYTE;
+      addStageTime(layers_tree, STAGE_BLEND, getSeconds() - start, blended_pixels);
+    }
 
-      for (int c = 0; c < 4; c++)
-      {
-        new_bmp->pixels_[new_index + c] = old_bmp->pixels_[old_index + c];
-      }
+    result = finishFrameWriter(&writer);
+    char* frame_path = result == OK ? formatFramePath(words[3], path[frame]->layer_id_) : NULL;
+    // bmps mapped from the file are copied before it is written, no thread reads bmp pixels at this point
+    if (result == OK && (frame_path == NULL || detachMappedFile(library, frame_path) != OK))
+    {
+      free(frame_path);
+      result = ERROR_MALLOC_FAILED;
+    }
+    if (result == OK)
+    {
+      startFrameWriter(&writer, frame_path, canvases[turn], canvas_width, canvas_height);
     }
   }
-  int result = resizeCapacity(library);
-  if (result != OK)
-  {
-      free(new_bmp->pixels_);
-      free(new_bmp);
-      return result;
-  }
-  library->bmps_[library->next_id_] = new_bmp;
-  library->next_id_++;
-  printCropMessage(id, new_bmp->bmp_id_, crop_width, crop_height);
-  return OK;
-}
+  ErrorCodes write_result = finishFrameWriter(&writer);
+  result = result == OK ? write_result : result;
 
-//----------------------------------------------------------------------------------------------------------------------
-/// @brief Validates the blend mode.
-/// @param mode Blend mode from user input.
-/// @return OK (0) if everything passed, ERROR_INVALID_BLEND_MODE (-1) if blend mode was incorrect.
-ErrorCodes checkBlendMode(char mode)
-{
-  if ((mode != BLEND_MODE_N) && (mode != BLEND_MODE_M) && (mode != BLEND_MODE_S))
+  free(canvases[1]);
+  free(canvases[0]);
+  free(path);
+  if (result == OK)
   {
-    return ERROR_INVALID_BLEND_MODE;
+    printf("Exported %d frames from layer %d to layer %d\n", frames_count, ends[0]->layer_id_, ends[1]->layer_id_);
   }
-  return OK;
+  return result;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Places bmp on the canvas by storing bmps in different layers on the layer tree.
-/// @param id Id of the bmp.
-/// @param canvas_x X coordinate where bmp is placed on the canvas.
-/// @param canvas_y Y coordinate where bmp is placed on the canvas.
-/// @param blend_mode Blend mode with which bmp should be placed.
-/// @param library The bmp library of the program.
+/// @brief Frees one layer of an abandoned branch. Its snapshot is evicted, its bmps can be unloaded again and the
+///        layer goes back to the arena for the next place. A frame that shows the layer is dropped as well, since it
+///        can no longer be brought up to date from it.
 /// @param layers_tree The layer tree of the program.
-/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if malloc failed, (-1,2,3) for every other error.
-ErrorCodes placeBmp(int id, int canvas_x, int canvas_y, char blend_mode, BmpLibrary* library, TreeNode* layers_tree)
+/// @param layer The layer, it is not linked to its parent any more.
+/// @param reclaimed_bytes Receives the bytes that were freed in addition.
+void releaseLayer(TreeNode* layers_tree, Layer* layer, size_t* reclaimed_bytes)
 {
-  Layer* new_layer = calloc(1, sizeof(Layer));
-  if (new_layer == NULL)
+  if (layer->snapshot_ != NULL)
   {
-    return ERROR_MALLOC_FAILED;
+    *reclaimed_bytes += layer->snapshot_->size_;
+    evictSnapshot(layers_tree, layer);
   }
-  Layer* parent = layers_tree->current_active_layer_;
-  new_layer->width_ = parent->width_;
-  new_layer->height_ = parent->height_;
-
-  new_layer->bmp_ = library->bmps_[id];
-  new_layer->coordinate_x_ = canvas_x - 1;
-  new_layer->coordinate_y_ = canvas_y - 1;
-  new_layer->blend_mode_ = blend_mode;
-  new_layer->layer_id_ = layers_tree->next_id_++;
-  new_layer->parent_layer_ = parent;
-
-  new_layer->children_list_ = calloc(5, sizeof(Layer*));
-  if (new_layer->children_list_ == NULL) 
+  if (layers_tree->frame_layer_ == layer)
   {
-    free(new_layer);
-    return ERROR_MALLOC_FAILED;
+    *reclaimed_bytes += (size_t)layer->width_ * layer->height_ * BYTE;
+    free(layers_tree->frame_);
+    layers_tree->frame_ = NULL;
+    layers_tree->frame_layer_ = NULL;
   }
-  new_layer->number_of_children_ = START_NUMBER_OF_CHILDREN;
-  new_layer->capacity_ = LAYER_TREE_CAPACITY;
-
-  if (parent->number_of_children_ >= parent->capacity_)
+  layer->bmp_->use_count_--;
+  if (layer->flattened_bmp_ != NULL)
   {
-    parent->capacity_ += 1;
-    Layer** temporary = realloc(parent->children_list_, parent->capacity_ * sizeof(Layer*));
-    if (temporary == NULL)
-    {
-      free(new_layer->children_list_);
-      free(new_layer);
-      return ERROR_MALLOC_FAILED;
-    }
-    parent->children_list_ = temporary;
-    temporary = NULL;
+    layer->flattened_bmp_->use_count_--;
   }
-  parent->children_list_[parent->number_of_children_++] = new_layer;
-  layers_tree->current_active_layer_ = new_layer;
-
-  printPlaceMessage(new_layer->layer_id_);
-  return OK;
+  layers_tree->layer_table_[layer->layer_id_] = NULL;
+  layers_tree->layers_count_--;
+  *reclaimed_bytes += sizeof(Layer);
+  layer->next_sibling_ = layers_tree->arena_.free_layers_;
+  layers_tree->arena_.free_layers_ = layer;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Validates the place command and calls placeBmp() to actually place the bmp.
-/// @param library The bmp library of the program.
-/// @param words User input split into words.
+/// @brief Frees every layer that is not on the path from the root to the active layer, including the layers above
+///        the active one. Layers keep their ids, the ids of freed layers are not found any more, and free ids at the
+///        end of the id table are handed out again.
 /// @param layers_tree The layer tree of the program.
-/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if malloc failed, (-1,2,3) for every other error.
-ErrorCodes placeCommand(BmpLibrary* library, char** words, TreeNode* layers_tree)
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if malloc failed.
+ErrorCodes pruneLayers(TreeNode* layers_tree)
 {
-  int id = atoi(words[1]);
-  int canvas_x = atoi(words[2]);
-  int canvas_y = atoi(words[3]);
-  char blend_mode = words[4][0];
-  ErrorCodes result = checkBmpId(id, library);
-  if (result != OK)
+  Layer** order = malloc(layers_tree->next_id_ * sizeof(Layer*));
+  if (order == NULL)
   {
-    return result;
+    return ERROR_MALLOC_FAILED;
   }
-  for (int index_words = 1; index_words < PLACE_ARGS_COUNT - 1; index_words++)
+  int pruned_count = 0;
+  size_t reclaimed_bytes = 0;
+  Layer* path_child = NULL;
+  for (Layer* layer = layers_tree->current_active_layer_; layer != NULL; layer = layer->parent_layer_)
   {
-    for (int index_letters = 0; words[index_words][index_letters] != 0; index_letters++)
+    if (layer->number_of_children_ > (path_child != NULL ? 1 : 0))
     {
-      if (!isdigit((unsigned char)words[index_words][index_letters]))
+      Layer* child = layer->first_child_;
+      while (child != NULL)
       {
-        return ERROR_INVALID_COORDINATES;
+        Layer* next = child->next_sibling_;
+        if (child != path_child)
+        {
+          int count = traverseLayers(child, order, NULL, layers_tree->next_id_);
+          for (int index = 0; index < count; index++)
+          {
+            releaseLayer(layers_tree, order[index], &reclaimed_bytes);
+          }
+          pruned_count += count;
+        }
+        child = next;
+      }
+      layer->first_child_ = path_child;
+      layer->last_child_ = path_child;
+      layer->number_of_children_ = path_child != NULL ? 1 : 0;
+      if (path_child != NULL)
+      {
+        path_child->next_sibling_ = NULL;
       }
     }
+    path_child = layer;
   }
-  Layer* layer = layers_tree->current_active_layer_;
-  BMP* bmp = library->bmps_[id];
-  
-  if (canvas_x <= 0 || canvas_y <= 0)
-  {
-    return ERROR_INVALID_COORDINATES;
-  }
-
-  if ((canvas_x - 1 + bmp->width_) > layer->width_ ||
-    (canvas_y - 1 + bmp->height_) > layer->height_)
-  {
-    return ERROR_BMP_DOESNT_FIT;
-  }
-
-  if (words[4][1] != '\0') 
-  {
-      return ERROR_INVALID_BLEND_MODE;
-  }
-  result = checkBlendMode(blend_mode);
-  if (result != OK) 
-  {
-      return result;
-  }
-  result = placeBmp(id, canvas_x, canvas_y, blend_mode, library, layers_tree);
-  if (result != 0)
-  {
-    return result;
-  }
+  free(order);
+  shrinkLayerTable(layers_tree, &reclaimed_bytes);
+  layers_tree->branches_since_prune_ = 0;
+  printf("Pruned %d layers and reclaimed %zu bytes\n", pruned_count, reclaimed_bytes);
   return OK;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Switches user to the previous layer.
+/// @brief Gets the memory the layer tree holds: the layers, the id table and the snapshots.
 /// @param layers_tree The layer tree of the program.
-/// @return OK (0) if everything passed, ERROR_ALREADY_ROOT (-1) if already at root layer.
-ErrorCodes undoCommand(TreeNode* layers_tree)
+/// @return The size in bytes.
+size_t getLayerTreeBytes(TreeNode* layers_tree)
 {
-  if (layers_tree->current_active_layer_->layer_id_ == ROOT_LAYER_ID)
-  {
-    return ERROR_ALREADY_ROOT;
-  }
-  layers_tree->current_active_layer_ = layers_tree->current_active_layer_->parent_layer_;
-  printUndoMessage(layers_tree->current_active_layer_->layer_id_);
-  return OK;
+  return (size_t)layers_tree->layers_count_ * sizeof(Layer) +
+         (size_t)layers_tree->table_capacity_ * sizeof(Layer*) + layers_tree->cache_used_;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Starts at leaf, goes up to root by parent layer to get the array of layers to print.
+/// @brief Prunes the abandoned branches once more branches were started since the last prune than --prune-branches
+///        allows, or once the layer tree holds more memory than --prune-budget. Nothing happens while every layer is
+///        on the active path.
 /// @param layers_tree The layer tree of the program.
-/// @param layers_to_print Array of the layers we want to print.
-/// @return last_index which is actually the count of all layers we want to print excluding the root layer.
-int getLayers(TreeNode* layers_tree, Layer** layers_to_print)
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if malloc failed.
+ErrorCodes applyPrunePolicy(TreeNode* layers_tree)
 {
-  Layer* current_layer = layers_tree->current_active_layer_;
-  int last_index = 0;
-  while (current_layer->layer_id_ != 0)
+  if (layers_tree->layers_count_ == layers_tree->current_active_layer_->depth_ + 1)
   {
-    layers_to_print[last_index++] = current_layer;
-    current_layer = current_layer->parent_layer_;
+    return OK;
   }
-
-  for (int index = 0; index < last_index / 2; index++)
+  if ((layers_tree->prune_branches_ > 0 && layers_tree->branches_since_prune_ > layers_tree->prune_branches_) ||
+      (layers_tree->prune_budget_ > 0 && getLayerTreeBytes(layers_tree) > layers_tree->prune_budget_))
   {
-    Layer* temporary = layers_to_print[index];
-    layers_to_print[index] = layers_to_print[last_index - 1 - index];
-    layers_to_print[last_index - 1 - index] = temporary;
+    return pruneLayers(layers_tree);
   }
+  return OK;
+}
 
-  return last_index;
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Gets the bytes of its pixel buffer that a bmp reads, from the first byte of its top or bottom row (whichever
+///        comes first) to the end of the other one.
+/// @param bmp The bmp.
+/// @param first_byte Receives the offset of the first byte in the buffer.
+/// @param end_byte Receives the offset after the last byte.
+void getBmpByteRange(BMP* bmp, ptrdiff_t* first_byte, ptrdiff_t* end_byte)
+{
+  ptrdiff_t first_row = bmp->pixels_ - bmp->buffer_->data_;
+  ptrdiff_t last_row = first_row + (ptrdiff_t)(bmp->height_ - 1) * bmp->stride_;
+  *first_byte = first_row < last_row ? first_row : last_row;
+  *end_byte = (first_row < last_row ? last_row : first_row) + (ptrdiff_t)bmp->width_ * BYTE;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Blends the layer pixels together.
-/// @param layer Current layer.
-/// @param canvas The root layer.
-/// @param canvas_width Width of the canvas.
-void blendLayer(Layer* layer, char* canvas, int canvas_width)
+/// @brief Orders bmps by the pixel buffer they use and then by the first byte they read, so that views of the same
+///        buffer end up next to each other in the order they lie in it. The buffers themselves are ordered by address
+///        here, compareBufferGroups() puts them in a fixed order afterwards.
+/// @param first Pointer to the first bmp.
+/// @param second Pointer to the second bmp.
+/// @return Negative, zero or positive like strcmp().
+int compareBmpBuffers(const void* first, const void* second)
 {
-  BMP* bmp = layer->bmp_;
-  double alpha = 0;
-  for (int y = 0; y < bmp->height_; y++)
+  BMP* first_bmp = *(BMP* const*)first;
+  BMP* second_bmp = *(BMP* const*)second;
+  uintptr_t first_buffer = (uintptr_t)first_bmp->buffer_;
+  uintptr_t second_buffer = (uintptr_t)second_bmp->buffer_;
+  if (first_buffer != second_buffer)
   {
-    for (int x = 0; x < bmp->width_; x++)
-    {
-      int bmp_index = (y * bmp->width_ + x) * BYTE;
-      int canvas_x = layer->coordinate_x_ + x;
-      int canvas_y = layer->coordinate_y_ + y;
-      int canvas_index = (canvas_y * canvas_width + canvas_x) * BYTE;
-
-      switch (layer->blend_mode_)
-      {
-        case BLEND_MODE_N:
-          alpha = (unsigned char)bmp->pixels_[bmp_index + 3] / 255.0;
-          for (int c = 0; c < 3; c++) {
-              unsigned char A = (unsigned char)canvas[canvas_index + c];
-              unsigned char B = (unsigned char)bmp->pixels_[bmp_index + c];
-              canvas[canvas_index + c] = (unsigned char)(alpha * B + (1.0 - alpha) * A);
-          }
-          canvas[canvas_index + 3] = (unsigned char)255;
-          break;
-        case BLEND_MODE_M:
-          canvas[canvas_index] = ((unsigned char)canvas[canvas_index] * (unsigned char)bmp->pixels_[bmp_index]) / 255;
-          canvas[canvas_index + 1] = 
-          ((unsigned char)canvas[canvas_index + 1] * (unsigned char)bmp->pixels_[bmp_index + 1]) / 255;
-          canvas[canvas_index + 2] = 
-          ((unsigned char)canvas[canvas_index + 2] * (unsigned char)bmp->pixels_[bmp_index + 2]) / 255;
-          canvas[canvas_index + 3] = (unsigned char)255;
-          break;
-        case BLEND_MODE_S:
-          canvas[canvas_index] = 
-          (unsigned char)abs((unsigned char)canvas[canvas_index] - (unsigned char)bmp->pixels_[bmp_index]);
-          canvas[canvas_index + 1] = 
-          (unsigned char)abs((unsigned char)canvas[canvas_index + 1] - (unsigned char)bmp->pixels_[bmp_index + 1]);
-          canvas[canvas_index + 2] = 
-          (unsigned char)abs((unsigned char)canvas[canvas_index + 2] - (unsigned char)bmp->pixels_[bmp_index + 2]);
-          canvas[canvas_index + 3] = (unsigned char)255;
-          break;
-        default:
-          break;
-      }
-    }
+    return (first_buffer > second_buffer) - (first_buffer < second_buffer);
   }
+  ptrdiff_t first_start;
+  ptrdiff_t second_start;
+  ptrdiff_t end_byte;
+  getBmpByteRange(first_bmp, &first_start, &end_byte);
+  getBmpByteRange(second_bmp, &second_start, &end_byte);
+  return (first_start > second_start) - (first_start < second_start);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Prints the canvas.
-/// @param canvas The root layer.
-/// @param canvas_height Height of the canvas.
-/// @param canvas_width Width of the canvas.
-void printCanvas(char* canvas, int canvas_height, int canvas_width)
+/// @brief Orders the pixel buffers of a project by the lowest bmp id that uses them, so the blobs are written in the
+///        same order every time and do not depend on where the buffers were allocated.
+/// @param first Pointer to the first group.
+/// @param second Pointer to the second group.
+/// @return Negative, zero or positive like strcmp().
+int compareBufferGroups(const void* first, const void* second)
+{
+  int first_id = ((const BufferGroup*)first)->lowest_bmp_id_;
+  int second_id = ((const BufferGroup*)second)->lowest_bmp_id_;
+  return (first_id > second_id) - (first_id < second_id);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Saves the library and the layer tree to a project file. The file starts with fixed size tables (blobs,
+///        bmps, free ids and layers that refer to their parent by id), followed by the paths and the pixel blobs. A
+///        blob is the part of a pixel buffer that the bmps using it read, views that overlap share one blob and only
+///        store where they start in it. Nothing else of a buffer is written, so a project that was loaded (where
+///        every bmp uses the whole mapped file) does not carry its tables or unloaded bmps into the next one. Blobs
+///        follow the lowest bmp id of their buffer, so the same session is always saved to the same bytes. The file
+///        is written next to the target and renamed over it when it is complete, so a project that is still mapped by
+///        loadstate is never changed in place.
+/// @param path Path of the project file.
+/// @param library The bmp library of the program.
+/// @param layers_tree The layer tree of the program.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if malloc failed, ERROR_INVALID_FILE_PATH (-1) if
+///         the file could not be written.
+ErrorCodes saveStateCommand(char* path, BmpLibrary* library, TreeNode* layers_tree)
 {
-  printf("   ");
-  for (int column_indices = 1; column_indices <= canvas_width; column_indices++)
+  static const char padding[STATE_ALIGNMENT];
+  int bmps_count = library->next_id_;
+  int layers_count = layers_tree->next_id_;
+  BMP** sorted_bmps = malloc((bmps_count + 1) * sizeof(BMP*));
+  BufferGroup* groups = malloc((bmps_count + 1) * sizeof(BufferGroup));
+  const char** blob_data = malloc((bmps_count + 1) * sizeof(char*));
+  StateBlob* blobs = calloc(bmps_count + 1, sizeof(StateBlob));
+  StateBmp* bmps = calloc(bmps_count + 1, sizeof(StateBmp));
+  StateLayer* layers = calloc(layers_count, sizeof(StateLayer));
+  struct iovec* parts = malloc((3 * bmps_count + 5) * sizeof(struct iovec));
+  if (sorted_bmps == NULL || groups == NULL || blob_data == NULL || blobs == NULL || bmps == NULL || layers == NULL ||
+      parts == NULL)
   {
-    if (column_indices < 10)
-    {
-      printf(" 0%d", column_indices);
-    }
-    else
-    {
-      printf(" %d", column_indices);
-    }
+    free(parts);
+    free(layers);
+    free(bmps);
+    free(blobs);
+    free(blob_data);
+    free(groups);
+    free(sorted_bmps);
+    return ERROR_MALLOC_FAILED;
   }
-  printf("\n");
 
-  for (int y = 0; y < canvas_height; y++)
+  int loaded_count = 0;
+  for (int id = 0; id < bmps_count; id++)
   {
-    int row_indices = y + 1;
-    if (row_indices < 10)
-    {
-      printf("0");
-    }
-    printf("%d|", row_indices);
-
-    for (int x = 0; x < canvas_width; x++)
+    bmps[id].blob_ = STATE_NO_ID;
+    if (library->bmps_[id] != NULL)
     {
-        int index = (y * canvas_width + x) * BYTE;
-        unsigned char B = canvas[index];
-        unsigned char G = canvas[index + 1];
-        unsigned char R = canvas[index + 2];
-        printf("\033[38;2;%d;%d;%dm███\033[0m", R, G, B);
+      sorted_bmps[loaded_count++] = library->bmps_[id];
     }
-    printf("|\n");
   }
-
-  printf("  ");
-  for (int bottom = 0; bottom < canvas_width * 3 + 2; bottom++)
+  qsort(sorted_bmps, loaded_count, sizeof(BMP*), compareBmpBuffers);
+  int groups_count = 0;
+  for (int index = 0; index < loaded_count; index++)
   {
-    printf("-");
-  }
-  printf("\n");
-}
-
-//----------------------------------------------------------------------------------------------------------------------
-/// @brief Initializes the canvas, blends the layers and prints the canvas.
-/// @param layers_tree The layer tree of the program.
-/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if memory allocation failed
-ErrorCodes printCommand(TreeNode* layers_tree)
-{
-  Layer* layer = layers_tree->current_active_layer_;
-  int canvas_height = layer->height_;
-  int canvas_width = layer->width_;
-  int canvas_size = canvas_height * canvas_width * BYTE;
-  char* canvas = calloc(canvas_size, sizeof(char));
-  if (canvas == NULL)
+    if (index == 0 || sorted_bmps[index]->buffer_ != sorted_bmps[index - 1]->buffer_)
+    {
+      groups[groups_count++] = (BufferGroup){index, index, sorted_bmps[index]->bmp_id_};
+    }
+    BufferGroup* group = &groups[groups_count - 1];
+    group->end_index_ = index + 1;
+    group->lowest_bmp_id_ = sorted_bmps[index]->bmp_id_ < group->lowest_bmp_id_ ? sorted_bmps[index]->bmp_id_ :
+                                                                                  group->lowest_bmp_id_;
+  }
+  qsort(groups, groups_count, sizeof(BufferGroup), compareBufferGroups);
+  int blobs_count = 0;
+  ptrdiff_t blob_start = 0;
+  ptrdiff_t blob_end = 0;
+  for (int group = 0; group < groups_count; group++)
   {
-    return ERROR_MALLOC_FAILED;
+    for (int index = groups[group].first_index_; index < groups[group].end_index_; index++)
+    {
+      BMP* bmp = sorted_bmps[index];
+      ptrdiff_t first_byte;
+      ptrdiff_t end_byte;
+      getBmpByteRange(bmp, &first_byte, &end_byte);
+      // a view that starts behind the end of the blob before it gets a blob of its own
+      if (index == groups[group].first_index_ || first_byte > blob_end)
+      {
+        blob_start = first_byte;
+        blob_end = end_byte;
+        blob_data[blobs_count++] = bmp->buffer_->data_ + blob_start;
+      }
+      blob_end = end_byte > blob_end ? end_byte : blob_end;
+      blobs[blobs_count - 1].size_ = blob_end - blob_start;
+      StateBmp* record = &bmps[bmp->bmp_id_];
+      record->blob_ = blobs_count - 1;
+      record->width_ = bmp->width_;
+      record->height_ = bmp->height_;
+      record->pixels_offset_ = bmp->pixels_ - bmp->buffer_->data_ - blob_start;
+      record->stride_ = bmp->stride_;
+      record->path_length_ = bmp->path_ != NULL ? (int32_t)strlen(bmp->path_) : 0;
+    }
   }
-
-  for (int pixel_index = 0; pixel_index < canvas_size; pixel_index += BYTE)
+  for (int id = 0; id < layers_count; id++)
   {
-    canvas[pixel_index] = (unsigned char)255;
-    canvas[pixel_index + 1] = (unsigned char)255;
-    canvas[pixel_index + 2] = (unsigned char)255;
-    canvas[pixel_index + 3] = (unsigned char)255;
+    Layer* layer = layers_tree->layer_table_[id];
+    // ids freed by prune are stored as layers without parent and bmp
+    if (layer == NULL)
+    {
+      layers[id].parent_id_ = STATE_NO_ID;
+      layers[id].bmp_id_ = STATE_NO_ID;
+      layers[id].flattened_bmp_id_ = STATE_NO_ID;
+      continue;
+    }
+    layers[id].parent_id_ = layer->parent_layer_ != NULL ? layer->parent_layer_->layer_id_ : STATE_NO_ID;
+    layers[id].bmp_id_ = layer->bmp_ != NULL ? layer->bmp_->bmp_id_ : STATE_NO_ID;
+    layers[id].flattened_bmp_id_ = layer->flattened_bmp_ != NULL ? layer->flattened_bmp_->bmp_id_ : STATE_NO_ID;
+    layers[id].coordinate_x_ = layer->coordinate_x_;
+    layers[id].coordinate_y_ = layer->coordinate_y_;
+    layers[id].blend_mode_ = layer->blend_mode_;
   }
-  
-  if (layers_tree->current_active_layer_->layer_id_ == 0)
+
+  StateHeader header;
+  memset(&header, 0, sizeof(StateHeader));
+  memcpy(header.magic_, STATE_MAGIC, STATE_MAGIC_SIZE);
+  header.version_ = STATE_VERSION;
+  header.canvas_width_ = layers_tree->layer_table_[ROOT_LAYER_ID]->width_;
+  header.canvas_height_ = layers_tree->layer_table_[ROOT_LAYER_ID]->height_;
+  header.blobs_count_ = blobs_count;
+  header.bmps_count_ = bmps_count;
+  header.free_count_ = library->free_count_;
+  header.layers_count_ = layers_count;
+  header.active_layer_id_ = layers_tree->current_active_layer_->layer_id_;
+  header.blobs_offset_ = sizeof(StateHeader);
+  header.bmps_offset_ = header.blobs_offset_ + blobs_count * sizeof(StateBlob);
+  header.free_ids_offset_ = header.bmps_offset_ + bmps_count * sizeof(StateBmp);
+  header.layers_offset_ = header.free_ids_offset_ + library->free_count_ * sizeof(int32_t);
+  parts[0] = (struct iovec){&header, sizeof(StateHeader)};
+  parts[1] = (struct iovec){blobs, blobs_count * sizeof(StateBlob)};
+  parts[2] = (struct iovec){bmps, bmps_count * sizeof(StateBmp)};
+  parts[3] = (struct iovec){library->free_ids_, library->free_count_ * sizeof(int32_t)};
+  parts[4] = (struct iovec){layers, layers_count * sizeof(StateLayer)};
+  int parts_count = 5;
+
+  uint64_t offset = header.layers_offset_ + layers_count * sizeof(StateLayer);
+  for (int id = 0; id < bmps_count; id++)
   {
-    printCanvas(canvas, canvas_height, canvas_width);
-    free(canvas);
-    return OK;
+    if (bmps[id].path_length_ > 0)
+    {
+      bmps[id].path_offset_ = offset;
+      parts[parts_count++] = (struct iovec){library->bmps_[id]->path_, bmps[id].path_length_};
+      offset += bmps[id].path_length_;
+    }
   }
-  Layer** layers_to_print = calloc(layers_tree->next_id_, sizeof(Layer*));
-  if (layers_to_print == NULL)
+  for (int blob = 0; blob < blobs_count; blob++)
   {
-    free(canvas);
-    return ERROR_MALLOC_FAILED;
+    uint64_t aligned_offset = (offset + STATE_ALIGNMENT - 1) / STATE_ALIGNMENT * STATE_ALIGNMENT;
+    parts[parts_count++] = (struct iovec){(void*)padding, aligned_offset - offset};
+    parts[parts_count++] = (struct iovec){(void*)blob_data[blob], blobs[blob].size_};
+    blobs[blob].offset_ = aligned_offset;
+    offset = aligned_offset + blobs[blob].size_;
   }
-  int layers_count = getLayers(layers_tree, layers_to_print);
 
-  for (int index = 0; index < layers_count; index++)
+  char* temporary_path = NULL;
+  int descriptor = -1;
+  ErrorCodes result = createTemporaryFile(path, &temporary_path, &descriptor);
+  if (result == OK)
   {
-    blendLayer(layers_to_print[index], canvas, canvas_width);
+    result = writeRows(descriptor, parts, parts_count);
+    result = commitTemporaryFile(descriptor, temporary_path, path, result);
   }
-
-  printCanvas(canvas, canvas_height, canvas_width);
-  free(layers_to_print);
-  free(canvas);
-  return OK;
+  if (result == OK)
+  {
+    printf("Successfully saved state to %s\n", path);
+  }
+  free(parts);
+  free(layers);
+  free(bmps);
+  free(blobs);
+  free(blob_data);
+  free(groups);
+  free(sorted_bmps);
+  return result;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Gets the pointer to the root layer of the tree.
-/// @param layers_tree The layer tree of the program.
-/// @return The root of the tree.
-Layer* getRootLayer(TreeNode* layers_tree)
+/// @brief Checks that a table of fixed size records lies within the project file.
+/// @param file The mapped project file.
+/// @param offset Offset of the table.
+/// @param count Number of records.
+/// @param record_size Size of one record.
+/// @return 1 if the table is within the file, 0 if not.
+int isStateTableValid(PixelBuffer* file, uint64_t offset, int32_t count, size_t record_size)
 {
-  Layer* root = layers_tree->current_active_layer_;
-  while (root->parent_layer_ != NULL)
-  {
-    root = root->parent_layer_;
-  }
-  return root;
+  return count >= 0 && offset <= file->size_ && (uint64_t)count <= (file->size_ - offset) / record_size;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Prints the layer tree.
-/// @param root Root of the layer tree.
-/// @param depth Depth of the layer tree.
-void printTree(Layer* root, int depth)
+/// @brief Validates the header of a project file and that its tables lie within the file.
+/// @param file The mapped project file.
+/// @param width Width of the canvas.
+/// @param height Height of the canvas.
+/// @return OK (0) if the header is valid, ERROR_INVALID_FILE or ERROR_CANVAS_SIZE_MISMATCH (-1) if not.
+ErrorCodes checkStateHeader(PixelBuffer* file, int width, int height)
 {
-  for (int space_count = 0; space_count < depth; space_count++)
+  if (file->size_ < sizeof(StateHeader))
   {
-    printf("   ");
+    return ERROR_INVALID_FILE;
   }
-  printf("Layer %d renders BMP %d at %d %d\n",
-          root->layer_id_, root->bmp_->bmp_id_, root->coordinate_x_ + 1, root->coordinate_y_ + 1);
-  if (root->number_of_children_ != 0)
+  StateHeader header;
+  memcpy(&header, file->data_, sizeof(StateHeader));
+  if (memcmp(header.magic_, STATE_MAGIC, STATE_MAGIC_SIZE) != 0 || header.version_ != STATE_VERSION ||
+      !isStateTableValid(file, header.blobs_offset_, header.blobs_count_, sizeof(StateBlob)) ||
+      !isStateTableValid(file, header.bmps_offset_, header.bmps_count_, sizeof(StateBmp)) ||
+      !isStateTableValid(file, header.free_ids_offset_, header.free_count_, sizeof(int32_t)) ||
+      !isStateTableValid(file, header.layers_offset_, header.layers_count_, sizeof(StateLayer)) ||
+      header.free_count_ > header.bmps_count_ || header.layers_count_ < 1 || header.active_layer_id_ < 0 ||
+      header.active_layer_id_ >= header.layers_count_)
   {
-    for (int index = 0; index < root->number_of_children_; index++)
-    {
-      printTree(root->children_list_[index], depth + 1);
-    }
+    return ERROR_INVALID_FILE;
+  }
+  if (header.canvas_width_ != width || header.canvas_height_ != height)
+  {
+    return ERROR_CANVAS_SIZE_MISMATCH;
   }
+  return OK;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Gets the root of the tree and prints it.
-/// @param layers_tree The layer tree of the program.
-/// @return OK (0) if everything passes.
-ErrorCodes treeCommand(TreeNode* layers_tree)
+/// @brief Creates the bmps of a project file. They are views into the mapped file and share it as their pixel
+///        buffer, so nothing is decoded or copied.
+/// @param file The mapped project file, its header was checked already.
+/// @param library Zeroed library that receives the bmps.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if malloc failed, ERROR_INVALID_FILE (-1) if a record
+///         is invalid.
+ErrorCodes readStateBmps(PixelBuffer* file, BmpLibrary* library)
 {
-  int depth = 0;
-  Layer* root = getRootLayer(layers_tree);
-  printf("Layer %d\n", root->layer_id_);
+  StateHeader header;
+  memcpy(&header, file->data_, sizeof(StateHeader));
+  library->capacity_ = header.bmps_count_ > LIBRARY_CAPACITY ? header.bmps_count_ : LIBRARY_CAPACITY;
+  library->bmps_ = calloc(library->capacity_, sizeof(BMP*));
+  library->free_ids_ = calloc(library->capacity_, sizeof(int));
+  if (library->bmps_ == NULL || library->free_ids_ == NULL)
+  {
+    return ERROR_MALLOC_FAILED;
+  }
+  library->next_id_ = header.bmps_count_;
 
-  if (root->number_of_children_ != 0)
+  for (int id = 0; id < header.bmps_count_; id++)
   {
-    for (int index = 0; index < root->number_of_children_; index++)
+    StateBmp record;
+    memcpy(&record, file->data_ + header.bmps_offset_ + id * sizeof(StateBmp), sizeof(StateBmp));
+    if (record.blob_ == STATE_NO_ID)
     {
-      printTree(root->children_list_[index], depth + 1);
+      continue;
+    }
+    if (record.blob_ < 0 || record.blob_ >= header.blobs_count_ || record.width_ <= 0 || record.height_ <= 0 ||
+        record.path_length_ < 0 || !isStateTableValid(file, record.path_offset_, record.path_length_, 1))
+    {
+      return ERROR_INVALID_FILE;
+    }
+    StateBlob blob;
+    memcpy(&blob, file->data_ + header.blobs_offset_ + record.blob_ * sizeof(StateBlob), sizeof(StateBlob));
+    if (blob.offset_ > file->size_ || blob.size_ > file->size_ - blob.offset_)
+    {
+      return ERROR_INVALID_FILE;
+    }
+    // every row of the view has to lie within the blob
+    int64_t blob_size = (int64_t)blob.size_;
+    int64_t row_size = (int64_t)record.width_ * BYTE;
+    int64_t stride_size = record.stride_ < 0 ? -record.stride_ : record.stride_;
+    if (record.pixels_offset_ < 0 || record.pixels_offset_ > blob_size || row_size > blob_size ||
+        stride_size > blob_size || (stride_size > 0 && record.height_ - 1 > blob_size / stride_size))
+    {
+      return ERROR_INVALID_FILE;
+    }
+    int64_t last_row_offset = record.pixels_offset_ + (int64_t)(record.height_ - 1) * record.stride_;
+    int64_t first_byte = record.stride_ < 0 ? last_row_offset : record.pixels_offset_;
+    int64_t end_byte = (record.stride_ < 0 ? record.pixels_offset_ : last_row_offset) + row_size;
+    if (first_byte < 0 || end_byte > blob_size)
+    {
+      return ERROR_INVALID_FILE;
     }
-  }
-  return OK;
-}
 
-//----------------------------------------------------------------------------------------------------------------------
-/// @brief Switches from current to the chosen layer.
-/// @param layer Pointer to the layer we are on.
-/// @param new_layer_id Pointer to the layer we want to be on.
-/// @return Returns current layer if we are already on the layer we want to switch to, returns the switched layer if
-///         we switched, NULL otherwise.
-Layer* switchLayer(Layer* layer, int new_layer_id)
-{
-  Layer* switched_layer = NULL;
+    BMP* bmp = calloc(1, sizeof(BMP));
+    if (bmp == NULL)
+    {
+      return ERROR_MALLOC_FAILED;
+    }
+    library->bmps_[id] = bmp;
+    bmp->bmp_id_ = id;
+    bmp->width_ = record.width_;
+    bmp->height_ = record.height_;
+    bmp->buffer_ = retainPixelBuffer(file);
+    bmp->pixels_ = file->data_ + blob.offset_ + record.pixels_offset_;
+    bmp->stride_ = record.stride_;
+    if (record.path_length_ > 0)
+    {
+      bmp->path_ = calloc(record.path_length_ + 1, sizeof(char));
+      if (bmp->path_ == NULL)
+      {
+        return ERROR_MALLOC_FAILED;
+      }
+      memcpy(bmp->path_, file->data_ + record.path_offset_, record.path_length_);
+    }
+  }
 
-  if (layer->layer_id_ == new_layer_id)
+  char* is_free = calloc(header.bmps_count_ + 1, sizeof(char));
+  if (is_free == NULL)
   {
-    return layer;
+    return ERROR_MALLOC_FAILED;
   }
-  else if (layer->number_of_children_ != 0 && layer->layer_id_ != new_layer_id)
+  ErrorCodes result = OK;
+  for (int index = 0; index < header.free_count_ && result == OK; index++)
   {
-    for (int index = 0; index < layer->number_of_children_; index++)
+    int32_t id;
+    memcpy(&id, file->data_ + header.free_ids_offset_ + index * sizeof(int32_t), sizeof(int32_t));
+    if (id < 0 || id >= header.bmps_count_ || library->bmps_[id] != NULL || is_free[id])
     {
-      switched_layer = switchLayer(layer->children_list_[index], new_layer_id);
-      if (switched_layer != NULL)
-      {
-        return switched_layer;
-      }
+      result = ERROR_INVALID_FILE;
+      break;
     }
+    is_free[id] = 1;
+    library->free_ids_[library->free_count_++] = id;
   }
-  return NULL;
+  free(is_free);
+  return result;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Validates the switch command and executes it.
-/// @param layers_tree The tree of the program.
-/// @param new_id Id of the layer we want to switch to.
-/// @return OK (0) if everything passes, ERROR_INVALID_COORDINATES (-1) if coordinates are invalid.
-ErrorCodes switchCommand(TreeNode* layers_tree, char* new_id)
+/// @brief Rebuilds the layer tree of a project file. Parents always have a smaller id than their children, so the
+///        records are linked in one pass in id order, which also restores the order of the children.
+/// @param file The mapped project file, its header was checked already.
+/// @param library The library read from the same file.
+/// @param layers_tree Zeroed tree that receives the arena, the layer table and the active layer.
+/// @param width Width of the canvas.
+/// @param height Height of the canvas.
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if malloc failed, ERROR_INVALID_FILE (-1) if a record
+///         is invalid.
+ErrorCodes readStateLayers(PixelBuffer* file, BmpLibrary* library, TreeNode* layers_tree, int width, int height)
 {
-  Layer* root = getRootLayer(layers_tree);
-  Layer* switched_layer = NULL;
-
-  for (int index_letters = 0; new_id[index_letters] != 0; index_letters++)
+  StateHeader header;
+  memcpy(&header, file->data_, sizeof(StateHeader));
+  for (int id = 0; id < header.layers_count_; id++)
   {
-    if (!isdigit(new_id[index_letters]))
+    StateLayer record;
+    memcpy(&record, file->data_ + header.layers_offset_ + id * sizeof(StateLayer), sizeof(StateLayer));
+    BMP* bmp = record.bmp_id_ != STATE_NO_ID && checkBmpId(record.bmp_id_, library) == OK ?
+               library->bmps_[record.bmp_id_] : NULL;
+    BMP* flattened_bmp = record.flattened_bmp_id_ != STATE_NO_ID &&
+                         checkBmpId(record.flattened_bmp_id_, library) == OK ?
+                         library->bmps_[record.flattened_bmp_id_] : NULL;
+    int is_free = record.parent_id_ == STATE_NO_ID && record.bmp_id_ == STATE_NO_ID &&
+                  record.flattened_bmp_id_ == STATE_NO_ID;
+    if (id == ROOT_LAYER_ID)
     {
-      return ERROR_INVALID_COORDINATES;
+      if (!is_free)
+      {
+        return ERROR_INVALID_FILE;
+      }
+    }
+    else if (is_free)
+    {
+      layers_tree->next_id_ = id;
+      if (resizeLayerTable(layers_tree) != OK)
+      {
+        return ERROR_MALLOC_FAILED;
+      }
+      layers_tree->next_id_ = id + 1;
+      continue;
+    }
+    else if (record.parent_id_ < 0 || record.parent_id_ >= id || layers_tree->layer_table_[record.parent_id_] == NULL ||
+             bmp == NULL ||
+             checkBlendMode(record.blend_mode_) != OK || record.coordinate_x_ < 0 || record.coordinate_y_ < 0 ||
+             record.coordinate_x_ > width - bmp->width_ || record.coordinate_y_ > height - bmp->height_ ||
+             (record.flattened_bmp_id_ != STATE_NO_ID &&
+              (flattened_bmp == NULL || flattened_bmp->width_ != width || flattened_bmp->height_ != height ||
+               flattened_bmp->stride_ != (ptrdiff_t)width * BYTE)))
+    {
+      return ERROR_INVALID_FILE;
     }
-  }
-  
-  int new_layer_id = atoi(new_id);
 
-  if (root->layer_id_ == new_layer_id)
-  {
-    layers_tree->current_active_layer_ = root;
-    printSwitchMessage(new_layer_id);
-    return OK;
-  }
+    layers_tree->next_id_ = id;
+    if (resizeLayerTable(layers_tree) != OK)
+    {
+      return ERROR_MALLOC_FAILED;
+    }
+    Layer* layer = allocateLayer(&layers_tree->arena_);
+    if (layer == NULL)
+    {
+      return ERROR_MALLOC_FAILED;
+    }
+    layer->layer_id_ = id;
+    layer->width_ = width;
+    layer->height_ = height;
+    layers_tree->layer_table_[id] = layer;
+    layers_tree->next_id_ = id + 1;
+    layers_tree->layers_count_++;
+    if (id == ROOT_LAYER_ID)
+    {
+      continue;
+    }
 
-  for (int index = 0; index < root->number_of_children_; index++)
-  {
-    switched_layer = switchLayer(root->children_list_[index], new_layer_id);
-    if (switched_layer != NULL)
+    Layer* parent = layers_tree->layer_table_[record.parent_id_];
+    layer->bmp_ = bmp;
+    bmp->use_count_++;
+    layer->flattened_bmp_ = flattened_bmp;
+    if (flattened_bmp != NULL)
     {
-      layers_tree->current_active_layer_ = switched_layer;
-      printSwitchMessage(new_layer_id);
-      return OK;
+      flattened_bmp->use_count_++;
+    }
+    layer->coordinate_x_ = record.coordinate_x_;
+    layer->coordinate_y_ = record.coordinate_y_;
+    layer->blend_mode_ = record.blend_mode_;
+    layer->blend_row_ = getBlendRowFunction(record.blend_mode_);
+    layer->parent_layer_ = parent;
+    layer->depth_ = parent->depth_ + 1;
+    if (parent->last_child_ != NULL)
+    {
+      parent->last_child_->next_sibling_ = layer;
+    }
+    else
+    {
+      parent->first_child_ = layer;
     }
+    parent->last_child_ = layer;
+    parent->number_of_children_++;
   }
-  return ERROR_LAYER_ID_NOT_FOUND;
+  layers_tree->current_active_layer_ = layers_tree->layer_table_[header.active_layer_id_];
+  return layers_tree->current_active_layer_ != NULL ? OK : ERROR_INVALID_FILE;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Validates the save command and executes it.
+/// @brief Replaces the library and the layer tree with the ones of a project file. The file is mapped and the bmps
+///        point into it, so loading only reads the tables and the pixels are paged in when they are first used. The
+///        current session is only dropped once the whole file was read successfully.
+/// @param path Path of the project file.
+/// @param library The bmp library of the program.
 /// @param layers_tree The layer tree of the program.
-/// @param path Path we want to save the bmp to.
-/// @return OK (0) if everything passes, ERROR_MALLOC_FAILED (1) if malloc fails, (-1, 2, 3) for other types of errors.
-ErrorCodes saveCommand(TreeNode* layers_tree, char* path)
+/// @return OK (0) if everything passed, ERROR_MALLOC_FAILED (1) if malloc failed, -1 for everything else.
+ErrorCodes loadStateCommand(char* path, BmpLibrary* library, TreeNode* layers_tree)
 {
-  Layer** layers_to_print = calloc(layers_tree->next_id_, sizeof(Layer*));
-  if (layers_to_print == NULL)
+  PixelBuffer* file = NULL;
+  ErrorCodes result = mapFile(path, &file, 0, NULL);
+  if (result != OK)
   {
-    return ERROR_MALLOC_FAILED;
+    return result;
   }
-  int layers_count = getLayers(layers_tree, layers_to_print);
-
-  char* canvas = 
-    calloc(layers_tree->current_active_layer_->width_ * layers_tree->current_active_layer_->height_ * BYTE,
-    sizeof(char));
-    
-  if (canvas == NULL)
+  int width = layers_tree->layer_table_[ROOT_LAYER_ID]->width_;
+  int height = layers_tree->layer_table_[ROOT_LAYER_ID]->height_;
+  BmpLibrary* loaded_library = calloc(1, sizeof(BmpLibrary));
+  TreeNode loaded_tree;
+  memset(&loaded_tree, 0, sizeof(TreeNode));
+  result = loaded_library != NULL ? checkStateHeader(file, width, height) : ERROR_MALLOC_FAILED;
+  if (result == OK)
   {
-    free(layers_to_print);
-    free(canvas);
-    return ERROR_MALLOC_FAILED;
+    result = readStateBmps(file, loaded_library);
   }
-
-  for (int index = 0; 
-       index < layers_tree->current_active_layer_->width_ * layers_tree->current_active_layer_->height_ * BYTE; 
-       index += BYTE)
+  if (result == OK)
   {
-    canvas[index] = (unsigned char)255;
-    canvas[index + 1] = (unsigned char)255;
-    canvas[index + 2] = (unsigned char)255;
-    canvas[index + 3] = (unsigned char)255;
+    result = readStateLayers(file, loaded_library, &loaded_tree, width, height);
   }
-
-  for (int counter = 0; counter < layers_count; counter++)
+  releasePixelBuffer(file);
+  if (result != OK)
   {
-    blendLayer(layers_to_print[counter],canvas, layers_tree->current_active_layer_->width_);
+    freeLibrary(loaded_library);
+    freeLayerArena(&loaded_tree.arena_);
+    free(loaded_tree.layer_table_);
+    return result;
   }
 
-  FILE* file = fopen(path, "wb");
-  if (file == NULL)
-  {
-    free(layers_to_print);
-    free(canvas);
-    return ERROR_INVALID_FILE_PATH;
-  }
-  
-  BmpHeader* header = calloc(1, sizeof(BmpHeader));
-  if (header == NULL)
-  {
-    free(header);
-    free(layers_to_print);
-    free(canvas);
-    fclose(file);
-    return ERROR_MALLOC_FAILED;
-  }
-  fillBmpHeaderDefaultValues(header, 
-                             layers_tree->current_active_layer_->width_, 
-                             layers_tree->current_active_layer_->height_);
-  fwrite(header, sizeof(BmpHeader), 1, file);
+  BmpLibrary previous_library = *library;
+  *library = *loaded_library;
+  *loaded_library = previous_library;
+  freeLibrary(loaded_library);
 
-  int row_size = layers_tree->current_active_layer_->width_ * BYTE;
-  for (int row = layers_tree->current_active_layer_->height_ - 1; row >= 0; row--)
+  while (layers_tree->lru_head_ != NULL)
   {
-    fwrite(canvas + row * row_size, row_size, 1, file);
+    evictSnapshot(layers_tree, layers_tree->lru_head_);
   }
-
-  free(header);
-  free(layers_to_print);
-  free(canvas);
-  fclose(file);
-  printf("Successfully saved image to %s\n", path);
+  freeLayerArena(&layers_tree->arena_);
+  free(layers_tree->layer_table_);
+  layers_tree->arena_ = loaded_tree.arena_;
+  layers_tree->layer_table_ = loaded_tree.layer_table_;
+  layers_tree->table_capacity_ = loaded_tree.table_capacity_;
+  layers_tree->next_id_ = loaded_tree.next_id_;
+  layers_tree->layers_count_ = loaded_tree.layers_count_;
+  layers_tree->branches_since_prune_ = 0;
+  layers_tree->current_active_layer_ = loaded_tree.current_active_layer_;
+  free(layers_tree->frame_);
+  layers_tree->frame_ = NULL;
+  layers_tree->frame_layer_ = NULL;
+  printf("Successfully loaded state from %s\n", path);
   return OK;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 /// @brief Executes the command from user input.
 /// @param words User input split into words.
+/// @param command The command, already looked up in the command table.
 /// @param library The bmp library of the program.
 /// @param layers_tree The layer tree of the program.
 /// @return OK (0) if everything passes, ERROR_MALLOC_FAILED (1) if malloc fails, (-1, 2, 3) for other types of errors.
-ErrorCodes executeCommand(char** words, BmpLibrary* library, TreeNode* layers_tree)
+ErrorCodes executeCommand(char** words, CommandCodes command, BmpLibrary* library, TreeNode* layers_tree)
 {
-  char* command = words[0];
-  if (strcmp(COMMAND_HELP, command) == 0)
-  {
-    printCommandList();
-    return OK;
-  }
-  else if (strcmp(COMMAND_LOAD, command) == 0)
-  {
-    return loadBmp(words[1], library);
-  }
-  else if (strcmp(COMMAND_BMPS, command) == 0)
-  {
-    printBmps(library);
-    return OK;
-  }
-  else if (strcmp(COMMAND_CROP, command) == 0)
-  {
-    return cropCommand(words, library);
-  }
-  else if (strcmp(COMMAND_PRINT, command) == 0)
-  {
-    return printCommand(layers_tree);
-  }
-  else if (strcmp(COMMAND_TREE, command) == 0)
-  {
-    return treeCommand(layers_tree);
-  }
-  else if (strcmp(COMMAND_SWITCH, command) == 0)
+  switch (command)
   {
-    return switchCommand(layers_tree, words[1]);
+    case HELP:
+      printCommandList();
+      return OK;
+    case LOAD:
+      return loadBmp(words[1], library);
+    case BMPS:
+      printBmps(library);
+      return OK;
+    case CROP:
+      return cropCommand(words, library);
+    case PRINT:
+      return printCommand(layers_tree);
+    case TREE:
+      return treeCommand(layers_tree);
+    case SWITCH:
+      return switchCommand(layers_tree, words[1]);
+    case PLACE:
+      return placeCommand(library, words, layers_tree);
+    case UNDO:
+      return undoCommand(layers_tree);
+    case UNLOAD:
+      return unloadCommand(words[1], library);
+    case LOADALL:
+      return loadAllCommand(words[1], library, layers_tree->thread_pool_);
+    case FLATTEN:
+      return flattenCommand(words[1], library, layers_tree);
+    case SAVESTATE:
+      return saveStateCommand(words[1], library, layers_tree);
+    case LOADSTATE:
+      return loadStateCommand(words[1], library, layers_tree);
+    case SAVE:
+      return saveCommand(library, layers_tree, words[1]);
+    case EXPORT:
+      return exportCommand(words, library, layers_tree);
+    case PRUNE:
+      return pruneLayers(layers_tree);
+    default:
+      return ERROR_COMMAND_UNKNOWN;
   }
-  else if (strcmp(COMMAND_PLACE, command) == 0)
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Validates the command and dispatches it to be executed.
+/// @param words User input split into words.
+/// @param argc Count of arguments the user put in.
+/// @param library The bmp library of the program.
+/// @param layers_tree The layer tree of the program.
+/// @param table The command table.
+/// @return OK (0) if everything passes, ERROR_MALLOC_FAILED (1) if malloc fails, (-1, 2, 3) for other types of errors. 
+ErrorCodes dispatchCommand(char** words, int argc, BmpLibrary* library, TreeNode* layers_tree, CommandTable* table)
+{
+  CommandCodes command = findCommand(table, words[0]);
+  if (command == CMD_COUNT)
   {
-    return placeCommand(library, words, layers_tree);
+    return ERROR_COMMAND_UNKNOWN;
   }
-  else if (strcmp(COMMAND_UNDO, command) == 0)
+  if (argc != table->commands_[command].argc_)
   {
-    return undoCommand(layers_tree);
+    return ERROR_ARGUMENTS_AMOUNT;
   }
-  else
+  // compositing is counted as its own stage, so it is taken out of the time of the command that caused it
+  double blend_seconds = layers_tree->stats_.seconds_[STAGE_BLEND];
+  double start = getSeconds();
+  ErrorCodes result = table->commands_[command].reads_pixels_ ? checkMappedFiles(library) : OK;
+  if (result != OK)
   {
-    return saveCommand(layers_tree, words[1]);
+    return result;
   }
+  result = executeCommand(words, command, library, layers_tree);
+  double seconds = getSeconds() - start - (layers_tree->stats_.seconds_[STAGE_BLEND] - blend_seconds);
+  addStageTime(layers_tree, table->commands_[command].stage_, seconds, 0);
+  return result;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-/// @brief Validates the command and dispatches it to be executed.
-/// @param words User input split into words.
-/// @param argc Count of arguments the user put in.
-/// @param library The bmp library of the program.
+/// @brief Gets the current time.
+/// @return Seconds of a monotonic clock.
+double getSeconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / NANOSECONDS;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Adds one call of a stage to the statistics.
 /// @param layers_tree The layer tree of the program.
-/// @return OK (0) if everything passes, ERROR_MALLOC_FAILED (1) if malloc fails, (-1, 2, 3) for other types of errors. 
-ErrorCodes dispatchCommand(char** words, int argc, BmpLibrary* library, TreeNode* layers_tree)
+/// @param stage The stage.
+/// @param seconds Time the call took.
+/// @param pixels Canvas pixels the call composited.
+void addStageTime(TreeNode* layers_tree, StageCodes stage, double seconds, uint64_t pixels)
+{
+  layers_tree->stats_.calls_[stage]++;
+  layers_tree->stats_.seconds_[stage] += seconds;
+  layers_tree->stats_.pixels_[stage] += pixels;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Writes the time spent in each stage as CSV to the file given with --stats. Blend is the compositing of
+///        print, save and flatten, the other stages are the commands without it.
+/// @param layers_tree The layer tree of the program.
+void writeStageStats(TreeNode* layers_tree)
 {
-  char* command = words[0];
-  Command commands[CMD_COUNT];
-  initializeCommands(commands);
-  for (int index = 0; index < CMD_COUNT; index++)
+  static const char* stage_names[STAGE_COUNT] = {"load", "crop", "place", "blend", "print", "save", "other"};
+  if (layers_tree->stats_path_ == NULL)
   {
-    if (strcmp(command, commands[index].name_) == 0)
-    {
-      if (argc != commands[index].argc_)
-      {
-        return ERROR_ARGUMENTS_AMOUNT;
-      }
-      return executeCommand(words, library, layers_tree);
-    }
+    return;
+  }
+  FILE* file = fopen(layers_tree->stats_path_, "w");
+  if (file == NULL)
+  {
+    printErrorMessage(ERROR_CANNOT_OPEN_FILE);
+    return;
   }
-  return ERROR_COMMAND_UNKNOWN;
+  fprintf(file, "stage,calls,seconds,pixels\n");
+  for (int stage = 0; stage < STAGE_COUNT; stage++)
+  {
+    fprintf(file, "%s,%d,%.6f,%llu\n", stage_names[stage], layers_tree->stats_.calls_[stage],
+            layers_tree->stats_.seconds_[stage], (unsigned long long)layers_tree->stats_.pixels_[stage]);
+  }
+  fclose(file);
 }
 
 /// @brief Starts the command validation and execution process.
 /// @param input User input.
 /// @param library The bmp library of the program. 
 /// @param layers_tree The layer tree of the program.
+/// @param table The command table.
 /// @return OK (0) if everything passes, ERROR_MALLOC_FAILED (1) if malloc fails
-int isValid(char* input, BmpLibrary* library, TreeNode* layers_tree)
+int isValid(char* input, BmpLibrary* library, TreeNode* layers_tree, CommandTable* table)
 {
   removeNewLine(input);
   char** words = splitString(input);
@@ -1606,7 +5179,7 @@ int isValid(char* input, BmpLibrary* library, TreeNode* layers_tree)
       return printErrorMessage(ERROR_MALLOC_FAILED);
   }
   int argc = countArguments(words);
-  ErrorCodes result = dispatchCommand(words, argc, library, layers_tree);
+  ErrorCodes result = dispatchCommand(words, argc, library, layers_tree, table);
   free(words);
   
   if (result == OK || result == ERROR_MALLOC_FAILED)
@@ -1619,19 +5192,117 @@ int isValid(char* input, BmpLibrary* library, TreeNode* layers_tree)
   }
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Runs the commands of a script without prompts. The line and word buffers are reused for every line, empty
+///        lines and lines starting with '#' are skipped. The script ends with quit or at the end of the file.
+/// @param script The opened script.
+/// @param library The bmp library of the program.
+/// @param layers_tree The layer tree of the program.
+/// @param table The command table.
+/// @return 0 if every command passed, EXIT_COMMANDS_FAILED if some failed, 1 if memory allocation failed.
+int runScript(FILE* script, BmpLibrary* library, TreeNode* layers_tree, CommandTable* table)
+{
+  char* line = NULL;
+  size_t line_capacity = 0;
+  char** words = NULL;
+  size_t words_capacity = 0;
+  int commands_count = 0;
+  int failed_count = 0;
+  ssize_t length;
+  while ((length = getline(&line, &line_capacity, script)) != -1)
+  {
+    while (length > 0 && isspace((unsigned char)line[length - 1]))
+    {
+      line[--length] = '\0';
+    }
+    char* command = line;
+    while (*command == ' ' || *command == '\t')
+    {
+      command++;
+    }
+    if (*command == '\0' || *command == SCRIPT_COMMENT)
+    {
+      continue;
+    }
+    if (strcmp(command, "quit") == 0)
+    {
+      break;
+    }
+    size_t words_needed = length / 2 + 2;
+    if (words_needed > words_capacity)
+    {
+      char** temporary = realloc(words, words_needed * sizeof(char*));
+      if (temporary == NULL)
+      {
+        free(words);
+        free(line);
+        return printErrorMessage(ERROR_MALLOC_FAILED);
+      }
+      words = temporary;
+      words_capacity = words_needed;
+    }
+    int argc = 0;
+    for (char* word = strtok(command, " "); word != NULL; word = strtok(NULL, " "))
+    {
+      words[argc++] = word;
+    }
+    words[argc] = NULL;
+
+    commands_count++;
+    ErrorCodes result = dispatchCommand(words, argc, library, layers_tree, table);
+    if (result == ERROR_MALLOC_FAILED)
+    {
+      free(words);
+      free(line);
+      return printErrorMessage(result);
+    }
+    if (result != OK)
+    {
+      failed_count++;
+      printErrorMessage(result);
+    }
+  }
+  free(words);
+  free(line);
+  printf("Ran %d commands, %d failed\n", commands_count, failed_count);
+  return failed_count > 0 ? EXIT_COMMANDS_FAILED : 0;
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 /// @brief Starts the command loop.
 /// @param library The bmp library of the program.
 /// @param width Width of the canvas.
 /// @param height Height of the canvas.
+/// @param options Settings given on the command line.
 /// @return OK (0) if everything passes, ERROR_MALLOC_FAILED (1) if malloc fails, (-1, 2, 3) for other types of errors.
-int commandLoop(BmpLibrary* library, int width, int height)
+int commandLoop(BmpLibrary* library, int width, int height, ProgramOptions* options)
 {
-  TreeNode* layers_tree = createRootLayer(width, height);
+  TreeNode* layers_tree = createRootLayer(width, height, options);
   if (layers_tree == NULL)
   {
     return 1;
   }
+  CommandTable table;
+  initializeCommandTable(&table);
+  if (options->script_path_ != NULL)
+  {
+    int is_stdin = strcmp(options->script_path_, SCRIPT_STDIN) == 0;
+    FILE* script = is_stdin ? stdin : fopen(options->script_path_, "r");
+    if (script == NULL)
+    {
+      freeLayerTree(layers_tree);
+      printErrorMessage(ERROR_CANNOT_OPEN_FILE);
+      return EXIT_COMMANDS_FAILED;
+    }
+    int result = runScript(script, library, layers_tree, &table);
+    if (!is_stdin)
+    {
+      fclose(script);
+    }
+    writeStageStats(layers_tree);
+    freeLayerTree(layers_tree);
+    return result;
+  }
   while (1)
   {
     printf(" > ");
@@ -1643,9 +5314,8 @@ int commandLoop(BmpLibrary* library, int width, int height)
     if (isQuit(input))
     {
       free(input);
-      Layer* root = getRootLayer(layers_tree);
-      freeLayerTree(root);
-      free(layers_tree);
+      writeStageStats(layers_tree);
+      freeLayerTree(layers_tree);
       return 0;
     }
     if (isEmpty(input) || isWhiteSpace(input))
@@ -1653,7 +5323,7 @@ int commandLoop(BmpLibrary* library, int width, int height)
       free(input);
       continue;
     }
-    int result = isValid(input, library, layers_tree);
+    int result = isValid(input, library, layers_tree, &table);
     if (result == 1)
     {
       free(input);
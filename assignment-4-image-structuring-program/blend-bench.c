@@ -0,0 +1,344 @@
+//----------------------------------------------------------------------------------------------------------------------
+/// Microbenchmark of the blend kernels. Every blend mode is timed with the plain per-channel code the program used
+/// before the kernels existed (divisions by 255, abs() and the alpha * B + (1 - alpha) * A double expression) and
+/// with each instruction set of blend.c, normal mode also with the kernel for premultiplied pixels. The rows hold
+/// every pair of canvas and BMP channel values, so the first pass also checks that all kernels give the same bytes
+/// as the plain code. Normal mode is checked once for every BMP alpha value. The benchmark fails if a kernel differs
+/// from the plain code or if a kernel the program selects by default is slower than it.
+///
+/// Build: gcc -O2 -o blend-bench blend-bench.c blend.c
+/// Usage: ./blend-bench [REPETITIONS]
+///
+/// Author: 12326821
+//----------------------------------------------------------------------------------------------------------------------
+
+#define _DEFAULT_SOURCE
+
+#include "blend.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BYTE 4
+#define PIXEL_COUNT 65536
+#define DEFAULT_REPETITIONS 2000
+#define NANOSECONDS 1e9
+#define ALPHA_CHANNEL 3
+#define ALPHA_VALUES 256
+
+typedef struct _Bench_Mode_
+{
+  char mode_;
+  const char* name_;
+  BlendRowFunction reference_;
+  int is_premultiplied_;
+} BenchMode;
+
+// premultiplied pixels of the BMP row, the premultiplied kernel reads them instead of the BMP row it is given
+static uint16_t* premultiplied_bmp;
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Normal mode as the program computed it originally.
+static void referenceNormal(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int index = 0; index < pixel_count * BYTE; index += BYTE)
+  {
+    double alpha = bmp_row[index + ALPHA_CHANNEL] / 255.0;
+    for (int channel = 0; channel < 3; channel++)
+    {
+      unsigned char canvas = canvas_row[index + channel];
+      unsigned char bmp = bmp_row[index + channel];
+      canvas_row[index + channel] = (unsigned char)(alpha * bmp + (1.0 - alpha) * canvas);
+    }
+    canvas_row[index + 3] = 255;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Multiply mode as the program computed it originally.
+static void referenceMultiply(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int index = 0; index < pixel_count * BYTE; index += BYTE)
+  {
+    canvas_row[index] = (canvas_row[index] * bmp_row[index]) / 255;
+    canvas_row[index + 1] = (canvas_row[index + 1] * bmp_row[index + 1]) / 255;
+    canvas_row[index + 2] = (canvas_row[index + 2] * bmp_row[index + 2]) / 255;
+    canvas_row[index + 3] = 255;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Subtract mode as the program computed it originally.
+static void referenceSubtract(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int index = 0; index < pixel_count * BYTE; index += BYTE)
+  {
+    canvas_row[index] = (unsigned char)abs(canvas_row[index] - bmp_row[index]);
+    canvas_row[index + 1] = (unsigned char)abs(canvas_row[index + 1] - bmp_row[index + 1]);
+    canvas_row[index + 2] = (unsigned char)abs(canvas_row[index + 2] - bmp_row[index + 2]);
+    canvas_row[index + 3] = 255;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Screen mode written the same plain way.
+static void referenceScreen(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int index = 0; index < pixel_count * BYTE; index += BYTE)
+  {
+    for (int channel = 0; channel < 3; channel++)
+    {
+      canvas_row[index + channel] =
+        255 - ((255 - canvas_row[index + channel]) * (255 - bmp_row[index + channel])) / 255;
+    }
+    canvas_row[index + 3] = 255;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Overlay mode written the same plain way.
+static void referenceOverlay(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int index = 0; index < pixel_count * BYTE; index += BYTE)
+  {
+    for (int channel = 0; channel < 3; channel++)
+    {
+      int canvas = canvas_row[index + channel];
+      int bmp = bmp_row[index + channel];
+      canvas_row[index + channel] = canvas < 128 ? (2 * canvas * bmp) / 255
+                                                 : 255 - (2 * (255 - canvas) * (255 - bmp)) / 255;
+    }
+    canvas_row[index + 3] = 255;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Additive mode written the same plain way.
+static void referenceAdditive(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int index = 0; index < pixel_count * BYTE; index += BYTE)
+  {
+    for (int channel = 0; channel < 3; channel++)
+    {
+      int sum = canvas_row[index + channel] + bmp_row[index + channel];
+      canvas_row[index + channel] = sum > 255 ? 255 : sum;
+    }
+    canvas_row[index + 3] = 255;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Darken mode written the same plain way.
+static void referenceDarken(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int index = 0; index < pixel_count * BYTE; index += BYTE)
+  {
+    for (int channel = 0; channel < 3; channel++)
+    {
+      if (bmp_row[index + channel] < canvas_row[index + channel])
+      {
+        canvas_row[index + channel] = bmp_row[index + channel];
+      }
+    }
+    canvas_row[index + 3] = 255;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Lighten mode written the same plain way.
+static void referenceLighten(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int index = 0; index < pixel_count * BYTE; index += BYTE)
+  {
+    for (int channel = 0; channel < 3; channel++)
+    {
+      if (bmp_row[index + channel] > canvas_row[index + channel])
+      {
+        canvas_row[index + channel] = bmp_row[index + channel];
+      }
+    }
+    canvas_row[index + 3] = 255;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Runs the selected premultiplied kernel on premultiplied_bmp, so it can be timed and checked like the others.
+static void blendPremultiplied(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  (void)bmp_row;
+  getPremultipliedRowFunction()(canvas_row, premultiplied_bmp, pixel_count);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Gets the current time.
+/// @return Seconds of a monotonic clock.
+static double getSeconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / NANOSECONDS;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Times a kernel blending the BMP row onto the canvas row again and again and keeps the fastest repetition,
+///        so other processes on the machine do not decide which kernel wins. The canvas row is reset before every
+///        repetition, outside of the measured time, because normal mode would otherwise turn the canvas into the BMP
+///        and only measure the inputs that need the old rounding.
+/// @param kernel The kernel.
+/// @param canvas Canvas row.
+/// @param source Values the canvas row is reset to.
+/// @param bmp BMP row.
+/// @param repetitions Number of repetitions.
+/// @return Nanoseconds per pixel.
+static double timeKernel(BlendRowFunction kernel, unsigned char* canvas, const unsigned char* source,
+                         const unsigned char* bmp, int repetitions)
+{
+  double fastest = 0;
+  for (int repetition = 0; repetition < repetitions; repetition++)
+  {
+    memcpy(canvas, source, PIXEL_COUNT * BYTE);
+    double start = getSeconds();
+    kernel(canvas, bmp, PIXEL_COUNT);
+    double seconds = getSeconds() - start;
+    fastest = repetition == 0 || seconds < fastest ? seconds : fastest;
+  }
+  return fastest * NANOSECONDS / PIXEL_COUNT;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Checks that a kernel gives the same bytes as the plain code for every pair of canvas and BMP values. Normal
+///        mode is checked with every BMP alpha value in turn.
+/// @param mode The blend mode.
+/// @param kernel The kernel.
+/// @param source Canvas row.
+/// @param bmp BMP row, its alpha channel gets overwritten for normal mode.
+/// @param expected Scratch row for the plain code.
+/// @param canvas Scratch row for the kernel.
+/// @return 1 if all bytes matched, 0 if not.
+static int checkKernel(const BenchMode* mode, BlendRowFunction kernel, const unsigned char* source,
+                       unsigned char* bmp, unsigned char* expected, unsigned char* canvas)
+{
+  int alphas_count = mode->mode_ == BLEND_MODE_N ? ALPHA_VALUES : 1;
+  for (int alpha = 0; alpha < alphas_count; alpha++)
+  {
+    if (mode->mode_ == BLEND_MODE_N)
+    {
+      for (int pixel = 0; pixel < PIXEL_COUNT; pixel++)
+      {
+        bmp[pixel * BYTE + ALPHA_CHANNEL] = (unsigned char)alpha;
+      }
+    }
+    if (mode->is_premultiplied_)
+    {
+      premultiplyRow(premultiplied_bmp, bmp, PIXEL_COUNT);
+    }
+    memcpy(expected, source, PIXEL_COUNT * BYTE);
+    mode->reference_(expected, bmp, PIXEL_COUNT);
+    memcpy(canvas, source, PIXEL_COUNT * BYTE);
+    kernel(canvas, bmp, PIXEL_COUNT);
+    if (memcmp(canvas, expected, PIXEL_COUNT * BYTE) != 0)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Main function of the benchmark.
+/// @param argc Count of cmd line arguments.
+/// @param argv Holds the cmd line arguments.
+/// @return 0 if every kernel matched the plain code and the selected kernels were not slower than it, 1 if not.
+int main(int argc, char* argv[])
+{
+  const BenchMode modes[] = {
+    {BLEND_MODE_N, "normal", referenceNormal, 0},     {BLEND_MODE_N, "premult", referenceNormal, 1},
+    {BLEND_MODE_M, "multiply", referenceMultiply, 0}, {BLEND_MODE_S, "subtract", referenceSubtract, 0},
+    {BLEND_MODE_E, "screen", referenceScreen, 0},     {BLEND_MODE_O, "overlay", referenceOverlay, 0},
+    {BLEND_MODE_A, "additive", referenceAdditive, 0}, {BLEND_MODE_D, "darken", referenceDarken, 0},
+    {BLEND_MODE_L, "lighten", referenceLighten, 0}};
+  const char* limits[] = {"scalar", "sse2", NULL};
+  int repetitions = argc > 1 ? atoi(argv[1]) : DEFAULT_REPETITIONS;
+  repetitions = repetitions > 0 ? repetitions : DEFAULT_REPETITIONS;
+
+  unsigned char* source = malloc(PIXEL_COUNT * BYTE);
+  unsigned char* bmp = malloc(PIXEL_COUNT * BYTE);
+  unsigned char* expected = malloc(PIXEL_COUNT * BYTE);
+  unsigned char* canvas = malloc(PIXEL_COUNT * BYTE);
+  unsigned char* checked_bmp = malloc(PIXEL_COUNT * BYTE);
+  premultiplied_bmp = malloc(PIXEL_COUNT * BYTE * sizeof(uint16_t));
+  if (source == NULL || bmp == NULL || expected == NULL || canvas == NULL || checked_bmp == NULL ||
+      premultiplied_bmp == NULL)
+  {
+    printf("[ERROR] Memory allocation failed!\n");
+    return 1;
+  }
+  // every channel sees all 65536 pairs of canvas and BMP values, in a different order
+  for (int pixel = 0; pixel < PIXEL_COUNT; pixel++)
+  {
+    for (int channel = 0; channel < BYTE; channel++)
+    {
+      int rotated = (pixel * (2 * channel + 1)) & (PIXEL_COUNT - 1);
+      source[pixel * BYTE + channel] = (unsigned char)rotated;
+      bmp[pixel * BYTE + channel] = (unsigned char)(rotated >> 8);
+    }
+  }
+
+  int mismatches = 0;
+  int slower = 0;
+  printf("%-10s %-10s %12s %10s\n", "mode", "kernel", "ns/pixel", "speedup");
+  for (size_t mode = 0; mode < sizeof(modes) / sizeof(modes[0]); mode++)
+  {
+    double reference_time = timeKernel(modes[mode].reference_, canvas, source, bmp, repetitions);
+    printf("%-10s %-10s %12.3f %10s\n", modes[mode].name_, "plain", reference_time, "1.00x");
+
+    const char* previous_name = NULL;
+    double previous_speedup = 0;
+    for (int limit = 0; limit < 3; limit++)
+    {
+      if (limits[limit] != NULL)
+      {
+        setenv(BLEND_KERNELS_ENVIRONMENT, limits[limit], 1);
+      }
+      else
+      {
+        unsetenv(BLEND_KERNELS_ENVIRONMENT);
+      }
+      initializeBlendKernels();
+      // the best kernels may be the ones that were measured already
+      if (previous_name != NULL && strcmp(previous_name, getBlendKernelName()) == 0)
+      {
+        slower += limits[limit] == NULL && previous_speedup < 1.0;
+        continue;
+      }
+      previous_name = getBlendKernelName();
+      BlendRowFunction kernel = modes[mode].is_premultiplied_ ? blendPremultiplied :
+                                getBlendRowFunction(modes[mode].mode_);
+
+      memcpy(checked_bmp, bmp, PIXEL_COUNT * BYTE);
+      int matches = checkKernel(&modes[mode], kernel, source, checked_bmp, expected, canvas);
+      mismatches += !matches;
+      if (modes[mode].is_premultiplied_)
+      {
+        premultiplyRow(premultiplied_bmp, bmp, PIXEL_COUNT);
+      }
+      double kernel_time = timeKernel(kernel, canvas, source, bmp, repetitions);
+      previous_speedup = reference_time / kernel_time;
+      int is_slower = limits[limit] == NULL && previous_speedup < 1.0;
+      slower += is_slower;
+      printf("%-10s %-10s %12.3f %9.2fx%s%s\n", modes[mode].name_, previous_name, kernel_time, previous_speedup,
+             matches ? "" : "  MISMATCH", is_slower ? "  SLOWER" : "");
+    }
+  }
+
+  free(premultiplied_bmp);
+  free(checked_bmp);
+  free(canvas);
+  free(expected);
+  free(bmp);
+  free(source);
+  return mismatches > 0 || slower > 0;
+}
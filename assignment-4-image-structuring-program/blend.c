@@ -0,0 +1,959 @@
+//----------------------------------------------------------------------------------------------------------------------
+/// Contains the row kernels that blend BMP pixels onto the canvas.
+///
+/// All kernels use integer math. The normal mode used to be computed as alpha * B + (1 - alpha) * A in double
+/// precision and truncated, which rounds down by one for some inputs where the exact result is a whole number. Those
+/// inputs are detected (the sum is an exact multiple of 255) and recomputed the old way, so every kernel gives the same
+/// bytes as the original implementation. The vector kernels recompute a group with such a channel in double precision
+/// vectors and take only the flagged lanes from it. The AVX2 kernels clear the upper register halves before they hand
+/// the rest of a row to SSE2 code, which would pay for the transition on every instruction otherwise.
+///
+/// Author: 12326821
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "blend.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BLEND_HAS_X86
+#include <immintrin.h>
+#endif
+
+#define BYTE 4
+#define ALPHA_CHANNEL 3
+#define OPAQUE 255
+#define HALF 128
+#define SSE2_PIXELS 4
+#define AVX2_PIXELS 8
+#define BLEND_MODES_COUNT 8
+
+typedef struct _Blend_Kernels_
+{
+  const char* name_;
+  BlendRowFunction rows_[BLEND_MODES_COUNT];
+  PremultipliedRowFunction premultiplied_;
+} BlendKernels;
+
+// order of the kernels in BlendKernels.rows_
+static const char blend_modes[BLEND_MODES_COUNT] = {BLEND_MODE_N, BLEND_MODE_M, BLEND_MODE_S, BLEND_MODE_E,
+                                                    BLEND_MODE_O, BLEND_MODE_A, BLEND_MODE_D, BLEND_MODE_L};
+
+static BlendKernels selected_kernels;
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Divides by 255 and rounds down, exact for every value up to 255 * 255.
+/// @param value Value to divide.
+/// @return value / 255
+static unsigned divideBy255(unsigned value)
+{
+  return (value + 1 + (value >> 8)) >> 8;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Blends one channel in normal mode as the program originally computed it. It is only called for the rare
+///        inputs that need the old rounding, so blendNormalChannel() stays small enough to be inlined.
+/// @param alpha Alpha of the BMP pixel.
+/// @param canvas Canvas channel value.
+/// @param bmp BMP channel value.
+/// @return The blended channel value.
+__attribute__((noinline))
+static unsigned char blendNormalChannelDouble(unsigned alpha, unsigned canvas, unsigned bmp)
+{
+  double alpha_double = alpha / 255.0;
+  return (unsigned char)(alpha_double * bmp + (1.0 - alpha_double) * canvas);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Blends one channel in normal mode.
+/// @param alpha Alpha of the BMP pixel.
+/// @param canvas Canvas channel value.
+/// @param bmp BMP channel value.
+/// @return The blended channel value.
+static inline unsigned char blendNormalChannel(unsigned alpha, unsigned canvas, unsigned bmp)
+{
+  unsigned value = alpha * bmp + (OPAQUE - alpha) * canvas;
+  unsigned result = divideBy255(value);
+  if (result * OPAQUE == value && alpha != 0 && alpha != OPAQUE)
+  {
+    return blendNormalChannelDouble(alpha, canvas, bmp);
+  }
+  return (unsigned char)result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Scalar normal mode kernel, see BlendRowFunction.
+static void blendNormalScalar(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int pixel = 0; pixel < pixel_count; pixel++)
+  {
+    unsigned char* canvas = canvas_row + pixel * BYTE;
+    const unsigned char* bmp = bmp_row + pixel * BYTE;
+    unsigned alpha = bmp[ALPHA_CHANNEL];
+    canvas[0] = blendNormalChannel(alpha, canvas[0], bmp[0]);
+    canvas[1] = blendNormalChannel(alpha, canvas[1], bmp[1]);
+    canvas[2] = blendNormalChannel(alpha, canvas[2], bmp[2]);
+    canvas[ALPHA_CHANNEL] = OPAQUE;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Scalar normal mode kernel for premultiplied pixels, see PremultipliedRowFunction. The rare channels that
+///        need the old rounding get the alpha and BMP value back from the premultiplied value.
+static void blendPremultipliedScalar(unsigned char* canvas_row, const uint16_t* bmp_row, int pixel_count)
+{
+  for (int pixel = 0; pixel < pixel_count; pixel++)
+  {
+    unsigned char* canvas = canvas_row + pixel * BYTE;
+    const uint16_t* bmp = bmp_row + pixel * BYTE;
+    unsigned inverse_alpha = bmp[ALPHA_CHANNEL];
+    for (int channel = 0; channel < ALPHA_CHANNEL; channel++)
+    {
+      unsigned value = bmp[channel] + inverse_alpha * canvas[channel];
+      unsigned result = divideBy255(value);
+      if (result * OPAQUE == value && inverse_alpha != 0 && inverse_alpha != OPAQUE)
+      {
+        unsigned alpha = OPAQUE - inverse_alpha;
+        result = blendNormalChannel(alpha, canvas[channel], bmp[channel] / alpha);
+      }
+      canvas[channel] = (unsigned char)result;
+    }
+    canvas[ALPHA_CHANNEL] = OPAQUE;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Scalar multiply mode kernel, see BlendRowFunction.
+static void blendMultiplyScalar(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int pixel = 0; pixel < pixel_count; pixel++)
+  {
+    unsigned char* canvas = canvas_row + pixel * BYTE;
+    const unsigned char* bmp = bmp_row + pixel * BYTE;
+    canvas[0] = (unsigned char)divideBy255(canvas[0] * bmp[0]);
+    canvas[1] = (unsigned char)divideBy255(canvas[1] * bmp[1]);
+    canvas[2] = (unsigned char)divideBy255(canvas[2] * bmp[2]);
+    canvas[ALPHA_CHANNEL] = OPAQUE;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Scalar subtract mode kernel, see BlendRowFunction.
+static void blendSubtractScalar(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int pixel = 0; pixel < pixel_count; pixel++)
+  {
+    unsigned char* canvas = canvas_row + pixel * BYTE;
+    const unsigned char* bmp = bmp_row + pixel * BYTE;
+    for (int channel = 0; channel < ALPHA_CHANNEL; channel++)
+    {
+      canvas[channel] = canvas[channel] > bmp[channel] ? canvas[channel] - bmp[channel]
+                                                       : bmp[channel] - canvas[channel];
+    }
+    canvas[ALPHA_CHANNEL] = OPAQUE;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Scalar screen mode kernel, multiplies the inverted colors and inverts the result, see BlendRowFunction.
+static void blendScreenScalar(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int pixel = 0; pixel < pixel_count; pixel++)
+  {
+    unsigned char* canvas = canvas_row + pixel * BYTE;
+    const unsigned char* bmp = bmp_row + pixel * BYTE;
+    for (int channel = 0; channel < ALPHA_CHANNEL; channel++)
+    {
+      canvas[channel] = (unsigned char)(OPAQUE - divideBy255((OPAQUE - canvas[channel]) * (OPAQUE - bmp[channel])));
+    }
+    canvas[ALPHA_CHANNEL] = OPAQUE;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Blends one channel in overlay mode. Dark canvas values are multiplied and light ones are screened, both
+///        with twice the weight, so the products stay within 255 * 255 and divideBy255() is exact.
+/// @param canvas Canvas channel value.
+/// @param bmp BMP channel value.
+/// @return The blended channel value.
+static unsigned char blendOverlayChannel(unsigned canvas, unsigned bmp)
+{
+  if (canvas < HALF)
+  {
+    return (unsigned char)divideBy255(2 * canvas * bmp);
+  }
+  return (unsigned char)(OPAQUE - divideBy255(2 * (OPAQUE - canvas) * (OPAQUE - bmp)));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Scalar overlay mode kernel, see BlendRowFunction.
+static void blendOverlayScalar(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int pixel = 0; pixel < pixel_count; pixel++)
+  {
+    unsigned char* canvas = canvas_row + pixel * BYTE;
+    const unsigned char* bmp = bmp_row + pixel * BYTE;
+    for (int channel = 0; channel < ALPHA_CHANNEL; channel++)
+    {
+      canvas[channel] = blendOverlayChannel(canvas[channel], bmp[channel]);
+    }
+    canvas[ALPHA_CHANNEL] = OPAQUE;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Scalar additive mode kernel, the sum saturates at 255, see BlendRowFunction.
+static void blendAdditiveScalar(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int pixel = 0; pixel < pixel_count; pixel++)
+  {
+    unsigned char* canvas = canvas_row + pixel * BYTE;
+    const unsigned char* bmp = bmp_row + pixel * BYTE;
+    for (int channel = 0; channel < ALPHA_CHANNEL; channel++)
+    {
+      unsigned sum = canvas[channel] + bmp[channel];
+      canvas[channel] = (unsigned char)(sum < OPAQUE ? sum : OPAQUE);
+    }
+    canvas[ALPHA_CHANNEL] = OPAQUE;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Scalar darken mode kernel, keeps the smaller value of every channel, see BlendRowFunction.
+static void blendDarkenScalar(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int pixel = 0; pixel < pixel_count; pixel++)
+  {
+    unsigned char* canvas = canvas_row + pixel * BYTE;
+    const unsigned char* bmp = bmp_row + pixel * BYTE;
+    for (int channel = 0; channel < ALPHA_CHANNEL; channel++)
+    {
+      canvas[channel] = canvas[channel] < bmp[channel] ? canvas[channel] : bmp[channel];
+    }
+    canvas[ALPHA_CHANNEL] = OPAQUE;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Scalar lighten mode kernel, keeps the larger value of every channel, see BlendRowFunction.
+static void blendLightenScalar(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int pixel = 0; pixel < pixel_count; pixel++)
+  {
+    unsigned char* canvas = canvas_row + pixel * BYTE;
+    const unsigned char* bmp = bmp_row + pixel * BYTE;
+    for (int channel = 0; channel < ALPHA_CHANNEL; channel++)
+    {
+      canvas[channel] = canvas[channel] > bmp[channel] ? canvas[channel] : bmp[channel];
+    }
+    canvas[ALPHA_CHANNEL] = OPAQUE;
+  }
+}
+
+#ifdef BLEND_HAS_X86
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Normal mode for two channels as the program originally computed it, in double precision and truncated.
+/// @param canvas Canvas channel values.
+/// @param bmp BMP channel values.
+/// @param alpha Alpha of the BMP pixel divided by 255.
+/// @return The blended values in the two lower 32 bit lanes.
+__attribute__((target("sse2")))
+static __m128i blendNormalDoubleSse2(__m128d canvas, __m128d bmp, __m128d alpha)
+{
+  __m128d inverse_alpha = _mm_sub_pd(_mm_set1_pd(1.0), alpha);
+  return _mm_cvttpd_epi32(_mm_add_pd(_mm_mul_pd(alpha, bmp), _mm_mul_pd(inverse_alpha, canvas)));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Normal mode for two pixels widened to 16 bit lanes as the program originally computed it. The vector
+///        kernels blend the lanes they flag for the old rounding from this, so a group with a flagged channel costs a
+///        few more instructions instead of a scalar pass over all its channels.
+/// @param canvas Canvas pixels, one channel per lane.
+/// @param bmp BMP pixels, one channel per lane.
+/// @param is_premultiplied 1 if the BMP pixels are premultiplied, their value is divided by the alpha again.
+/// @return The blended pixels, still widened.
+__attribute__((target("sse2")))
+static __m128i blendNormalExactSse2(__m128i canvas, __m128i bmp, int is_premultiplied)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128d max = _mm_set1_pd(OPAQUE);
+  const __m128d one = _mm_set1_pd(1.0);
+  __m128i pixels[2];
+  for (int pixel = 0; pixel < 2; pixel++)
+  {
+    __m128i canvas_pixel = pixel == 0 ? _mm_unpacklo_epi16(canvas, zero) : _mm_unpackhi_epi16(canvas, zero);
+    __m128i bmp_pixel = pixel == 0 ? _mm_unpacklo_epi16(bmp, zero) : _mm_unpackhi_epi16(bmp, zero);
+    __m128d bmp_low = _mm_cvtepi32_pd(bmp_pixel);
+    __m128d bmp_high = _mm_cvtepi32_pd(_mm_shuffle_epi32(bmp_pixel, 0xEE));
+    __m128d alpha = _mm_unpackhi_pd(bmp_high, bmp_high);
+    if (is_premultiplied)
+    {
+      alpha = _mm_sub_pd(max, alpha);
+      bmp_low = _mm_div_pd(bmp_low, _mm_max_pd(alpha, one));
+      bmp_high = _mm_div_pd(bmp_high, _mm_max_pd(alpha, one));
+    }
+    alpha = _mm_div_pd(alpha, max);
+    __m128i low = blendNormalDoubleSse2(_mm_cvtepi32_pd(canvas_pixel), bmp_low, alpha);
+    __m128i high = blendNormalDoubleSse2(_mm_cvtepi32_pd(_mm_shuffle_epi32(canvas_pixel, 0xEE)), bmp_high, alpha);
+    pixels[pixel] = _mm_unpacklo_epi64(low, high);
+  }
+  return _mm_packs_epi32(pixels[0], pixels[1]);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Normal mode for two pixels widened to 16 bit lanes.
+/// @param canvas Canvas pixels, one channel per lane.
+/// @param bmp BMP pixels, one channel per lane.
+/// @return The blended pixels, still widened. Colour channels that hit an exact multiple of 255 with partial alpha
+///         are taken from blendNormalExactSse2().
+__attribute__((target("sse2"), always_inline))
+static inline __m128i blendNormalWideSse2(__m128i canvas, __m128i bmp)
+{
+  const __m128i max = _mm_set1_epi16(OPAQUE);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i colour_lanes = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+  __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(bmp, 0xFF), 0xFF);
+  __m128i value = _mm_add_epi16(_mm_mullo_epi16(alpha, bmp), _mm_mullo_epi16(_mm_sub_epi16(max, alpha), canvas));
+  __m128i result = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(value, one), _mm_srli_epi16(value, 8)), 8);
+  __m128i exact = _mm_cmpeq_epi16(value, _mm_sub_epi16(_mm_slli_epi16(result, 8), result));
+  __m128i partial = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi16(alpha, zero), _mm_cmpeq_epi16(alpha, max)),
+                                     colour_lanes);
+  __m128i flagged = _mm_and_si128(exact, partial);
+  if (_mm_movemask_epi8(flagged) != 0)
+  {
+    __m128i original = blendNormalExactSse2(canvas, bmp, 0);
+    result = _mm_or_si128(_mm_and_si128(flagged, original), _mm_andnot_si128(flagged, result));
+  }
+  return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief SSE2 normal mode kernel, see BlendRowFunction.
+__attribute__((target("sse2")))
+static void blendNormalSse2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + SSE2_PIXELS <= pixel_count; pixel += SSE2_PIXELS)
+  {
+    __m128i canvas = _mm_loadu_si128((const __m128i*)(canvas_row + pixel * BYTE));
+    __m128i bmp = _mm_loadu_si128((const __m128i*)(bmp_row + pixel * BYTE));
+    __m128i low = blendNormalWideSse2(_mm_unpacklo_epi8(canvas, zero), _mm_unpacklo_epi8(bmp, zero));
+    __m128i high = blendNormalWideSse2(_mm_unpackhi_epi8(canvas, zero), _mm_unpackhi_epi8(bmp, zero));
+    __m128i result = _mm_or_si128(_mm_packus_epi16(low, high), opaque);
+    _mm_storeu_si128((__m128i*)(canvas_row + pixel * BYTE), result);
+  }
+  blendNormalScalar(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Normal mode for two premultiplied pixels.
+/// @param canvas Canvas pixels, one channel per lane.
+/// @param bmp Premultiplied pixels.
+/// @return The blended pixels, still widened. Colour channels that hit an exact multiple of 255 with partial alpha
+///         are taken from blendNormalExactSse2().
+__attribute__((target("sse2"), always_inline))
+static inline __m128i blendPremultipliedWideSse2(__m128i canvas, __m128i bmp)
+{
+  const __m128i max = _mm_set1_epi16(OPAQUE);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i colour_lanes = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+  __m128i inverse_alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(bmp, 0xFF), 0xFF);
+  __m128i value = _mm_add_epi16(bmp, _mm_mullo_epi16(inverse_alpha, canvas));
+  __m128i result = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(value, one), _mm_srli_epi16(value, 8)), 8);
+  __m128i exact = _mm_cmpeq_epi16(value, _mm_sub_epi16(_mm_slli_epi16(result, 8), result));
+  __m128i partial = _mm_andnot_si128(
+    _mm_or_si128(_mm_cmpeq_epi16(inverse_alpha, zero), _mm_cmpeq_epi16(inverse_alpha, max)), colour_lanes);
+  __m128i flagged = _mm_and_si128(exact, partial);
+  if (_mm_movemask_epi8(flagged) != 0)
+  {
+    __m128i original = blendNormalExactSse2(canvas, bmp, 1);
+    result = _mm_or_si128(_mm_and_si128(flagged, original), _mm_andnot_si128(flagged, result));
+  }
+  return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief SSE2 normal mode kernel for premultiplied pixels, see PremultipliedRowFunction.
+__attribute__((target("sse2")))
+static void blendPremultipliedSse2(unsigned char* canvas_row, const uint16_t* bmp_row, int pixel_count)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + SSE2_PIXELS <= pixel_count; pixel += SSE2_PIXELS)
+  {
+    __m128i canvas = _mm_loadu_si128((const __m128i*)(canvas_row + pixel * BYTE));
+    const uint16_t* bmp = bmp_row + pixel * BYTE;
+    __m128i low = blendPremultipliedWideSse2(_mm_unpacklo_epi8(canvas, zero), _mm_loadu_si128((const __m128i*)bmp));
+    __m128i high = blendPremultipliedWideSse2(_mm_unpackhi_epi8(canvas, zero),
+                                              _mm_loadu_si128((const __m128i*)(bmp + 2 * BYTE)));
+    __m128i result = _mm_or_si128(_mm_packus_epi16(low, high), opaque);
+    _mm_storeu_si128((__m128i*)(canvas_row + pixel * BYTE), result);
+  }
+  blendPremultipliedScalar(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief divideBy255() for 16 bit lanes.
+/// @param value Values up to 255 * 255.
+/// @return value / 255 in every lane.
+__attribute__((target("sse2")))
+static __m128i divideBy255Sse2(__m128i value)
+{
+  const __m128i one = _mm_set1_epi16(1);
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(value, one), _mm_srli_epi16(value, 8)), 8);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Multiplies four pixels channel by channel and divides by 255, including the alpha channel.
+/// @param canvas Four canvas pixels.
+/// @param bmp Four BMP pixels.
+/// @return The products.
+__attribute__((target("sse2")))
+static __m128i multiplyWideSse2(__m128i canvas, __m128i bmp)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i low = _mm_mullo_epi16(_mm_unpacklo_epi8(canvas, zero), _mm_unpacklo_epi8(bmp, zero));
+  __m128i high = _mm_mullo_epi16(_mm_unpackhi_epi8(canvas, zero), _mm_unpackhi_epi8(bmp, zero));
+  return _mm_packus_epi16(divideBy255Sse2(low), divideBy255Sse2(high));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Overlay mode for two pixels widened to 16 bit lanes. Both branches are computed and the canvas value picks
+///        one, the lanes of the other branch may overflow but are thrown away.
+/// @param canvas Two canvas pixels.
+/// @param bmp Two BMP pixels.
+/// @return The blended values in 16 bit lanes.
+__attribute__((target("sse2")))
+static __m128i overlayWideSse2(__m128i canvas, __m128i bmp)
+{
+  const __m128i opaque = _mm_set1_epi16(OPAQUE);
+  const __m128i below_half = _mm_set1_epi16(HALF - 1);
+  __m128i dark = divideBy255Sse2(_mm_slli_epi16(_mm_mullo_epi16(canvas, bmp), 1));
+  __m128i light = _mm_mullo_epi16(_mm_sub_epi16(opaque, canvas), _mm_sub_epi16(opaque, bmp));
+  light = _mm_sub_epi16(opaque, divideBy255Sse2(_mm_slli_epi16(light, 1)));
+  __m128i is_light = _mm_cmpgt_epi16(canvas, below_half);
+  return _mm_or_si128(_mm_and_si128(is_light, light), _mm_andnot_si128(is_light, dark));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief SSE2 multiply mode kernel, see BlendRowFunction.
+__attribute__((target("sse2")))
+static void blendMultiplySse2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + SSE2_PIXELS <= pixel_count; pixel += SSE2_PIXELS)
+  {
+    __m128i canvas = _mm_loadu_si128((const __m128i*)(canvas_row + pixel * BYTE));
+    __m128i bmp = _mm_loadu_si128((const __m128i*)(bmp_row + pixel * BYTE));
+    __m128i result = _mm_or_si128(multiplyWideSse2(canvas, bmp), opaque);
+    _mm_storeu_si128((__m128i*)(canvas_row + pixel * BYTE), result);
+  }
+  blendMultiplyScalar(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief SSE2 subtract mode kernel, see BlendRowFunction.
+__attribute__((target("sse2")))
+static void blendSubtractSse2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + SSE2_PIXELS <= pixel_count; pixel += SSE2_PIXELS)
+  {
+    __m128i canvas = _mm_loadu_si128((const __m128i*)(canvas_row + pixel * BYTE));
+    __m128i bmp = _mm_loadu_si128((const __m128i*)(bmp_row + pixel * BYTE));
+    __m128i difference = _mm_or_si128(_mm_subs_epu8(canvas, bmp), _mm_subs_epu8(bmp, canvas));
+    _mm_storeu_si128((__m128i*)(canvas_row + pixel * BYTE), _mm_or_si128(difference, opaque));
+  }
+  blendSubtractScalar(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief SSE2 screen mode kernel, see BlendRowFunction.
+__attribute__((target("sse2")))
+static void blendScreenSse2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m128i inverse = _mm_set1_epi32(0x00FFFFFF);
+  int pixel = 0;
+  for (; pixel + SSE2_PIXELS <= pixel_count; pixel += SSE2_PIXELS)
+  {
+    __m128i canvas = _mm_loadu_si128((const __m128i*)(canvas_row + pixel * BYTE));
+    __m128i bmp = _mm_loadu_si128((const __m128i*)(bmp_row + pixel * BYTE));
+    // the alpha channel of the inverted product is 255 again
+    __m128i product = multiplyWideSse2(_mm_andnot_si128(canvas, inverse), _mm_andnot_si128(bmp, inverse));
+    _mm_storeu_si128((__m128i*)(canvas_row + pixel * BYTE), _mm_xor_si128(product, _mm_set1_epi8(-1)));
+  }
+  blendScreenScalar(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief SSE2 overlay mode kernel, see BlendRowFunction.
+__attribute__((target("sse2")))
+static void blendOverlaySse2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + SSE2_PIXELS <= pixel_count; pixel += SSE2_PIXELS)
+  {
+    __m128i canvas = _mm_loadu_si128((const __m128i*)(canvas_row + pixel * BYTE));
+    __m128i bmp = _mm_loadu_si128((const __m128i*)(bmp_row + pixel * BYTE));
+    __m128i low = overlayWideSse2(_mm_unpacklo_epi8(canvas, zero), _mm_unpacklo_epi8(bmp, zero));
+    __m128i high = overlayWideSse2(_mm_unpackhi_epi8(canvas, zero), _mm_unpackhi_epi8(bmp, zero));
+    _mm_storeu_si128((__m128i*)(canvas_row + pixel * BYTE), _mm_or_si128(_mm_packus_epi16(low, high), opaque));
+  }
+  blendOverlayScalar(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief SSE2 additive mode kernel, see BlendRowFunction.
+__attribute__((target("sse2")))
+static void blendAdditiveSse2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + SSE2_PIXELS <= pixel_count; pixel += SSE2_PIXELS)
+  {
+    __m128i canvas = _mm_loadu_si128((const __m128i*)(canvas_row + pixel * BYTE));
+    __m128i bmp = _mm_loadu_si128((const __m128i*)(bmp_row + pixel * BYTE));
+    _mm_storeu_si128((__m128i*)(canvas_row + pixel * BYTE), _mm_or_si128(_mm_adds_epu8(canvas, bmp), opaque));
+  }
+  blendAdditiveScalar(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief SSE2 darken mode kernel, see BlendRowFunction.
+__attribute__((target("sse2")))
+static void blendDarkenSse2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + SSE2_PIXELS <= pixel_count; pixel += SSE2_PIXELS)
+  {
+    __m128i canvas = _mm_loadu_si128((const __m128i*)(canvas_row + pixel * BYTE));
+    __m128i bmp = _mm_loadu_si128((const __m128i*)(bmp_row + pixel * BYTE));
+    _mm_storeu_si128((__m128i*)(canvas_row + pixel * BYTE), _mm_or_si128(_mm_min_epu8(canvas, bmp), opaque));
+  }
+  blendDarkenScalar(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief SSE2 lighten mode kernel, see BlendRowFunction.
+__attribute__((target("sse2")))
+static void blendLightenSse2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + SSE2_PIXELS <= pixel_count; pixel += SSE2_PIXELS)
+  {
+    __m128i canvas = _mm_loadu_si128((const __m128i*)(canvas_row + pixel * BYTE));
+    __m128i bmp = _mm_loadu_si128((const __m128i*)(bmp_row + pixel * BYTE));
+    _mm_storeu_si128((__m128i*)(canvas_row + pixel * BYTE), _mm_or_si128(_mm_max_epu8(canvas, bmp), opaque));
+  }
+  blendLightenScalar(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 version of blendNormalDoubleSse2(), works on one pixel.
+/// @param canvas Canvas pixel.
+/// @param bmp BMP pixel.
+/// @param alpha Alpha of the BMP pixel divided by 255 in every lane.
+/// @return The blended channels in 32 bit lanes.
+__attribute__((target("avx2")))
+static __m128i blendNormalDoubleAvx2(__m256d canvas, __m256d bmp, __m256d alpha)
+{
+  __m256d inverse_alpha = _mm256_sub_pd(_mm256_set1_pd(1.0), alpha);
+  return _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_mul_pd(alpha, bmp), _mm256_mul_pd(inverse_alpha, canvas)));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 version of blendNormalExactSse2() for one 128 bit half.
+/// @param canvas Two canvas pixels, one channel per 16 bit lane.
+/// @param bmp Two BMP pixels, one channel per 16 bit lane.
+/// @param is_premultiplied 1 if the BMP pixels are premultiplied.
+/// @return The blended pixels, still widened.
+__attribute__((target("avx2")))
+static __m128i blendNormalExactHalfAvx2(__m128i canvas, __m128i bmp, int is_premultiplied)
+{
+  const __m256d max = _mm256_set1_pd(OPAQUE);
+  const __m256d one = _mm256_set1_pd(1.0);
+  __m256i canvas_pixels = _mm256_cvtepu16_epi32(canvas);
+  __m256i bmp_pixels = _mm256_cvtepu16_epi32(bmp);
+  __m128i pixels[2];
+  for (int pixel = 0; pixel < 2; pixel++)
+  {
+    __m256d canvas_pixel = _mm256_cvtepi32_pd(pixel == 0 ? _mm256_castsi256_si128(canvas_pixels) :
+                                                           _mm256_extracti128_si256(canvas_pixels, 1));
+    __m256d bmp_pixel = _mm256_cvtepi32_pd(pixel == 0 ? _mm256_castsi256_si128(bmp_pixels) :
+                                                        _mm256_extracti128_si256(bmp_pixels, 1));
+    __m256d alpha = _mm256_permute4x64_pd(bmp_pixel, 0xFF);
+    if (is_premultiplied)
+    {
+      alpha = _mm256_sub_pd(max, alpha);
+      bmp_pixel = _mm256_div_pd(bmp_pixel, _mm256_max_pd(alpha, one));
+    }
+    pixels[pixel] = blendNormalDoubleAvx2(canvas_pixel, bmp_pixel, _mm256_div_pd(alpha, max));
+  }
+  return _mm_packs_epi32(pixels[0], pixels[1]);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 version of blendNormalExactSse2(), works on four pixels.
+/// @param canvas Canvas pixels, one channel per lane.
+/// @param bmp BMP pixels, one channel per lane.
+/// @param is_premultiplied 1 if the BMP pixels are premultiplied.
+/// @return The blended pixels, still widened.
+__attribute__((target("avx2")))
+static __m256i blendNormalExactAvx2(__m256i canvas, __m256i bmp, int is_premultiplied)
+{
+  __m128i low = blendNormalExactHalfAvx2(_mm256_castsi256_si128(canvas), _mm256_castsi256_si128(bmp),
+                                         is_premultiplied);
+  __m128i high = blendNormalExactHalfAvx2(_mm256_extracti128_si256(canvas, 1), _mm256_extracti128_si256(bmp, 1),
+                                          is_premultiplied);
+  return _mm256_set_m128i(high, low);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 version of blendNormalWideSse2(), works on four pixels.
+__attribute__((target("avx2"), always_inline))
+static inline __m256i blendNormalWideAvx2(__m256i canvas, __m256i bmp)
+{
+  const __m256i max = _mm256_set1_epi16(OPAQUE);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi16(1);
+  const __m256i colour_lanes = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1);
+  __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(bmp, 0xFF), 0xFF);
+  __m256i value = _mm256_add_epi16(_mm256_mullo_epi16(alpha, bmp),
+                                   _mm256_mullo_epi16(_mm256_sub_epi16(max, alpha), canvas));
+  __m256i result = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(value, one), _mm256_srli_epi16(value, 8)), 8);
+  __m256i exact = _mm256_cmpeq_epi16(value, _mm256_sub_epi16(_mm256_slli_epi16(result, 8), result));
+  __m256i partial = _mm256_andnot_si256(
+    _mm256_or_si256(_mm256_cmpeq_epi16(alpha, zero), _mm256_cmpeq_epi16(alpha, max)), colour_lanes);
+  __m256i flagged = _mm256_and_si256(exact, partial);
+  if (_mm256_movemask_epi8(flagged) != 0)
+  {
+    result = _mm256_blendv_epi8(result, blendNormalExactAvx2(canvas, bmp, 0), flagged);
+  }
+  return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 normal mode kernel, see BlendRowFunction.
+__attribute__((target("avx2")))
+static void blendNormalAvx2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + AVX2_PIXELS <= pixel_count; pixel += AVX2_PIXELS)
+  {
+    __m256i canvas = _mm256_loadu_si256((const __m256i*)(canvas_row + pixel * BYTE));
+    __m256i bmp = _mm256_loadu_si256((const __m256i*)(bmp_row + pixel * BYTE));
+    __m256i low = blendNormalWideAvx2(_mm256_unpacklo_epi8(canvas, zero), _mm256_unpacklo_epi8(bmp, zero));
+    __m256i high = blendNormalWideAvx2(_mm256_unpackhi_epi8(canvas, zero), _mm256_unpackhi_epi8(bmp, zero));
+    __m256i result = _mm256_or_si256(_mm256_packus_epi16(low, high), opaque);
+    _mm256_storeu_si256((__m256i*)(canvas_row + pixel * BYTE), result);
+  }
+  _mm256_zeroupper();
+  blendNormalSse2(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 version of blendPremultipliedWideSse2(), works on four pixels.
+__attribute__((target("avx2"), always_inline))
+static inline __m256i blendPremultipliedWideAvx2(__m256i canvas, __m256i bmp)
+{
+  const __m256i max = _mm256_set1_epi16(OPAQUE);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi16(1);
+  const __m256i colour_lanes = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1);
+  __m256i inverse_alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(bmp, 0xFF), 0xFF);
+  __m256i value = _mm256_add_epi16(bmp, _mm256_mullo_epi16(inverse_alpha, canvas));
+  __m256i result = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(value, one), _mm256_srli_epi16(value, 8)), 8);
+  __m256i exact = _mm256_cmpeq_epi16(value, _mm256_sub_epi16(_mm256_slli_epi16(result, 8), result));
+  __m256i partial = _mm256_andnot_si256(
+    _mm256_or_si256(_mm256_cmpeq_epi16(inverse_alpha, zero), _mm256_cmpeq_epi16(inverse_alpha, max)), colour_lanes);
+  __m256i flagged = _mm256_and_si256(exact, partial);
+  if (_mm256_movemask_epi8(flagged) != 0)
+  {
+    result = _mm256_blendv_epi8(result, blendNormalExactAvx2(canvas, bmp, 1), flagged);
+  }
+  return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 normal mode kernel for premultiplied pixels, see PremultipliedRowFunction. The byte unpacks work per
+///        128 bit half, so the premultiplied pixels are regrouped to match: pixels 0, 1, 4, 5 and 2, 3, 6, 7.
+__attribute__((target("avx2")))
+static void blendPremultipliedAvx2(unsigned char* canvas_row, const uint16_t* bmp_row, int pixel_count)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + AVX2_PIXELS <= pixel_count; pixel += AVX2_PIXELS)
+  {
+    __m256i canvas = _mm256_loadu_si256((const __m256i*)(canvas_row + pixel * BYTE));
+    const uint16_t* bmp = bmp_row + pixel * BYTE;
+    __m256i first = _mm256_loadu_si256((const __m256i*)bmp);
+    __m256i second = _mm256_loadu_si256((const __m256i*)(bmp + SSE2_PIXELS * BYTE));
+    __m256i low = blendPremultipliedWideAvx2(_mm256_unpacklo_epi8(canvas, zero),
+                                             _mm256_permute2x128_si256(first, second, 0x20));
+    __m256i high = blendPremultipliedWideAvx2(_mm256_unpackhi_epi8(canvas, zero),
+                                              _mm256_permute2x128_si256(first, second, 0x31));
+    __m256i result = _mm256_or_si256(_mm256_packus_epi16(low, high), opaque);
+    _mm256_storeu_si256((__m256i*)(canvas_row + pixel * BYTE), result);
+  }
+  _mm256_zeroupper();
+  blendPremultipliedSse2(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 version of divideBy255Sse2().
+__attribute__((target("avx2")))
+static __m256i divideBy255Avx2(__m256i value)
+{
+  const __m256i one = _mm256_set1_epi16(1);
+  return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(value, one), _mm256_srli_epi16(value, 8)), 8);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 version of multiplyWideSse2(), works on eight pixels.
+__attribute__((target("avx2")))
+static __m256i multiplyWideAvx2(__m256i canvas, __m256i bmp)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i low = _mm256_mullo_epi16(_mm256_unpacklo_epi8(canvas, zero), _mm256_unpacklo_epi8(bmp, zero));
+  __m256i high = _mm256_mullo_epi16(_mm256_unpackhi_epi8(canvas, zero), _mm256_unpackhi_epi8(bmp, zero));
+  return _mm256_packus_epi16(divideBy255Avx2(low), divideBy255Avx2(high));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 version of overlayWideSse2(), works on four pixels.
+__attribute__((target("avx2")))
+static __m256i overlayWideAvx2(__m256i canvas, __m256i bmp)
+{
+  const __m256i opaque = _mm256_set1_epi16(OPAQUE);
+  const __m256i below_half = _mm256_set1_epi16(HALF - 1);
+  __m256i dark = divideBy255Avx2(_mm256_slli_epi16(_mm256_mullo_epi16(canvas, bmp), 1));
+  __m256i light = _mm256_mullo_epi16(_mm256_sub_epi16(opaque, canvas), _mm256_sub_epi16(opaque, bmp));
+  light = _mm256_sub_epi16(opaque, divideBy255Avx2(_mm256_slli_epi16(light, 1)));
+  return _mm256_blendv_epi8(dark, light, _mm256_cmpgt_epi16(canvas, below_half));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 multiply mode kernel, see BlendRowFunction.
+__attribute__((target("avx2")))
+static void blendMultiplyAvx2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + AVX2_PIXELS <= pixel_count; pixel += AVX2_PIXELS)
+  {
+    __m256i canvas = _mm256_loadu_si256((const __m256i*)(canvas_row + pixel * BYTE));
+    __m256i bmp = _mm256_loadu_si256((const __m256i*)(bmp_row + pixel * BYTE));
+    __m256i result = _mm256_or_si256(multiplyWideAvx2(canvas, bmp), opaque);
+    _mm256_storeu_si256((__m256i*)(canvas_row + pixel * BYTE), result);
+  }
+  _mm256_zeroupper();
+  blendMultiplySse2(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 subtract mode kernel, see BlendRowFunction.
+__attribute__((target("avx2")))
+static void blendSubtractAvx2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + AVX2_PIXELS <= pixel_count; pixel += AVX2_PIXELS)
+  {
+    __m256i canvas = _mm256_loadu_si256((const __m256i*)(canvas_row + pixel * BYTE));
+    __m256i bmp = _mm256_loadu_si256((const __m256i*)(bmp_row + pixel * BYTE));
+    __m256i difference = _mm256_or_si256(_mm256_subs_epu8(canvas, bmp), _mm256_subs_epu8(bmp, canvas));
+    _mm256_storeu_si256((__m256i*)(canvas_row + pixel * BYTE), _mm256_or_si256(difference, opaque));
+  }
+  _mm256_zeroupper();
+  blendSubtractSse2(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 screen mode kernel, see BlendRowFunction.
+__attribute__((target("avx2")))
+static void blendScreenAvx2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m256i inverse = _mm256_set1_epi32(0x00FFFFFF);
+  int pixel = 0;
+  for (; pixel + AVX2_PIXELS <= pixel_count; pixel += AVX2_PIXELS)
+  {
+    __m256i canvas = _mm256_loadu_si256((const __m256i*)(canvas_row + pixel * BYTE));
+    __m256i bmp = _mm256_loadu_si256((const __m256i*)(bmp_row + pixel * BYTE));
+    __m256i product = multiplyWideAvx2(_mm256_andnot_si256(canvas, inverse), _mm256_andnot_si256(bmp, inverse));
+    _mm256_storeu_si256((__m256i*)(canvas_row + pixel * BYTE), _mm256_xor_si256(product, _mm256_set1_epi8(-1)));
+  }
+  _mm256_zeroupper();
+  blendScreenSse2(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 overlay mode kernel, see BlendRowFunction.
+__attribute__((target("avx2")))
+static void blendOverlayAvx2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + AVX2_PIXELS <= pixel_count; pixel += AVX2_PIXELS)
+  {
+    __m256i canvas = _mm256_loadu_si256((const __m256i*)(canvas_row + pixel * BYTE));
+    __m256i bmp = _mm256_loadu_si256((const __m256i*)(bmp_row + pixel * BYTE));
+    __m256i low = overlayWideAvx2(_mm256_unpacklo_epi8(canvas, zero), _mm256_unpacklo_epi8(bmp, zero));
+    __m256i high = overlayWideAvx2(_mm256_unpackhi_epi8(canvas, zero), _mm256_unpackhi_epi8(bmp, zero));
+    __m256i result = _mm256_or_si256(_mm256_packus_epi16(low, high), opaque);
+    _mm256_storeu_si256((__m256i*)(canvas_row + pixel * BYTE), result);
+  }
+  _mm256_zeroupper();
+  blendOverlaySse2(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 additive mode kernel, see BlendRowFunction.
+__attribute__((target("avx2")))
+static void blendAdditiveAvx2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + AVX2_PIXELS <= pixel_count; pixel += AVX2_PIXELS)
+  {
+    __m256i canvas = _mm256_loadu_si256((const __m256i*)(canvas_row + pixel * BYTE));
+    __m256i bmp = _mm256_loadu_si256((const __m256i*)(bmp_row + pixel * BYTE));
+    __m256i result = _mm256_or_si256(_mm256_adds_epu8(canvas, bmp), opaque);
+    _mm256_storeu_si256((__m256i*)(canvas_row + pixel * BYTE), result);
+  }
+  _mm256_zeroupper();
+  blendAdditiveSse2(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 darken mode kernel, see BlendRowFunction.
+__attribute__((target("avx2")))
+static void blendDarkenAvx2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + AVX2_PIXELS <= pixel_count; pixel += AVX2_PIXELS)
+  {
+    __m256i canvas = _mm256_loadu_si256((const __m256i*)(canvas_row + pixel * BYTE));
+    __m256i bmp = _mm256_loadu_si256((const __m256i*)(bmp_row + pixel * BYTE));
+    __m256i result = _mm256_or_si256(_mm256_min_epu8(canvas, bmp), opaque);
+    _mm256_storeu_si256((__m256i*)(canvas_row + pixel * BYTE), result);
+  }
+  _mm256_zeroupper();
+  blendDarkenSse2(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief AVX2 lighten mode kernel, see BlendRowFunction.
+__attribute__((target("avx2")))
+static void blendLightenAvx2(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count)
+{
+  const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+  int pixel = 0;
+  for (; pixel + AVX2_PIXELS <= pixel_count; pixel += AVX2_PIXELS)
+  {
+    __m256i canvas = _mm256_loadu_si256((const __m256i*)(canvas_row + pixel * BYTE));
+    __m256i bmp = _mm256_loadu_si256((const __m256i*)(bmp_row + pixel * BYTE));
+    __m256i result = _mm256_or_si256(_mm256_max_epu8(canvas, bmp), opaque);
+    _mm256_storeu_si256((__m256i*)(canvas_row + pixel * BYTE), result);
+  }
+  _mm256_zeroupper();
+  blendLightenSse2(canvas_row + pixel * BYTE, bmp_row + pixel * BYTE, pixel_count - pixel);
+}
+#endif
+
+void initializeBlendKernels(void)
+{
+  const BlendKernels scalar = {"scalar",
+                               {blendNormalScalar, blendMultiplyScalar, blendSubtractScalar, blendScreenScalar,
+                                blendOverlayScalar, blendAdditiveScalar, blendDarkenScalar, blendLightenScalar},
+                               blendPremultipliedScalar};
+  selected_kernels = scalar;
+#ifdef BLEND_HAS_X86
+  const char* limit = getenv(BLEND_KERNELS_ENVIRONMENT);
+  if (limit != NULL && strcmp(limit, "scalar") == 0)
+  {
+    return;
+  }
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && (limit == NULL || strcmp(limit, "sse2") != 0))
+  {
+    const BlendKernels avx2 = {"avx2",
+                               {blendNormalAvx2, blendMultiplyAvx2, blendSubtractAvx2, blendScreenAvx2,
+                                blendOverlayAvx2, blendAdditiveAvx2, blendDarkenAvx2, blendLightenAvx2},
+                               blendPremultipliedAvx2};
+    selected_kernels = avx2;
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    const BlendKernels sse2 = {"sse2",
+                               {blendNormalSse2, blendMultiplySse2, blendSubtractSse2, blendScreenSse2,
+                                blendOverlaySse2, blendAdditiveSse2, blendDarkenSse2, blendLightenSse2},
+                               blendPremultipliedSse2};
+    selected_kernels = sse2;
+  }
+#endif
+}
+
+BlendRowFunction getBlendRowFunction(char blend_mode)
+{
+  if (selected_kernels.name_ == NULL)
+  {
+    initializeBlendKernels();
+  }
+  for (int mode = 0; mode < BLEND_MODES_COUNT; mode++)
+  {
+    if (blend_modes[mode] == blend_mode)
+    {
+      return selected_kernels.rows_[mode];
+    }
+  }
+  return NULL;
+}
+
+void premultiplyRow(uint16_t* destination, const unsigned char* bmp_row, int pixel_count)
+{
+  for (int pixel = 0; pixel < pixel_count; pixel++)
+  {
+    const unsigned char* bmp = bmp_row + pixel * BYTE;
+    uint16_t* premultiplied = destination + pixel * BYTE;
+    unsigned alpha = bmp[ALPHA_CHANNEL];
+    premultiplied[0] = (uint16_t)(alpha * bmp[0]);
+    premultiplied[1] = (uint16_t)(alpha * bmp[1]);
+    premultiplied[2] = (uint16_t)(alpha * bmp[2]);
+    premultiplied[ALPHA_CHANNEL] = (uint16_t)(OPAQUE - alpha);
+  }
+}
+
+PremultipliedRowFunction getPremultipliedRowFunction(void)
+{
+  if (selected_kernels.name_ == NULL)
+  {
+    initializeBlendKernels();
+  }
+  return selected_kernels.premultiplied_;
+}
+
+const char* getBlendKernelName(void)
+{
+  if (selected_kernels.name_ == NULL)
+  {
+    initializeBlendKernels();
+  }
+  return selected_kernels.name_;
+}
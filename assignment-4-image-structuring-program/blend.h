@@ -0,0 +1,70 @@
+//----------------------------------------------------------------------------------------------------------------------
+/// Contains the row kernels that blend BMP pixels onto the canvas. Every blend mode has a scalar version and, on x86,
+/// SSE2 and AVX2 versions. The fastest one the CPU supports is selected once at startup, and a layer looks up the
+/// kernel of its blend mode once when it is placed.
+///
+/// Author: 12326821
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifndef A4_CSF_BLEND_H
+#define A4_CSF_BLEND_H
+
+#include <stdint.h>
+
+#define BLEND_MODE_N 'n'
+#define BLEND_MODE_M 'm'
+#define BLEND_MODE_S 's'
+#define BLEND_MODE_E 'e'
+#define BLEND_MODE_O 'o'
+#define BLEND_MODE_A 'a'
+#define BLEND_MODE_D 'd'
+#define BLEND_MODE_L 'l'
+
+#define BLEND_KERNELS_ENVIRONMENT "A4_CSF_BLEND_KERNELS"
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Blends one row of BGRA pixels onto one row of the canvas. The canvas alpha is always set to 255.
+/// @param canvas_row First canvas pixel of the row, gets overwritten with the result.
+/// @param bmp_row First BMP pixel of the row.
+/// @param pixel_count Number of pixels to blend.
+typedef void (*BlendRowFunction)(unsigned char* canvas_row, const unsigned char* bmp_row, int pixel_count);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Blends one row of premultiplied pixels onto one row of the canvas in normal mode, see premultiplyRow().
+///        Gives the same bytes as the normal mode BlendRowFunction. The program does not keep premultiplied copies of
+///        its BMPs, because blend-bench shows these kernels no faster than the normal mode ones; the benchmark still
+///        measures them.
+/// @param canvas_row First canvas pixel of the row, gets overwritten with the result.
+/// @param bmp_row First premultiplied pixel of the row.
+/// @param pixel_count Number of pixels to blend.
+typedef void (*PremultipliedRowFunction)(unsigned char* canvas_row, const uint16_t* bmp_row, int pixel_count);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Converts one row of BGRA pixels to the premultiplied format, four 16 bit values per pixel holding
+///        alpha * B, alpha * G, alpha * R and 255 - alpha. Normal mode then needs one multiply-add per channel.
+/// @param destination First premultiplied pixel of the row.
+/// @param bmp_row First BMP pixel of the row.
+/// @param pixel_count Number of pixels to convert.
+void premultiplyRow(uint16_t* destination, const unsigned char* bmp_row, int pixel_count);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Detects the CPU features and selects the kernels. The environment variable A4_CSF_BLEND_KERNELS can be set
+///        to "scalar" or "sse2" to limit the selection.
+void initializeBlendKernels(void);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Returns the selected kernel for a blend mode.
+/// @param blend_mode One of the BLEND_MODE letters: normal, multiply, subtract, screen (e), overlay, additive,
+///        darken or lighten.
+/// @return The kernel or NULL if the blend mode is unknown.
+BlendRowFunction getBlendRowFunction(char blend_mode);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Returns the selected normal mode kernel for premultiplied pixels.
+PremultipliedRowFunction getPremultipliedRowFunction(void);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Returns the name of the selected instruction set, "scalar", "sse2" or "avx2".
+const char* getBlendKernelName(void);
+
+#endif //A4_CSF_BLEND_H
@@ -0,0 +1,207 @@
+//----------------------------------------------------------------------------------------------------------------------
+/// Contains the decoders that expand 24-bit, 8-bit paletted and RLE8 compressed BMP pixels into BGRA rows.
+///
+/// Author: 12326821
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "decode.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DECODE_HAS_X86
+#include <immintrin.h>
+#endif
+
+#define BYTE 4
+#define RGB_BYTES 3
+#define OPAQUE_ALPHA 0xFF000000u
+#define SSSE3_PIXELS 4
+#define SSSE3_LOAD_PIXELS 6
+#define RLE_ESCAPE 0
+#define RLE_END_OF_LINE 0
+#define RLE_END_OF_BITMAP 1
+#define RLE_DELTA 2
+#define RLE_MAXIMUM_RUN 255
+#define RLE_COMMAND_BYTES 2
+#define RLE_DELTA_BYTES 4
+
+typedef void (*DecodeRowFunction)(unsigned char* destination, const unsigned char* source, int width);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Expands one row of 24-bit pixels.
+/// @param destination BGRA row.
+/// @param source BGR row.
+/// @param width Width in pixels.
+static void decodeRow24Scalar(unsigned char* destination, const unsigned char* source, int width)
+{
+  for (int x = 0; x < width; x++)
+  {
+    destination[x * BYTE] = source[x * RGB_BYTES];
+    destination[x * BYTE + 1] = source[x * RGB_BYTES + 1];
+    destination[x * BYTE + 2] = source[x * RGB_BYTES + 2];
+    destination[x * BYTE + 3] = 255;
+  }
+}
+
+#ifdef DECODE_HAS_X86
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Expands one row of 24-bit pixels, four at a time with a byte shuffle. A load reads 16 bytes for 12 bytes of
+///        pixels, so the last pixels of the row are left to the scalar loop to never read past the row.
+/// @param destination BGRA row.
+/// @param source BGR row.
+/// @param width Width in pixels.
+__attribute__((target("ssse3")))
+static void decodeRow24Ssse3(unsigned char* destination, const unsigned char* source, int width)
+{
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i alpha = _mm_set1_epi32((int)OPAQUE_ALPHA);
+  int x = 0;
+  for (; x + SSSE3_LOAD_PIXELS <= width; x += SSSE3_PIXELS)
+  {
+    __m128i pixels = _mm_loadu_si128((const __m128i*)(source + x * RGB_BYTES));
+    pixels = _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), alpha);
+    _mm_storeu_si128((__m128i*)(destination + x * BYTE), pixels);
+  }
+  decodeRow24Scalar(destination + x * BYTE, source + x * RGB_BYTES, width - x);
+}
+#endif
+
+static DecodeRowFunction decode_row_24 = decodeRow24Scalar;
+
+void initializeDecoders(void)
+{
+#ifdef DECODE_HAS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3"))
+  {
+    decode_row_24 = decodeRow24Ssse3;
+  }
+#endif
+}
+
+size_t getStoredRowSize(int width, int bits_per_pixel)
+{
+  return ((size_t)width * bits_per_pixel + 31) / 32 * 4;
+}
+
+void buildPalette(uint32_t palette[PALETTE_SIZE], const unsigned char* colors, int colors_count)
+{
+  for (int index = 0; index < PALETTE_SIZE; index++)
+  {
+    palette[index] = OPAQUE_ALPHA;
+    if (index < colors_count)
+    {
+      const unsigned char* color = colors + index * BYTE;
+      palette[index] |= (uint32_t)color[0] | (uint32_t)color[1] << 8 | (uint32_t)color[2] << 16;
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Expands one row of palette indices.
+/// @param destination BGRA row.
+/// @param source Index row.
+/// @param width Width in pixels.
+/// @param palette Lookup table.
+static void decodeRow8(unsigned char* destination, const unsigned char* source, int width, const uint32_t* palette)
+{
+  for (int x = 0; x < width; x++)
+  {
+    memcpy(destination + x * BYTE, &palette[source[x]], BYTE);
+  }
+}
+
+void decodeRows(unsigned char* destination, const unsigned char* source, ptrdiff_t source_stride, int width, int rows,
+                const uint32_t* palette)
+{
+  size_t row_size = (size_t)width * BYTE;
+  for (int y = 0; y < rows; y++)
+  {
+    const unsigned char* source_row = source + (ptrdiff_t)y * source_stride;
+    if (palette != NULL)
+    {
+      decodeRow8(destination + y * row_size, source_row, width, palette);
+    }
+    else
+    {
+      decode_row_24(destination + y * row_size, source_row, width);
+    }
+  }
+}
+
+size_t getRle8PixelLimit(size_t source_size, int width)
+{
+  // a run covers 255 pixels and an end of line at most a whole row, a delta moves at most 255 rows and 255 columns
+  size_t command_limit = width > RLE_MAXIMUM_RUN ? (size_t)width : RLE_MAXIMUM_RUN;
+  size_t delta_limit = (size_t)RLE_MAXIMUM_RUN * width + RLE_MAXIMUM_RUN;
+  size_t deltas = source_size / RLE_DELTA_BYTES;
+  if (deltas > SIZE_MAX / delta_limit - 1)
+  {
+    return SIZE_MAX;
+  }
+  // per byte a delta covers the most, so the limit is reached with deltas and one command in the remaining bytes
+  return deltas * delta_limit + (source_size % RLE_DELTA_BYTES >= RLE_COMMAND_BYTES ? command_limit : 0);
+}
+
+int decodeRle8(unsigned char* destination, int width, int rows, const unsigned char* source, size_t source_size,
+               const uint32_t* palette)
+{
+  size_t row_size = (size_t)width * BYTE;
+  memset(destination, 0, row_size * rows);
+  size_t position = 0;
+  int x = 0;
+  int y = rows - 1;
+  while (position + 1 < source_size && y >= 0)
+  {
+    int count = source[position];
+    int value = source[position + 1];
+    position += 2;
+    unsigned char* row = destination + y * row_size;
+    if (count != RLE_ESCAPE)
+    {
+      for (; count > 0 && x < width; count--, x++)
+      {
+        memcpy(row + x * BYTE, &palette[value], BYTE);
+      }
+    }
+    else if (value == RLE_END_OF_LINE)
+    {
+      x = 0;
+      y--;
+    }
+    else if (value == RLE_END_OF_BITMAP)
+    {
+      return 0;
+    }
+    else if (value == RLE_DELTA)
+    {
+      if (position + 1 >= source_size)
+      {
+        return -1;
+      }
+      x += source[position];
+      y -= source[position + 1];
+      position += 2;
+      // a delta past the last column ends the bitmap, so x never runs away from the row
+      if (x > width)
+      {
+        return 0;
+      }
+    }
+    else
+    {
+      // absolute mode: value literal indices, padded to an even number of bytes
+      if (position + value > source_size)
+      {
+        return -1;
+      }
+      for (int index = 0; index < value && x < width; index++, x++)
+      {
+        memcpy(row + x * BYTE, &palette[source[position + index]], BYTE);
+      }
+      position += (value + 1) & ~1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,72 @@
+//----------------------------------------------------------------------------------------------------------------------
+/// Contains the decoders that expand 24-bit, 8-bit paletted and RLE8 compressed BMP pixels into BGRA rows. 32-bit
+/// BMPs are already stored that way and are used without decoding.
+///
+/// Author: 12326821
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifndef A4_CSF_DECODE_H
+#define A4_CSF_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BMP_COMPRESSION_RGB 0
+#define BMP_COMPRESSION_RLE8 1
+#define PALETTE_SIZE 256
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Detects the CPU features and selects the 24-bit decoder.
+void initializeDecoders(void);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Gets the size of one stored row, rows are padded to a multiple of 4 bytes.
+/// @param width Width in pixels.
+/// @param bits_per_pixel Bits per pixel.
+/// @return Row size in bytes.
+size_t getStoredRowSize(int width, int bits_per_pixel);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Builds the lookup table of an 8-bit BMP. Every entry is an opaque BGRA pixel, indices without a palette
+///        entry are black.
+/// @param palette Receives PALETTE_SIZE pixels.
+/// @param colors The BGRX palette entries of the file.
+/// @param colors_count Number of palette entries.
+void buildPalette(uint32_t palette[PALETTE_SIZE], const unsigned char* colors, int colors_count);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Expands uncompressed 24-bit or 8-bit rows into opaque BGRA rows.
+/// @param destination First BGRA row, rows follow each other from the top.
+/// @param source First stored row.
+/// @param source_stride Distance between stored rows from the top, negative for bottom-up files.
+/// @param width Width in pixels.
+/// @param rows Number of rows.
+/// @param palette Lookup table for 8-bit rows, NULL for 24-bit rows.
+void decodeRows(unsigned char* destination, const unsigned char* source, ptrdiff_t source_stride, int width, int rows,
+                const uint32_t* palette);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Gets the most pixels that RLE8 data of the given size can describe. A two byte run covers at most 255
+///        pixels, an end of line at most one row, and a four byte delta at most 255 rows and 255 columns. Literal runs
+///        need more bytes than a run. Bigger headers are rejected, so a small file cannot ask for a buffer that it
+///        could not reach.
+/// @param source_size Size of the compressed data.
+/// @param width Width in pixels.
+/// @return The number of pixels, SIZE_MAX if it does not fit.
+size_t getRle8PixelLimit(size_t source_size, int width);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Expands bottom-up RLE8 data into BGRA rows. Pixels the data skips (with a delta or an early end of line)
+///        stay transparent, pixels past the end of a row are dropped. Decoding stops like at the end of the bitmap
+///        when a delta moves past the last column or row.
+/// @param destination First BGRA row, rows follow each other from the top.
+/// @param width Width in pixels.
+/// @param rows Number of rows.
+/// @param source The compressed data.
+/// @param source_size Size of the compressed data.
+/// @param palette Lookup table of the file.
+/// @return 0 if the data was valid, -1 if it ends inside a delta or a literal run.
+int decodeRle8(unsigned char* destination, int width, int rows, const unsigned char* source, size_t source_size,
+               const uint32_t* palette);
+
+#endif //A4_CSF_DECODE_H
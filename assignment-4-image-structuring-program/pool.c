@@ -0,0 +1,161 @@
+//----------------------------------------------------------------------------------------------------------------------
+/// Contains a small fixed size thread pool that runs a number of independent tasks and waits for all of them.
+///
+/// Author: 12326821
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct _Thread_Pool_
+{
+  pthread_t* threads_;
+  int thread_count_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t work_ready_;
+  pthread_cond_t work_done_;
+  unsigned long generation_;
+  int busy_workers_;
+  int shutdown_;
+  PoolTask task_;
+  void* context_;
+  int task_count_;
+  atomic_int next_task_;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Takes tasks of the current job until none are left.
+/// @param pool The pool.
+static void runTasks(ThreadPool* pool)
+{
+  int task_index;
+  while ((task_index = atomic_fetch_add(&pool->next_task_, 1)) < pool->task_count_)
+  {
+    pool->task_(pool->context_, task_index);
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Main function of a worker thread, waits for jobs until the pool shuts down.
+/// @param argument The pool.
+/// @return Always NULL.
+static void* workerMain(void* argument)
+{
+  ThreadPool* pool = argument;
+  unsigned long seen_generation = 0;
+  pthread_mutex_lock(&pool->mutex_);
+  while (1)
+  {
+    while (!pool->shutdown_ && pool->generation_ == seen_generation)
+    {
+      pthread_cond_wait(&pool->work_ready_, &pool->mutex_);
+    }
+    if (pool->shutdown_)
+    {
+      break;
+    }
+    seen_generation = pool->generation_;
+    pthread_mutex_unlock(&pool->mutex_);
+    runTasks(pool);
+    pthread_mutex_lock(&pool->mutex_);
+    if (--pool->busy_workers_ == 0)
+    {
+      pthread_cond_signal(&pool->work_done_);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex_);
+  return NULL;
+}
+
+ThreadPool* createThreadPool(int thread_count)
+{
+  if (thread_count <= 0)
+  {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = online > 0 ? (int)online : 1;
+  }
+  ThreadPool* pool = calloc(1, sizeof(ThreadPool));
+  if (pool == NULL)
+  {
+    return NULL;
+  }
+  pool->threads_ = calloc(thread_count, sizeof(pthread_t));
+  if (pool->threads_ == NULL)
+  {
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->mutex_, NULL);
+  pthread_cond_init(&pool->work_ready_, NULL);
+  pthread_cond_init(&pool->work_done_, NULL);
+  for (int index = 0; index < thread_count - 1; index++)
+  {
+    if (pthread_create(&pool->threads_[index], NULL, workerMain, pool) != 0)
+    {
+      freeThreadPool(pool);
+      return NULL;
+    }
+    pool->thread_count_++;
+  }
+  return pool;
+}
+
+void runThreadPool(ThreadPool* pool, PoolTask task, void* context, int task_count)
+{
+  if (pool == NULL || pool->thread_count_ == 0 || task_count <= 1)
+  {
+    for (int task_index = 0; task_index < task_count; task_index++)
+    {
+      task(context, task_index);
+    }
+    return;
+  }
+  pthread_mutex_lock(&pool->mutex_);
+  pool->task_ = task;
+  pool->context_ = context;
+  pool->task_count_ = task_count;
+  atomic_store(&pool->next_task_, 0);
+  pool->busy_workers_ = pool->thread_count_;
+  pool->generation_++;
+  pthread_cond_broadcast(&pool->work_ready_);
+  pthread_mutex_unlock(&pool->mutex_);
+
+  runTasks(pool);
+
+  pthread_mutex_lock(&pool->mutex_);
+  while (pool->busy_workers_ > 0)
+  {
+    pthread_cond_wait(&pool->work_done_, &pool->mutex_);
+  }
+  pthread_mutex_unlock(&pool->mutex_);
+}
+
+int getThreadPoolSize(ThreadPool* pool)
+{
+  return pool == NULL ? 1 : pool->thread_count_ + 1;
+}
+
+void freeThreadPool(ThreadPool* pool)
+{
+  if (pool == NULL)
+  {
+    return;
+  }
+  pthread_mutex_lock(&pool->mutex_);
+  pool->shutdown_ = 1;
+  pthread_cond_broadcast(&pool->work_ready_);
+  pthread_mutex_unlock(&pool->mutex_);
+  for (int index = 0; index < pool->thread_count_; index++)
+  {
+    pthread_join(pool->threads_[index], NULL);
+  }
+  pthread_mutex_destroy(&pool->mutex_);
+  pthread_cond_destroy(&pool->work_ready_);
+  pthread_cond_destroy(&pool->work_done_);
+  free(pool->threads_);
+  free(pool);
+}
@@ -0,0 +1,44 @@
+//----------------------------------------------------------------------------------------------------------------------
+/// Contains a small fixed size thread pool that runs a number of independent tasks and waits for all of them.
+///
+/// Author: 12326821
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifndef A4_CSF_POOL_H
+#define A4_CSF_POOL_H
+
+#define THREADS_ENVIRONMENT "A4_CSF_THREADS"
+
+typedef struct _Thread_Pool_ ThreadPool;
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Runs one task of a job.
+/// @param context The context given to runThreadPool().
+/// @param task_index Index of the task, from 0 to task_count - 1.
+typedef void (*PoolTask)(void* context, int task_index);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Creates a thread pool. The calling thread takes part in every job, so thread_count - 1 threads are started.
+/// @param thread_count Total number of threads, 0 picks the number of online CPUs.
+/// @return The pool or NULL if memory allocation or thread creation failed.
+ThreadPool* createThreadPool(int thread_count);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Runs task_count tasks on the pool and returns once all of them are done. Without a pool the tasks run on
+///        the calling thread.
+/// @param pool The pool, may be NULL.
+/// @param task Function that runs one task.
+/// @param context Passed to every task.
+/// @param task_count Number of tasks.
+void runThreadPool(ThreadPool* pool, PoolTask task, void* context, int task_count);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Returns the total number of threads including the calling thread, 1 for a NULL pool.
+int getThreadPoolSize(ThreadPool* pool);
+
+//----------------------------------------------------------------------------------------------------------------------
+/// @brief Stops the threads and frees the pool.
+/// @param pool The pool, may be NULL.
+void freeThreadPool(ThreadPool* pool);
+
+#endif //A4_CSF_POOL_H